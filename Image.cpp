@@ -6,6 +6,371 @@
 #include "stb_image_write.h"
 
 #include <iostream>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <zlib.h>
+#include "parallel.h"
+
+namespace {
+
+//OpenEXR scanline file, little-endian like the x86 and ARM hosts
+const int exr_lines_per_block = 16;   //of ZIP_COMPRESSION
+
+template <typename T> void PutValue(std::vector<unsigned char> &out, T value)
+{
+  const unsigned char *bytes = reinterpret_cast<const unsigned char*>(&value);
+  out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+void PutString(std::vector<unsigned char> &out, const char *text)
+{
+  out.insert(out.end(), text, text + strlen(text) + 1);
+}
+
+void PutAttribute(std::vector<unsigned char> &out, const char *name, const char *type, const std::vector<unsigned char> &value)
+{
+  PutString(out, name);
+  PutString(out, type);
+  PutValue(out, int32_t(value.size()));
+  out.insert(out.end(), value.begin(), value.end());
+}
+
+//ZIP_COMPRESSION of a block: the bytes split into the even and the odd ones, delta coded, then zlib; a block that
+//does not shrink is stored as it is, which readers tell by its size
+std::vector<unsigned char> CompressEXRBlock(const std::vector<unsigned char> &raw)
+{
+  size_t size = raw.size();
+  std::vector<unsigned char> reordered(size);
+  size_t half = (size + 1) / 2;
+  for (size_t i = 0; i < size; i++)
+    reordered[(i & 1) ? half + i / 2 : i / 2] = raw[i];
+  int previous = size > 0 ? reordered[0] : 0;
+  for (size_t i = 1; i < size; i++) {
+    int current = reordered[i];
+    reordered[i] = (unsigned char)((current - previous + (128 + 256)) & 0xff);
+    previous = current;
+  }
+  int compressed_size = 0;
+  unsigned char *compressed = stbi_zlib_compress(reordered.data(), int(size), &compressed_size, stbi_write_png_compression_level);
+  std::vector<unsigned char> block;
+  if (compressed != nullptr && size_t(compressed_size) < size)
+    block.assign(compressed, compressed + compressed_size);
+  else
+    block = raw;
+  STBIW_FREE(compressed);
+  return block;
+}
+
+//portable float map: a text header, then the RGB floats row by row from the bottom up, as kept in memory
+int SavePFM(const std::string &a_path, int width, int height, const std::vector<float> &radiance)
+{
+  if (radiance.empty()) {
+    std::cerr << "No radiance to save in " << a_path << "\n";
+    return 1;
+  }
+  std::ofstream file(a_path, std::ios::binary);
+  file << "PF\n" << width << " " << height << "\n-1.0\n";   //a negative scale marks little-endian floats
+  file.write(reinterpret_cast<const char*>(radiance.data()), std::streamsize(radiance.size() * sizeof(float)));
+  if (!file) {
+    std::cerr << "Cannot write " << a_path << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+//OpenEXR with 32-bit float B, G and R channels; the blocks of 16 scanlines are compressed on all threads
+int SaveEXR(const std::string &a_path, int width, int height, const std::vector<float> &radiance)
+{
+  if (radiance.empty()) {
+    std::cerr << "No radiance to save in " << a_path << "\n";
+    return 1;
+  }
+  std::vector<unsigned char> header;
+  PutValue(header, uint32_t(20000630));   //magic number
+  PutValue(header, uint32_t(2));          //version 2, single part scanline file
+  std::vector<unsigned char> value;
+  const char *channel_names[3] = { "B", "G", "R" };   //in alphabetical order
+  for (int c = 0; c < 3; c++) {
+    PutString(value, channel_names[c]);
+    PutValue(value, int32_t(2));          //FLOAT
+    PutValue(value, uint32_t(0));         //pLinear and reserved
+    PutValue(value, int32_t(1));          //x and y sampling
+    PutValue(value, int32_t(1));
+  }
+  value.push_back(0);
+  PutAttribute(header, "channels", "chlist", value);
+  PutAttribute(header, "compression", "compression", std::vector<unsigned char>(1, 3));   //ZIP_COMPRESSION
+  value.clear();
+  PutValue(value, int32_t(0));
+  PutValue(value, int32_t(0));
+  PutValue(value, int32_t(width - 1));
+  PutValue(value, int32_t(height - 1));
+  PutAttribute(header, "dataWindow", "box2i", value);
+  PutAttribute(header, "displayWindow", "box2i", value);
+  PutAttribute(header, "lineOrder", "lineOrder", std::vector<unsigned char>(1, 0));     //INCREASING_Y
+  value.clear();
+  PutValue(value, 1.0f);
+  PutAttribute(header, "pixelAspectRatio", "float", value);
+  PutAttribute(header, "screenWindowWidth", "float", value);
+  value.clear();
+  PutValue(value, 0.0f);
+  PutValue(value, 0.0f);
+  PutAttribute(header, "screenWindowCenter", "v2f", value);
+  header.push_back(0);
+
+  //a block holds its scanlines top down, each as all its B values, then G, then R
+  size_t block_count = (size_t(height) + exr_lines_per_block - 1) / exr_lines_per_block;
+  std::vector<std::vector<unsigned char>> blocks(block_count);
+  ParallelFor(0, block_count, [&](size_t block) {
+    int first_line = int(block) * exr_lines_per_block;
+    int line_count = std::min(exr_lines_per_block, height - first_line);
+    std::vector<unsigned char> raw(size_t(line_count) * width * 3 * sizeof(float));
+    float *out = reinterpret_cast<float*>(raw.data());
+    for (int line = first_line; line < first_line + line_count; line++) {
+      const float *row = &radiance[3 * size_t(width) * (height - 1 - line)];
+      for (int c = 2; c >= 0; c--)
+        for (int x = 0; x < width; x++)
+          *out++ = row[3 * x + c];
+    }
+    blocks[block] = CompressEXRBlock(raw);
+  }, 1);
+
+  std::vector<unsigned char> offsets;
+  uint64_t offset = header.size() + block_count * sizeof(uint64_t);
+  for (size_t block = 0; block < block_count; block++) {
+    PutValue(offsets, offset);
+    offset += 2 * sizeof(int32_t) + blocks[block].size();
+  }
+  std::ofstream file(a_path, std::ios::binary);
+  file.write(reinterpret_cast<const char*>(header.data()), std::streamsize(header.size()));
+  file.write(reinterpret_cast<const char*>(offsets.data()), std::streamsize(offsets.size()));
+  for (size_t block = 0; block < block_count; block++) {
+    int32_t chunk[2] = { int32_t(block * exr_lines_per_block), int32_t(blocks[block].size()) };
+    file.write(reinterpret_cast<const char*>(chunk), sizeof(chunk));
+    file.write(reinterpret_cast<const char*>(blocks[block].data()), std::streamsize(blocks[block].size()));
+  }
+  if (!file) {
+    std::cerr << "Cannot write " << a_path << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+//_______png written in stripes of rows, filtered and deflated on all threads_______
+//every stripe is a raw deflate stream primed with the last 32KB of the stripe before it and ended with a sync
+//flush (the last one with the final block), so the stripes simply follow each other in one zlib stream; the adler32
+//checksums of the stripes are combined and every stripe is an IDAT chunk of its own
+
+const int png_min_stripe_rows = 16;
+const int png_deflate_level = 2;   //higher zlib levels take several times longer and gain little on rendered images
+
+void PutBigEndian(std::vector<unsigned char> &out, uint32_t value)
+{
+  unsigned char bytes[4] = { (unsigned char)(value >> 24), (unsigned char)(value >> 16), (unsigned char)(value >> 8), (unsigned char)value };
+  out.insert(out.end(), bytes, bytes + 4);
+}
+
+void PutPNGChunk(std::vector<unsigned char> &out, const char *type, const unsigned char *chunk_data, size_t size)
+{
+  PutBigEndian(out, uint32_t(size));
+  size_t start = out.size();
+  out.insert(out.end(), type, type + 4);
+  out.insert(out.end(), chunk_data, chunk_data + size);
+  PutBigEndian(out, uint32_t(crc32(0, &out[start], uInt(out.size() - start))));
+}
+
+int Paeth(int a, int b, int c)
+{
+  int p = a + b - c;
+  int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+  if (pa <= pb && pa <= pc)
+    return a;
+  return pb <= pc ? b : c;
+}
+
+//the filter of a row is chosen as by stb: the one whose bytes, taken as signed, have the smallest absolute sum; the
+//first row has no row above, which the filters read as zeros
+void FilterPNGRow(const unsigned char *row, const unsigned char *above, int row_bytes, int pixel_bytes, unsigned char *out, unsigned char *candidate)
+{
+  int best_sum = -1;
+  for (int filter = 0; filter < 5; filter++) {
+    if (above == nullptr && filter > 1)   //up, average and paeth would only repeat none and sub
+      break;
+    switch (filter) {
+      case 0:
+        memcpy(candidate, row, row_bytes);
+        break;
+      case 1:
+        memcpy(candidate, row, pixel_bytes);
+        for (int i = pixel_bytes; i < row_bytes; i++)
+          candidate[i] = (unsigned char)(row[i] - row[i - pixel_bytes]);
+        break;
+      case 2:
+        for (int i = 0; i < row_bytes; i++)
+          candidate[i] = (unsigned char)(row[i] - above[i]);
+        break;
+      case 3:
+        for (int i = 0; i < pixel_bytes; i++)
+          candidate[i] = (unsigned char)(row[i] - (above[i] >> 1));
+        for (int i = pixel_bytes; i < row_bytes; i++)
+          candidate[i] = (unsigned char)(row[i] - ((row[i - pixel_bytes] + above[i]) >> 1));
+        break;
+      default:
+        for (int i = 0; i < pixel_bytes; i++)
+          candidate[i] = (unsigned char)(row[i] - above[i]);
+        for (int i = pixel_bytes; i < row_bytes; i++)
+          candidate[i] = (unsigned char)(row[i] - Paeth(row[i - pixel_bytes], above[i], above[i - pixel_bytes]));
+    }
+    int sum = 0;
+    for (int i = 0; i < row_bytes; i++)
+      sum += std::abs(int((signed char)candidate[i]));
+    if (best_sum < 0 || sum < best_sum) {
+      best_sum = sum;
+      out[0] = (unsigned char)filter;
+      memcpy(out + 1, candidate, row_bytes);
+    }
+  }
+}
+
+int SavePNG(const std::string &a_path, int width, int height, int channels, const unsigned char *top_row, ptrdiff_t stride)
+{
+  static const unsigned char color_types[5] = { 0, 0, 4, 2, 6 };   //gray, gray and alpha, rgb, rgba by channels
+  if (width <= 0 || height <= 0 || channels < 1 || channels > 4) {
+    std::cerr << "Cannot write " << a_path << " as png\n";
+    return 1;
+  }
+  int row_bytes = width * channels;
+  size_t filtered_row_bytes = size_t(row_bytes) + 1;
+  int stripe_rows = std::max(png_min_stripe_rows, int((height + 4 * GetThreadCount() - 1) / (4 * GetThreadCount())));
+  size_t stripe_count = (size_t(height) + stripe_rows - 1) / stripe_rows;
+
+  std::vector<std::vector<unsigned char>> filtered(stripe_count);
+  std::vector<uLong> adlers(stripe_count);
+  ParallelFor(0, stripe_count, [&](size_t stripe) {
+    int first_row = int(stripe) * stripe_rows;
+    int row_count = std::min(stripe_rows, height - first_row);
+    filtered[stripe].resize(row_count * filtered_row_bytes);
+    std::vector<unsigned char> candidate(row_bytes);
+    for (int y = first_row; y < first_row + row_count; y++)
+      FilterPNGRow(top_row + y * stride, y > 0 ? top_row + (y - 1) * stride : nullptr, row_bytes, channels,
+                   &filtered[stripe][(y - first_row) * filtered_row_bytes], candidate.data());
+    adlers[stripe] = adler32(adler32(0, nullptr, 0), filtered[stripe].data(), uInt(filtered[stripe].size()));
+  }, 1);
+
+  std::vector<std::vector<unsigned char>> deflated(stripe_count);
+  std::atomic<bool> deflated_all(true);
+  ParallelFor(0, stripe_count, [&](size_t stripe) {
+    z_stream stream = {};
+    bool last = stripe + 1 == stripe_count;
+    if (deflateInit2(&stream, png_deflate_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      deflated_all = false;
+      return;
+    }
+    if (stripe > 0) {
+      const std::vector<unsigned char> &previous = filtered[stripe - 1];
+      size_t window = std::min(previous.size(), size_t(32768));
+      deflateSetDictionary(&stream, previous.data() + previous.size() - window, uInt(window));
+    }
+    std::vector<unsigned char> &out = deflated[stripe];
+    out.resize(deflateBound(&stream, uLong(filtered[stripe].size())) + 16);   //a sync flush adds an empty stored block
+    stream.next_in = filtered[stripe].data();
+    stream.avail_in = uInt(filtered[stripe].size());
+    stream.next_out = out.data();
+    stream.avail_out = uInt(out.size());
+    int status = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    //output left in the stream for want of space would be lost
+    if (status != (last ? Z_STREAM_END : Z_OK) || stream.avail_in != 0 || stream.avail_out == 0)
+      deflated_all = false;
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+  }, 1);
+  if (!deflated_all) {
+    std::cerr << "Cannot compress " << a_path << "\n";
+    return 1;
+  }
+
+  uLong adler = adlers[0];
+  for (size_t stripe = 1; stripe < stripe_count; stripe++)
+    adler = adler32_combine(adler, adlers[stripe], z_off_t(filtered[stripe].size()));
+  deflated[0].insert(deflated[0].begin(), { 0x78, 0x5e });   //zlib header: deflate, 32KB window, fast compression
+  std::vector<unsigned char> checksum;
+  PutBigEndian(checksum, uint32_t(adler));
+  deflated.back().insert(deflated.back().end(), checksum.begin(), checksum.end());
+
+  static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+  std::vector<unsigned char> header(signature, signature + 8);
+  std::vector<unsigned char> image_header;
+  PutBigEndian(image_header, uint32_t(width));
+  PutBigEndian(image_header, uint32_t(height));
+  image_header.insert(image_header.end(), { 8, color_types[channels], 0, 0, 0 });   //8 bits, no interlace
+  PutPNGChunk(header, "IHDR", image_header.data(), image_header.size());
+  std::vector<std::vector<unsigned char>> chunks(stripe_count);
+  ParallelFor(0, stripe_count, [&](size_t stripe) {
+    PutPNGChunk(chunks[stripe], "IDAT", deflated[stripe].data(), deflated[stripe].size());
+  }, 1);
+  std::vector<unsigned char> end;
+  PutPNGChunk(end, "IEND", nullptr, 0);
+
+  std::ofstream file(a_path, std::ios::binary);
+  file.write(reinterpret_cast<const char*>(header.data()), std::streamsize(header.size()));
+  for (size_t stripe = 0; stripe < stripe_count; stripe++)
+    file.write(reinterpret_cast<const char*>(chunks[stripe].data()), std::streamsize(chunks[stripe].size()));
+  file.write(reinterpret_cast<const char*>(end.data()), std::streamsize(end.size()));
+  if (!file) {
+    std::cerr << "Cannot write " << a_path << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+//the rows are kept from the bottom up and written from the top down: the png encoder walks them with a negative
+//stride, the jpeg one has no stride and gets a copy in file order
+int SavePixels(const std::string &a_path, const std::string &extension, int width, int height, int channels, const Pixel *data)
+{
+  int row_bytes = width * channels;
+  const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data);
+  if(extension == ".png" || extension == ".PNG")
+  {
+    return SavePNG(a_path, width, height, channels, bytes + size_t(height - 1) * row_bytes, -ptrdiff_t(row_bytes));
+  }
+  else if(extension == ".jpg" || extension == ".JPG" || extension == ".jpeg" || extension == ".JPEG")
+  {
+    std::vector<unsigned char> top_down(size_t(height) * row_bytes);
+    for (int i = 0; i < height; i++)
+      memcpy(&top_down[size_t(i) * row_bytes], bytes + size_t(height - 1 - i) * row_bytes, row_bytes);
+    stbi_write_jpg(a_path.c_str(), width, height, channels, top_down.data(), 100);
+  }
+  else
+  {
+    std::cerr << "Unknown file extension: " << extension << " in file name " << a_path << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+int SaveFile(const std::string &a_path, int width, int height, int channels, const Pixel *data, const std::vector<float> &radiance)
+{
+  auto extPos = a_path.find_last_of('.');
+  std::string extension = extPos == std::string::npos ? std::string() : a_path.substr(extPos);
+  if (extension == ".pfm" || extension == ".PFM")
+    return SavePFM(a_path, width, height, radiance);
+  if (extension == ".exr" || extension == ".EXR")
+    return SaveEXR(a_path, width, height, radiance);
+  return SavePixels(a_path, extension, width, height, channels, data);
+}
+
+}
+
+void Image::PutRadiance(int x, int y, float r, float g, float b)
+{
+  float *pixel = &radiance[3 * (size_t(width) * y + x)];
+  pixel[0] = r;
+  pixel[1] = g;
+  pixel[2] = b;
+}
 
 void Image::AddPixel(int x, int y, const Pixel &pix) {
     data[width * (height - y - 1) + x].r = data[width * (height - y - 1) + x].r * (1 - pix.a/255) + pix.r * pix.a/255;
@@ -33,45 +398,80 @@ Image::Image(int a_width, int a_height, int a_channels)
     size = a_width * a_height * a_channels;
     channels = a_channels;
     self_allocated = true;
+    radiance.assign(3 * size_t(a_width) * a_height, 0.0f);
   }
 }
 
 
-int Image::Save(const std::string &a_path)
+int Image::Save(const std::string &a_path) const
 {
-  Pixel pix;
-  for (int i = 0; i < height / 2; i++){
-    for (int j = 0; j < width; j++) {
-    pix = data[i * width + j];
-    data[i * width + j] = data[(height - i) * width + j];
-    data[(height - i) * width + j] = pix;
-    }
-  }
-  auto extPos = a_path.find_last_of('.');
-  if(a_path.substr(extPos, std::string::npos) == ".png" || a_path.substr(extPos, std::string::npos) == ".PNG")
+  return SaveFile(a_path, width, height, channels, data, radiance);
+}
+
+Image::~Image()
+{
+  if(self_allocated)
+    delete [] data;
+  else
   {
-    stbi_write_png(a_path.c_str(), width, height, channels, data, width * channels);
+    stbi_image_free(data);
   }
-  else if(a_path.substr(extPos, std::string::npos) == ".jpg" || a_path.substr(extPos, std::string::npos) == ".JPG" ||
-          a_path.substr(extPos, std::string::npos) == ".jpeg" || a_path.substr(extPos, std::string::npos) == ".JPEG")
+}
+
+//_______background writer________________________________________________________
+
+ImageWriter::ImageWriter() : writer(&ImageWriter::WriterLoop, this) {}
+
+ImageWriter::~ImageWriter()
+{
   {
-    stbi_write_jpg(a_path.c_str(), width, height, channels, data, 100);
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
   }
-  else
+  requested.notify_all();
+  writer.join();
+}
+
+std::future<int> ImageWriter::Save(const Image &image, const std::string &a_path)
+{
+  std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>();
+  snapshot->width = image.width;
+  snapshot->height = image.height;
+  snapshot->channels = image.channels;
+  snapshot->pixels.assign(image.data, image.data + size_t(image.width) * image.height);
+  snapshot->radiance = image.radiance;
+  std::packaged_task<int()> task([snapshot, a_path] {
+    return SaveFile(a_path, snapshot->width, snapshot->height, snapshot->channels, snapshot->pixels.data(), snapshot->radiance);
+  });
+  std::future<int> result = task.get_future();
   {
-    std::cerr << "Unknown file extension: " << a_path.substr(extPos, std::string::npos) << "in file name" << a_path << "\n";
-    return 1;
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.push_back(std::move(task));
   }
+  requested.notify_one();
+  return result;
+}
 
-  return 0;
+void ImageWriter::Wait()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  written.wait(lock, [this] { return queue.empty() && !busy; });
 }
 
-Image::~Image()
+void ImageWriter::WriterLoop()
 {
-  if(self_allocated)
-    delete [] data;
-  else
-  {
-    stbi_image_free(data);
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    requested.wait(lock, [this] { return stopping || !queue.empty(); });
+    if (queue.empty())      //stopping only once everything queued is written
+      return;
+    std::packaged_task<int()> task = std::move(queue.front());
+    queue.pop_front();
+    busy = true;
+    lock.unlock();
+    task();
+    lock.lock();
+    busy = false;
+    written.notify_all();
   }
 }
@@ -2,6 +2,13 @@
 #define MAIN_IMAGE_H
 
 #include <string>
+#include <vector>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
 
 struct Pixel
 {
@@ -17,7 +24,7 @@ struct Image {
   explicit Image(const std::string &a_path);
   Image(int a_width, int a_height, int a_channels);
 
-  int Save(const std::string &a_path);
+  int Save(const std::string &a_path) const;
 
   int Width()    const { return width; }
   int Height()   const { return height; }
@@ -29,15 +36,51 @@ struct Image {
   void PutPixel(int x, int y, const Pixel &pix) { data[width * y + x] = pix; }
   void AddPixel(int x, int y, const Pixel &pix);
 
+  //linear RGB of the pixels as rendered, before the 8-bit conversion, for the HDR formats
+  //(.pfm uncompressed, .exr with ZIP-compressed blocks of 16 scanlines); only images made with a size have it
+  void PutRadiance(int x, int y, float r, float g, float b);
+  const float* Radiance() const { return radiance.data(); }
+
   ~Image();
 
 private:
+  friend class ImageWriter;
   int width = -1;
   int height = -1;
   int channels = 3;
   size_t size = 0;
   Pixel *data = nullptr;
   bool self_allocated = false;
+  std::vector<float> radiance;    //rows from the bottom up, like data
+};
+
+//saves images on a background I/O thread, one after another: Save copies the image and returns at once, so that
+//the next frame can be rendered into it while the previous one is compressed and written
+class ImageWriter {
+  struct Snapshot {
+    int width;
+    int height;
+    int channels;
+    std::vector<Pixel> pixels;
+    std::vector<float> radiance;
+  };
+  std::deque<std::packaged_task<int()>> queue;
+  bool busy = false;
+  bool stopping = false;
+  std::mutex mutex;
+  std::condition_variable requested;
+  std::condition_variable written;
+  std::thread writer;
+  void WriterLoop();
+public:
+  ImageWriter();
+  ImageWriter(const ImageWriter&) = delete;
+  ImageWriter& operator=(const ImageWriter&) = delete;
+  //writes whatever is still queued
+  ~ImageWriter();
+  //the result of Image::Save once the file is written
+  std::future<int> Save(const Image &image, const std::string &a_path);
+  void Wait();
 };
 
 #endif //MAIN_IMAGE_H
\ No newline at end of file
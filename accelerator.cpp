@@ -0,0 +1,57 @@
+#include "accelerator.h"
+
+void Accelerator::Build(const std::vector<AABB>& primitive_bounds, const AcceleratorOptions& options) {
+    //the structures of the other types are released so that only one is kept in memory
+    type = options.type;
+    if (type != ACCELERATOR_BVH)
+        bvh = BVH();
+    if (type != ACCELERATOR_GRID)
+        grid = UniformGrid();
+    if (type != ACCELERATOR_KDTREE)
+        kdtree = KDTree();
+    if (type == ACCELERATOR_GRID)
+        grid.Build(primitive_bounds, options.grid);
+    else if (type == ACCELERATOR_KDTREE)
+        kdtree.Build(primitive_bounds, options.kdtree);
+    else
+        bvh.Build(primitive_bounds, options.bvh);
+}
+
+bool Accelerator::Refit(const std::vector<AABB>& slot_bounds) {
+    if (type != ACCELERATOR_BVH || !bvh.CanRefit())
+        return false;
+    bvh.Refit(slot_bounds);
+    return true;
+}
+
+const char* Accelerator::GetName() const {
+    if (type == ACCELERATOR_GRID)
+        return "grid";
+    if (type == ACCELERATOR_KDTREE)
+        return "kd-tree";
+    return "bvh";
+}
+
+AABB Accelerator::GetBounds() const {
+    if (type == ACCELERATOR_GRID)
+        return grid.GetBounds();
+    if (type == ACCELERATOR_KDTREE)
+        return kdtree.GetBounds();
+    return bvh.GetBounds();
+}
+
+size_t Accelerator::GetMemoryUsage() const {
+    if (type == ACCELERATOR_GRID)
+        return grid.GetMemoryUsage();
+    if (type == ACCELERATOR_KDTREE)
+        return kdtree.GetMemoryUsage();
+    return bvh.GetMemoryUsage();
+}
+
+const std::vector<uint32_t>& Accelerator::GetPrimitiveIndices() const {
+    if (type == ACCELERATOR_GRID)
+        return grid.GetPrimitiveIndices();
+    if (type == ACCELERATOR_KDTREE)
+        return kdtree.GetPrimitiveIndices();
+    return bvh.GetPrimitiveIndices();
+}
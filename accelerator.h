@@ -0,0 +1,66 @@
+#ifndef ACCELERATOR_H
+#define ACCELERATOR_H
+
+#include <vector>
+#include <cstdint>
+#include "bvh.h"
+#include "grid.h"
+#include "kdtree.h"
+
+enum AcceleratorType {
+    ACCELERATOR_BVH,
+    ACCELERATOR_GRID,
+    ACCELERATOR_KDTREE
+};
+
+struct AcceleratorOptions {
+    AcceleratorType type = ACCELERATOR_BVH;
+    BVHBuildOptions bvh;
+    GridBuildOptions grid;
+    KDTreeBuildOptions kdtree;
+    AcceleratorOptions() {}
+    AcceleratorOptions(const BVHBuildOptions& in_bvh) : bvh(in_bvh) {}
+    AcceleratorOptions(AcceleratorType in_type) : type(in_type) {}
+};
+
+//_______one of the acceleration structures behind the BVH query contract_____
+//every back-end hands out slots through GetPrimitiveIndices() and calls intersect(slot, tmax) from Traverse
+
+class Accelerator {
+    AcceleratorType type = ACCELERATOR_BVH;
+    BVH bvh;
+    UniformGrid grid;
+    KDTree kdtree;
+public:
+    void Build(const std::vector<AABB>& primitive_bounds, const AcceleratorOptions& options = AcceleratorOptions());
+    //only an uncompressed BVH can be refitted; returns false when the owner has to rebuild instead
+    bool Refit(const std::vector<AABB>& slot_bounds);
+    AcceleratorType GetType() const { return type; }
+    const char* GetName() const;
+    AABB GetBounds() const;
+    size_t GetMemoryUsage() const;
+    float GetCost() const { return bvh.GetCost(); }
+    float GetBuildCost() const { return bvh.GetBuildCost(); }
+    const std::vector<uint32_t>& GetPrimitiveIndices() const;
+    template <typename Intersector> bool Traverse(const vec3f& origin, const vec3f& direction, float& tmax, Intersector intersect) const;
+    //the BVH takes the precomputed inverse direction of the ray, the grid and the kd-tree set up their own walk
+    template <typename Intersector> bool Traverse(const Ray& ray, float& tmax, Intersector intersect) const;
+};
+
+template <typename Intersector> bool Accelerator::Traverse(const vec3f& origin, const vec3f& direction, float& tmax, Intersector intersect) const {
+    if (type == ACCELERATOR_GRID)
+        return grid.Traverse(origin, direction, tmax, intersect);
+    if (type == ACCELERATOR_KDTREE)
+        return kdtree.Traverse(origin, direction, tmax, intersect);
+    return bvh.Traverse(origin, direction, tmax, intersect);
+}
+
+template <typename Intersector> bool Accelerator::Traverse(const Ray& ray, float& tmax, Intersector intersect) const {
+    if (type == ACCELERATOR_GRID)
+        return grid.Traverse(ray.GetStartingPoint(), ray.GetDirection(), tmax, intersect);
+    if (type == ACCELERATOR_KDTREE)
+        return kdtree.Traverse(ray.GetStartingPoint(), ray.GetDirection(), tmax, intersect);
+    return bvh.Traverse(ray, tmax, intersect);
+}
+
+#endif
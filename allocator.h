@@ -0,0 +1,48 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+//_______allocator for over-aligned types (std::allocator ignores alignas before C++17)_____
+
+template <typename T, size_t alignment> struct AlignedAllocator {
+    typedef T value_type;
+    template <typename U> struct rebind { typedef AlignedAllocator<U, alignment> other; };
+
+    AlignedAllocator() {}
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, alignment>&) {}
+
+    T* allocate(size_t n) {
+        void* ptr = nullptr;
+#ifdef _WIN32
+        ptr = _aligned_malloc(n * sizeof(T), alignment);
+#else
+        if (posix_memalign(&ptr, alignment, n * sizeof(T)) != 0)
+            ptr = nullptr;
+#endif
+        if (ptr == nullptr)
+            throw std::bad_alloc();
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, size_t) {
+#ifdef _WIN32
+        _aligned_free(ptr);
+#else
+        free(ptr);
+#endif
+    }
+};
+
+template <typename T, typename U, size_t alignment>
+bool operator==(const AlignedAllocator<T, alignment>&, const AlignedAllocator<U, alignment>&) { return true; }
+
+template <typename T, typename U, size_t alignment>
+bool operator!=(const AlignedAllocator<T, alignment>&, const AlignedAllocator<U, alignment>&) { return false; }
+
+#endif
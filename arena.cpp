@@ -0,0 +1,101 @@
+#include <cstdlib>
+#include "arena.h"
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace {
+
+const size_t huge_page_size = size_t(2) << 20;
+
+size_t RoundUp(size_t value, size_t multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+}
+
+Arena::Block Arena::NewBlock(size_t size) const {
+    Block block{ nullptr, size, false };
+    if (options.huge_pages) {
+        block.size = RoundUp(size, huge_page_size);
+#if defined(MAP_HUGETLB)
+        //pages reserved by the administrator (vm.nr_hugepages), usually none
+        void* mapped = mmap(nullptr, block.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mapped != MAP_FAILED) {
+            block.data = static_cast<char*>(mapped);
+            block.mapped = true;
+        }
+#endif
+    }
+    if (block.data == nullptr) {
+        void* ptr = nullptr;
+        size_t alignment = options.huge_pages ? huge_page_size : 64;
+#ifdef _WIN32
+        ptr = _aligned_malloc(block.size, alignment);
+#else
+        if (posix_memalign(&ptr, alignment, block.size) != 0)
+            ptr = nullptr;
+#endif
+        if (ptr == nullptr)
+            throw std::bad_alloc();
+#if defined(MADV_HUGEPAGE)
+        //a 2MB-aligned range the kernel backs with transparent huge pages where it can
+        if (options.huge_pages)
+            madvise(ptr, block.size, MADV_HUGEPAGE);
+#endif
+        block.data = static_cast<char*>(ptr);
+    }
+    return block;
+}
+
+void* Arena::Allocate(size_t size, size_t alignment) {
+    if (!blocks.empty()) {
+        const Block& block = blocks.back();
+        size_t offset = RoundUp(size_t(block.data) + used, alignment) - size_t(block.data);
+        if (offset + size <= block.size) {
+            used = offset + size;
+            return block.data + offset;
+        }
+    }
+    //blocks are at least 64-byte aligned, larger alignments may need a little slack
+    size_t block_size = size + (alignment > 64 ? alignment : 0);
+    if (block_size > options.block_size && !blocks.empty()) {
+        //a large array gets a block of its own, the current block stays open for the small requests
+        Block block = NewBlock(block_size);
+        blocks.insert(blocks.end() - 1, block);
+        return block.data + (RoundUp(size_t(block.data), alignment) - size_t(block.data));
+    }
+    blocks.push_back(NewBlock(block_size > options.block_size ? block_size : options.block_size));
+    used = 0;
+    return Allocate(size, alignment);
+}
+
+void Arena::Release() {
+    for (size_t i = finalizers.size(); i-- > 0;)
+        finalizers[i].destroy(finalizers[i].object);
+    finalizers.clear();
+    for (size_t i = 0; i < blocks.size(); i++) {
+#if defined(MAP_HUGETLB)
+        if (blocks[i].mapped) {
+            munmap(blocks[i].data, blocks[i].size);
+            continue;
+        }
+#endif
+#ifdef _WIN32
+        _aligned_free(blocks[i].data);
+#else
+        free(blocks[i].data);
+#endif
+    }
+    blocks.clear();
+    used = 0;
+}
+
+size_t Arena::GetMemoryUsage() const {
+    size_t total = 0;
+    for (size_t i = 0; i < blocks.size(); i++)
+        total += blocks[i].size;
+    return total;
+}
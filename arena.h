@@ -0,0 +1,68 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+//_______monotonic arena: objects are carved out of large blocks and all released at once_______
+//nothing is freed individually; destructors of the created objects run in reverse order of creation when the arena
+//is released or destroyed. With huge_pages the blocks are backed by 2MB pages (MAP_HUGETLB, else transparent huge
+//pages through madvise, else plain pages), so that large traversed arrays need few TLB entries
+
+struct ArenaOptions {
+    size_t block_size = size_t(1) << 20;   //a request bigger than this gets a block of its own
+    bool huge_pages = false;               //blocks are rounded up to 2MB
+};
+
+class Arena {
+    struct Block {
+        char* data;
+        size_t size;
+        bool mapped;        //explicit huge pages, released with munmap
+    };
+    struct Finalizer {
+        void (*destroy)(void*);
+        void* object;
+    };
+    ArenaOptions options;
+    std::vector<Block> blocks;
+    size_t used = 0;        //bytes taken from the last block
+    std::vector<Finalizer> finalizers;
+    template <typename T> static void Destroy(void* object) { static_cast<T*>(object) -> ~T(); }
+    Block NewBlock(size_t size) const;
+public:
+    Arena(const ArenaOptions& in_options = ArenaOptions()) : options(in_options) {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena() { Release(); }
+    void* Allocate(size_t size, size_t alignment);
+    //constructs a T in the arena, destroyed together with it
+    template <typename T, typename... Args> T* Create(Args&&... args);
+    //copies count trivially copyable elements into the arena
+    template <typename T> T* Copy(const T* source, size_t count, size_t alignment = alignof(T));
+    //runs the destructors and returns all blocks to the system
+    void Release();
+    size_t GetMemoryUsage() const;
+    bool UsesHugePages() const { return options.huge_pages; }
+};
+
+template <typename T, typename... Args> T* Arena::Create(Args&&... args) {
+    T* object = new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    if (!std::is_trivially_destructible<T>::value)
+        finalizers.push_back(Finalizer{ &Arena::Destroy<T>, object });
+    return object;
+}
+
+template <typename T> T* Arena::Copy(const T* source, size_t count, size_t alignment) {
+    static_assert(std::is_trivially_copyable<T>::value, "only raw data is copied into an arena");
+    T* copy = static_cast<T*>(Allocate(count * sizeof(T), alignment));
+    if (count > 0)
+        memcpy(copy, source, count * sizeof(T));
+    return copy;
+}
+
+#endif
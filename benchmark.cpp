@@ -0,0 +1,148 @@
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <atomic>
+
+#include "geometry.h"
+#include "ray.h"
+#include "objects.h"
+#include "accelerator.h"
+#include "parallel.h"
+#include "dispatch.h"
+
+//compares the acceleration back-ends on the same primitives: build time, memory and rays per second
+//usage: benchmark [primitive count] [image size]
+
+namespace {
+
+//a dense field of similar spheres, the favourable case for a uniform grid
+std::vector<Sphere> MakeSphereField(Material* material, size_t count, std::mt19937& generator) {
+    std::uniform_real_distribution<float> position(-50.0f, 50.0f);
+    std::uniform_real_distribution<float> radius(0.3f, 0.5f);
+    std::vector<Sphere> spheres;
+    for (size_t i = 0; i < count; i++) {
+        vec3f center(position(generator), position(generator), position(generator));
+        spheres.push_back(Sphere(material, center, radius(generator)));
+    }
+    return spheres;
+}
+
+void AddQuad(std::vector<Polygon>& polygons, const vec3f& a, const vec3f& b, const vec3f& c, const vec3f& d) {
+    polygons.push_back(Polygon(a, b, c));
+    polygons.push_back(Polygon(a, c, d));
+}
+
+//an architecture-like scene: a big floor with boxes of very different sizes made of large and small triangles
+std::vector<Polygon> MakeBlocks(size_t count, std::mt19937& generator) {
+    std::uniform_real_distribution<float> position(-100.0f, 100.0f);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::vector<Polygon> polygons;
+    AddQuad(polygons, vec3f(-120, -120, 0), vec3f(120, -120, 0), vec3f(120, 120, 0), vec3f(-120, 120, 0));
+    while (polygons.size() + 12 <= count) {
+        float size = 0.2f + 8.0f * unit(generator) * unit(generator);
+        float height = size * (0.5f + 4.0f * unit(generator));
+        vec3f low(position(generator), position(generator), 0.0f);
+        vec3f high = low + vec3f(size, size, height);
+        vec3f corner[8];
+        for (unsigned i = 0; i < 8; i++)
+            corner[i] = vec3f(i & 1 ? high.x : low.x, i & 2 ? high.y : low.y, i & 4 ? high.z : low.z);
+        AddQuad(polygons, corner[0], corner[1], corner[3], corner[2]);
+        AddQuad(polygons, corner[4], corner[5], corner[7], corner[6]);
+        AddQuad(polygons, corner[0], corner[1], corner[5], corner[4]);
+        AddQuad(polygons, corner[2], corner[3], corner[7], corner[6]);
+        AddQuad(polygons, corner[0], corner[2], corner[6], corner[4]);
+        AddQuad(polygons, corner[1], corner[3], corner[7], corner[5]);
+    }
+    return polygons;
+}
+
+//primary rays of a pinhole camera looking at the scene from above one corner
+struct PinholeView {
+    vec3f eye;
+    vec3f forward;
+    vec3f right;
+    vec3f up;
+};
+
+//placed from the primitives themselves, not from the bounds of an accelerator (the grid rounds them up to whole
+//cells), so that every back-end traces the same rays
+template <typename Primitive> PinholeView MakeView(const std::vector<Primitive>& primitives) {
+    AABB scene_bounds;
+    for (size_t i = 0; i < primitives.size(); i++)
+        scene_bounds.Extend(primitives[i].GetBounds());
+    PinholeView view;
+    vec3f center = scene_bounds.Center();
+    view.eye = center + vec3f(-0.6f, -0.8f, 0.5f) * scene_bounds.Extent().norm();
+    view.forward = (center - view.eye).normalize();
+    view.right = cross(view.forward, vec3f(0.0f, 0.0f, 1.0f)).normalize();
+    view.up = cross(view.right, view.forward);
+    return view;
+}
+
+template <typename Primitive> void RunBenchmark(const char* scene_name, const std::vector<Primitive>& primitives, const PinholeView& view,
+                                                AcceleratorType type, unsigned image_size) {
+    std::vector<AABB> bounds;
+    for (size_t i = 0; i < primitives.size(); i++)
+        bounds.push_back(primitives[i].GetBounds());
+
+    Accelerator accelerator;
+    auto build_start = std::chrono::steady_clock::now();
+    accelerator.Build(bounds, AcceleratorOptions(type));
+    auto build_end = std::chrono::steady_clock::now();
+    const std::vector<uint32_t>& slots = accelerator.GetPrimitiveIndices();
+
+    std::atomic<size_t> hit_count(0);
+    auto trace_start = std::chrono::steady_clock::now();
+    ParallelFor(0, size_t(image_size) * image_size, [&](size_t pixel) {
+        float u = (float(pixel % image_size) + 0.5f) / image_size - 0.5f;
+        float v = (float(pixel / image_size) + 0.5f) / image_size - 0.5f;
+        Ray ray(view.forward + view.right * u + view.up * v, view.eye, 1.0f, 0);
+        vec3f hitpoint, normal;
+        Side side;
+        float tmax = std::numeric_limits<float>::max();
+        bool hit = accelerator.Traverse(ray, tmax, [&](uint32_t slot, float& closest) {
+            if (primitives[slots[slot]].Hitted(ray, hitpoint, normal, side)) {
+                float distance = (hitpoint - ray.GetStartingPoint()).norm();
+                if (distance < closest) {
+                    closest = distance;
+                    return true;
+                }
+            }
+            return false;
+        });
+        if (hit)
+            hit_count++;
+    }, 1024);
+    auto trace_end = std::chrono::steady_clock::now();
+
+    double build_ms = std::chrono::duration<double, std::milli>(build_end - build_start).count();
+    double trace_s = std::chrono::duration<double>(trace_end - trace_start).count();
+    printf("%-8s %-8s %10.1f %10.2f %12.2f %10zu\n", scene_name, accelerator.GetName(), build_ms,
+           accelerator.GetMemoryUsage() / (1024.0 * 1024.0), double(image_size) * image_size / trace_s * 1e-6, size_t(hit_count));
+}
+
+}
+
+int main(int argc, char** argv) {
+    size_t primitive_count = argc > 1 ? size_t(atol(argv[1])) : 100000;
+    unsigned image_size = argc > 2 ? unsigned(atoi(argv[2])) : 512;
+    vec3f grey(0.5f, 0.5f, 0.5f);
+    DiffuseMaterial material(grey);
+    std::mt19937 generator(1);
+
+    std::vector<Sphere> spheres = MakeSphereField(&material, primitive_count, generator);
+    std::vector<Polygon> blocks = MakeBlocks(primitive_count, generator);
+
+    printf("%zu primitives, %ux%u primary rays, %u threads, %s kernels\n", primitive_count, image_size, image_size, GetThreadCount(), GetKernels().name);
+    printf("%-8s %-8s %10s %10s %12s %10s\n", "scene", "type", "build ms", "memory MB", "Mrays/s", "hits");
+    AcceleratorType types[] = { ACCELERATOR_BVH, ACCELERATOR_GRID, ACCELERATOR_KDTREE };
+    PinholeView sphere_view = MakeView(spheres);
+    PinholeView block_view = MakeView(blocks);
+    for (unsigned i = 0; i < 3; i++)
+        RunBenchmark("spheres", spheres, sphere_view, types[i], image_size);
+    for (unsigned i = 0; i < 3; i++)
+        RunBenchmark("blocks", blocks, block_view, types[i], image_size);
+    return 0;
+}
@@ -0,0 +1,1115 @@
+#include <numeric>
+#include <cassert>
+#include <future>
+
+#include "bvh.h"
+#include "geometry.h"
+#include "parallel.h"
+
+float AABB::SurfaceArea() const {
+    if (Empty())
+        return 0.0f;
+    vec3f extent = Extent();
+    return 2 * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+unsigned AABB::LargestAxis() const {
+    vec3f extent = Extent();
+    if (extent.x >= extent.y && extent.x >= extent.z)
+        return 0;
+    return extent.y >= extent.z ? 1 : 2;
+}
+
+size_t BVH::GetNodeCount() const {
+    if (external_nodes != nullptr)
+        return external_node_count;
+    if (quantization_bits == 8)
+        return width == 8 ? quantized8_8.size() : quantized4_8.size();
+    if (quantization_bits == 16)
+        return width == 8 ? quantized8_16.size() : quantized4_16.size();
+    return width == 8 ? nodes8.size() : (width == 4 ? nodes4.size() : nodes.size());
+}
+
+size_t BVH::GetMemoryUsage() const {
+    return nodes.capacity() * sizeof(BVHNode) + nodes4.capacity() * sizeof(WideBVHNode<4>) + nodes8.capacity() * sizeof(WideBVHNode<8>) +
+           quantized4_8.capacity() * sizeof(QuantizedBVHNode<4, uint8_t>) + quantized4_16.capacity() * sizeof(QuantizedBVHNode<4, uint16_t>) +
+           quantized8_8.capacity() * sizeof(QuantizedBVHNode<8, uint8_t>) + quantized8_16.capacity() * sizeof(QuantizedBVHNode<8, uint16_t>) +
+           primitive_indices.capacity() * sizeof(uint32_t);
+}
+
+//_______binned SAH builder________________________________
+//subtrees are written into a 2n-1 node array where every subtree of k primitives owns 2k-1 slots,
+//so that tasks can fill disjoint ranges without synchronisation; the gaps are squeezed out afterwards
+
+namespace {
+
+const unsigned max_bin_count = 32;
+const uint32_t parallel_threshold = 1 << 16;    //ranges above this are binned and partitioned by several threads
+const uint32_t task_threshold = 1 << 12;        //ranges above this build one of their subtrees as a separate task
+const float traversal_cost = 1.0f;              //relative to the cost of one primitive intersection
+const uint32_t max_leaf_primitives = std::numeric_limits<uint16_t>::max();   //the count of a BVHNode
+
+//whether a range has to be halved so that every leaf below it still fits max_leaf_primitives when the depth limit
+//is reached: halving keeps count <= max_leaf_primitives << remaining_depth all the way down
+bool MustHalve(uint32_t count, unsigned remaining_depth) {
+    return remaining_depth <= 32 && uint64_t(count) > (uint64_t(max_leaf_primitives) << (remaining_depth - 1));
+}
+
+struct Bin {
+    AABB bounds;
+    uint32_t count;
+};
+
+unsigned BinIndex(float centroid, float centroid_min, float scale, unsigned bin_count) {
+    int bin = int((centroid - centroid_min) * scale);
+    return std::min(unsigned(std::max(bin, 0)), bin_count - 1);
+}
+
+}
+
+//per-task scratch space, only the bins of the current node are reset
+struct BVH::Binning {
+    Bin bins[3][max_bin_count];
+    void Reset(unsigned bin_count) {
+        for (unsigned axis = 0; axis < 3; axis++) {
+            for (unsigned i = 0; i < bin_count; i++) {
+                bins[axis][i].bounds = AABB();
+                bins[axis][i].count = 0;
+            }
+        }
+    }
+    void Extend(const Binning& binning, unsigned bin_count) {
+        for (unsigned axis = 0; axis < 3; axis++) {
+            for (unsigned i = 0; i < bin_count; i++) {
+                bins[axis][i].bounds.Extend(binning.bins[axis][i].bounds);
+                bins[axis][i].count += binning.bins[axis][i].count;
+            }
+        }
+    }
+};
+
+//primitive bounds are partitioned by value so that the passes over a range stay sequential in memory
+struct BVH::Reference {
+    AABB bounds;
+    uint32_t primitive;
+    float Centroid(unsigned axis) const { return (bounds.min[axis] + bounds.max[axis]) * 0.5f; }
+};
+
+struct BVH::ObjectSplit {
+    float cost;
+    unsigned axis;
+    unsigned split;
+    AABB left_bounds;
+    AABB right_bounds;
+    uint32_t left_count;
+};
+
+struct BVH::SpatialSplit {
+    float cost;
+    unsigned axis;
+    float position;
+};
+
+struct BVH::BuildContext {
+    std::vector<Reference> references;
+    std::vector<Reference> scratch_references;
+    std::vector<uint8_t> used;
+    const BVHBuildOptions& options;
+    unsigned thread_count;
+    unsigned task_depth;
+    const PrimitiveClipper* clipper;
+    float root_area;
+    BuildContext(const BVHBuildOptions& in_options) : options(in_options) {}
+};
+
+//_______quantization of the wide nodes________________________
+
+namespace {
+
+//smallest power of two exponent whose scale spans [lower, upper] in max_code steps
+int QuantizationExponent(float lower, float upper, uint32_t max_code) {
+    int exponent;
+    std::frexp((upper - lower) / max_code, &exponent);
+    exponent = std::max(exponent, -126);
+    while (exponent < 127 && lower + float(max_code) * ExponentToScale(exponent) < upper)
+        exponent++;
+    return exponent;
+}
+
+template <unsigned wide, typename Quantized> void Quantize(const std::vector<WideBVHNode<wide>, AlignedAllocator<WideBVHNode<wide>, 64>>& wide_nodes,
+                                                          std::vector<QuantizedBVHNode<wide, Quantized>, AlignedAllocator<QuantizedBVHNode<wide, Quantized>, 64>>& quantized_nodes) {
+    const uint32_t max_code = std::numeric_limits<Quantized>::max();
+    quantized_nodes.resize(wide_nodes.size());
+    ParallelFor(0, wide_nodes.size(), [&](size_t index) {
+        const WideBVHNode<wide>& node = wide_nodes[index];
+        QuantizedBVHNode<wide, Quantized>& quantized = quantized_nodes[index];
+        quantized.child_count = uint8_t(node.child_count);
+        for (unsigned axis = 0; axis < 3; axis++) {
+            float lower = std::numeric_limits<float>::max();
+            float upper = -std::numeric_limits<float>::max();
+            for (unsigned i = 0; i < node.child_count; i++) {
+                lower = std::min(lower, node.bounds_min[axis][i]);
+                upper = std::max(upper, node.bounds_max[axis][i]);
+            }
+            int exponent = QuantizationExponent(lower, upper, max_code);
+            float scale = ExponentToScale(exponent);
+            quantized.origin[axis] = lower;
+            quantized.exponent[axis] = int8_t(exponent);
+            for (unsigned i = 0; i < wide; i++) {
+                if (i >= node.child_count) {
+                    quantized.bounds_min[axis][i] = 0;
+                    quantized.bounds_max[axis][i] = 0;
+                    continue;
+                }
+                //round outwards, then step until the decoded value (same arithmetic as traversal) is conservative
+                float child_min = node.bounds_min[axis][i];
+                float child_max = node.bounds_max[axis][i];
+                uint32_t low_code = uint32_t(std::min(std::max(std::floor((child_min - lower) / scale), 0.0f), float(max_code)));
+                uint32_t high_code = uint32_t(std::min(std::max(std::ceil((child_max - lower) / scale), 0.0f), float(max_code)));
+                while (low_code > 0 && lower + float(low_code) * scale > child_min)
+                    low_code--;
+                while (high_code < max_code && lower + float(high_code) * scale < child_max)
+                    high_code++;
+                quantized.bounds_min[axis][i] = Quantized(low_code);
+                quantized.bounds_max[axis][i] = Quantized(high_code);
+            }
+        }
+        for (unsigned i = 0; i < wide; i++) {
+            quantized.child[i] = node.child[i];
+            quantized.count[i] = node.count[i];
+        }
+    }, 256);
+}
+
+}
+
+void BVH::Build(const std::vector<AABB>& primitive_bounds, const BVHBuildOptions& options, const PrimitiveClipper& clipper) {
+    nodes.clear();
+    nodes4.clear();
+    nodes8.clear();
+    quantized4_8.clear();
+    quantized4_16.clear();
+    quantized8_8.clear();
+    quantized8_16.clear();
+    quantization_bits = 0;
+    external_nodes = nullptr;
+    external_node_count = 0;
+    bounds = AABB();
+    primitive_indices.resize(primitive_bounds.size());
+    std::iota(primitive_indices.begin(), primitive_indices.end(), 0);
+    if (primitive_bounds.empty())
+        return;
+
+    uint32_t primitive_count = primitive_bounds.size();
+    BuildContext context(options);
+    context.thread_count = GetThreadCount();
+    context.task_depth = 1;
+    while ((1u << context.task_depth) < 4 * context.thread_count)
+        context.task_depth++;
+    context.references.resize(primitive_count);
+
+    //bounds of all primitives, reduced over per-thread partial results
+    unsigned chunk_count = std::min(context.thread_count, primitive_count / parallel_threshold + 1);
+    std::vector<AABB> partial_bounds(chunk_count);
+    ParallelForChunks(0, primitive_count, chunk_count, [&](unsigned chunk, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            context.references[i].bounds = primitive_bounds[i];
+            context.references[i].primitive = i;
+            partial_bounds[chunk].Extend(primitive_bounds[i]);
+        }
+    });
+    for (unsigned chunk = 0; chunk < chunk_count; chunk++)
+        bounds.Extend(partial_bounds[chunk]);
+
+    Binning binning;
+    if (options.spatial_splits) {
+        PrimitiveClipper box_clipper = [&primitive_bounds](uint32_t primitive, unsigned, float, float) { return primitive_bounds[primitive]; };
+        context.clipper = clipper ? &clipper : &box_clipper;
+        context.root_area = bounds.SurfaceArea();
+        primitive_indices.clear();
+        BuildSpatialRecursive(context, binning, context.references, 1, bounds);
+        nodes.shrink_to_fit();
+    } else {
+        context.scratch_references.resize(primitive_count);
+        context.used.assign(2 * primitive_count - 1, 0);
+        nodes.resize(2 * primitive_count - 1);
+        BuildRecursive(context, binning, 0, primitive_count, 0, 1, bounds);
+        for (uint32_t i = 0; i < primitive_count; i++)
+            primitive_indices[i] = context.references[i].primitive;
+
+        //squeeze out the slots that the subtrees did not need, the depth-first order is kept
+        std::vector<uint32_t> new_index(nodes.size());
+        uint32_t node_count = 0;
+        for (uint32_t i = 0; i < nodes.size(); i++) {
+            if (context.used[i])
+                new_index[i] = node_count++;
+        }
+        for (uint32_t i = 0; i < nodes.size(); i++) {
+            if (!context.used[i])
+                continue;
+            BVHNode node = nodes[i];
+            if (!node.IsLeaf())
+                node.offset = new_index[node.offset];
+            nodes[new_index[i]] = node;
+        }
+        nodes.resize(node_count);
+        nodes.shrink_to_fit();
+    }
+
+    cost = ComputeCost();
+    build_cost = cost;
+    width = options.width;
+    if (width == 4)
+        Collapse<4>(nodes4);
+    else if (width == 8)
+        Collapse<8>(nodes8);
+    else
+        width = 2;
+
+    //the compressed tree replaces both the binary and the float wide nodes
+    if (width != 2 && (options.quantization_bits == 8 || options.quantization_bits == 16)) {
+        quantization_bits = options.quantization_bits;
+        if (width == 4 && quantization_bits == 8)
+            Quantize(nodes4, quantized4_8);
+        else if (width == 4)
+            Quantize(nodes4, quantized4_16);
+        else if (quantization_bits == 8)
+            Quantize(nodes8, quantized8_8);
+        else
+            Quantize(nodes8, quantized8_16);
+        std::vector<BVHNode, AlignedAllocator<BVHNode, 64>>().swap(nodes);
+        std::vector<WideBVHNode<4>, AlignedAllocator<WideBVHNode<4>, 64>>().swap(nodes4);
+        std::vector<WideBVHNode<8>, AlignedAllocator<WideBVHNode<8>, 64>>().swap(nodes8);
+    }
+}
+
+size_t BVH::GetNodeSize(unsigned width, unsigned quantization_bits) {
+    if (quantization_bits == 8)
+        return width == 8 ? sizeof(QuantizedBVHNode<8, uint8_t>) : sizeof(QuantizedBVHNode<4, uint8_t>);
+    if (quantization_bits == 16)
+        return width == 8 ? sizeof(QuantizedBVHNode<8, uint16_t>) : sizeof(QuantizedBVHNode<4, uint16_t>);
+    if (width == 8)
+        return sizeof(WideBVHNode<8>);
+    if (width == 4)
+        return sizeof(WideBVHNode<4>);
+    return sizeof(BVHNode);
+}
+
+BVHImage BVH::GetImage() const {
+    BVHImage image;
+    image.width = width;
+    image.quantization_bits = quantization_bits;
+    image.bounds = bounds;
+    image.node_count = GetNodeCount();
+    image.node_size = GetNodeSize(width, quantization_bits);
+    if (quantization_bits == 8)
+        image.nodes = width == 8 ? static_cast<const void*>(GetNodes(quantized8_8)) : GetNodes(quantized4_8);
+    else if (quantization_bits == 16)
+        image.nodes = width == 8 ? static_cast<const void*>(GetNodes(quantized8_16)) : GetNodes(quantized4_16);
+    else if (width == 8)
+        image.nodes = GetNodes(nodes8);
+    else if (width == 4)
+        image.nodes = GetNodes(nodes4);
+    else
+        image.nodes = GetNodes(nodes);
+    return image;
+}
+
+void BVH::Attach(const BVHImage& image) {
+    *this = BVH();
+    width = image.width;
+    quantization_bits = image.quantization_bits;
+    bounds = image.bounds;
+    external_nodes = image.nodes;
+    external_node_count = image.node_count;
+}
+
+float BVH::ComputeCost() const {
+    float area_sum = 0.0f;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        float area = AABB(nodes[i].bounds_min, nodes[i].bounds_max).SurfaceArea();
+        area_sum += nodes[i].IsLeaf() ? area * nodes[i].count : area * traversal_cost;
+    }
+    float root_area = GetBounds().SurfaceArea();
+    return root_area > 0 ? area_sum / root_area : 0.0f;
+}
+
+//_______refitting________________________________________
+//in the depth-first layout every subtree is a contiguous index range whose children come after their parents,
+//so a reverse sweep over the range refits it; disjoint subtrees are swept by different threads
+
+float BVH::RefitSubtree(uint32_t root, const std::vector<AABB>& slot_bounds) {
+    uint32_t last = root;
+    while (!nodes[last].IsLeaf())
+        last = nodes[last].offset;
+    float area_sum = 0.0f;
+    for (uint32_t i = last + 1; i-- > root;) {
+        BVHNode& node = nodes[i];
+        AABB node_bounds;
+        if (node.IsLeaf()) {
+            for (uint32_t slot = node.offset; slot < node.offset + node.count; slot++)
+                node_bounds.Extend(slot_bounds[slot]);
+            area_sum += node_bounds.SurfaceArea() * node.count;
+        } else {
+            node_bounds = AABB(nodes[i + 1].bounds_min, nodes[i + 1].bounds_max);
+            node_bounds.Extend(AABB(nodes[node.offset].bounds_min, nodes[node.offset].bounds_max));
+            area_sum += node_bounds.SurfaceArea() * traversal_cost;
+        }
+        node.bounds_min = node_bounds.min;
+        node.bounds_max = node_bounds.max;
+    }
+    return area_sum;
+}
+
+void BVH::Refit(const std::vector<AABB>& slot_bounds) {
+    assert(CanRefit());
+    assert(slot_bounds.size() == primitive_indices.size());
+    if (nodes.empty())
+        return;
+
+    //cut the tree breadth-first into a few subtrees per thread, the nodes above the cut are refitted last
+    std::vector<uint32_t> subtree_roots(1, 0);
+    std::vector<uint32_t> top_nodes;
+    while (subtree_roots.size() < 4 * GetThreadCount()) {
+        std::vector<uint32_t> next_roots;
+        for (size_t i = 0; i < subtree_roots.size(); i++) {
+            const BVHNode& node = nodes[subtree_roots[i]];
+            if (node.IsLeaf()) {
+                next_roots.push_back(subtree_roots[i]);
+            } else {
+                top_nodes.push_back(subtree_roots[i]);
+                next_roots.push_back(subtree_roots[i] + 1);
+                next_roots.push_back(node.offset);
+            }
+        }
+        if (next_roots.size() == subtree_roots.size())
+            break;
+        subtree_roots.swap(next_roots);
+    }
+
+    std::vector<float> partial_area_sums(subtree_roots.size());
+    ParallelFor(0, subtree_roots.size(), [&](size_t i) {
+        partial_area_sums[i] = RefitSubtree(subtree_roots[i], slot_bounds);
+    }, 1);
+    float area_sum = 0.0f;
+    for (size_t i = 0; i < partial_area_sums.size(); i++)
+        area_sum += partial_area_sums[i];
+
+    std::sort(top_nodes.begin(), top_nodes.end());
+    for (size_t i = top_nodes.size(); i-- > 0;) {
+        BVHNode& node = nodes[top_nodes[i]];
+        AABB node_bounds(nodes[top_nodes[i] + 1].bounds_min, nodes[top_nodes[i] + 1].bounds_max);
+        node_bounds.Extend(AABB(nodes[node.offset].bounds_min, nodes[node.offset].bounds_max));
+        node.bounds_min = node_bounds.min;
+        node.bounds_max = node_bounds.max;
+        area_sum += node_bounds.SurfaceArea() * traversal_cost;
+    }
+    bounds = AABB(nodes[0].bounds_min, nodes[0].bounds_max);
+    float root_area = bounds.SurfaceArea();
+    cost = root_area > 0 ? area_sum / root_area : 0.0f;
+
+    //the wide layer is re-collapsed from the refitted binary tree, which is also linear in the node count
+    if (width == 4) {
+        nodes4.clear();
+        Collapse<4>(nodes4);
+    } else if (width == 8) {
+        nodes8.clear();
+        Collapse<8>(nodes8);
+    }
+}
+
+namespace {
+
+//returns the slot range of the subtree and replaces the ranges emitted by its descendants with a single one
+//when the whole subtree fits
+std::pair<uint32_t, uint32_t> CollectSubtreeSlotRanges(const BVHNode* nodes, uint32_t index, size_t max_slots, std::vector<std::pair<uint32_t, uint32_t>>& ranges) {
+    const BVHNode& node = nodes[index];
+    if (node.IsLeaf()) {
+        ranges.push_back(std::make_pair(node.offset, node.offset + node.count));
+        return ranges.back();
+    }
+    size_t first_range = ranges.size();
+    std::pair<uint32_t, uint32_t> first = CollectSubtreeSlotRanges(nodes, index + 1, max_slots, ranges);
+    std::pair<uint32_t, uint32_t> second = CollectSubtreeSlotRanges(nodes, node.offset, max_slots, ranges);
+    std::pair<uint32_t, uint32_t> range(std::min(first.first, second.first), std::max(first.second, second.second));
+    if (range.second - range.first <= max_slots) {
+        ranges.resize(first_range);
+        ranges.push_back(range);
+    }
+    return range;
+}
+
+}
+
+std::vector<std::pair<uint32_t, uint32_t>> BVH::GetSubtreeSlotRanges(size_t max_slots) const {
+    assert(CanRefit());
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    if (nodes.empty())
+        return ranges;
+    CollectSubtreeSlotRanges(nodes.data(), 0, max_slots, ranges);
+    std::sort(ranges.begin(), ranges.end());
+    return ranges;
+}
+
+void BVH::BinReferences(const Reference* references, size_t count, const AABB& centroid_bounds, const float* scale, unsigned bin_count, Binning& binning) {
+    binning.Reset(bin_count);
+    for (size_t i = 0; i < count; i++) {
+        const AABB& reference_bounds = references[i].bounds;
+        vec3f centroid = reference_bounds.Center();
+        Bin& bin_x = binning.bins[0][BinIndex(centroid.x, centroid_bounds.min.x, scale[0], bin_count)];
+        bin_x.bounds.Extend(reference_bounds);
+        bin_x.count++;
+        Bin& bin_y = binning.bins[1][BinIndex(centroid.y, centroid_bounds.min.y, scale[1], bin_count)];
+        bin_y.bounds.Extend(reference_bounds);
+        bin_y.count++;
+        Bin& bin_z = binning.bins[2][BinIndex(centroid.z, centroid_bounds.min.z, scale[2], bin_count)];
+        bin_z.bounds.Extend(reference_bounds);
+        bin_z.count++;
+    }
+}
+
+//sweeps the bins from both sides to find the cheapest split plane, cost is the unnormalized SAH
+BVH::ObjectSplit BVH::FindObjectSplit(const Binning& binning, const float* scale, unsigned bin_count) {
+    ObjectSplit best;
+    best.cost = std::numeric_limits<float>::max();
+    best.axis = 0;
+    best.split = 0;
+    best.left_count = 0;
+    for (unsigned axis = 0; axis < 3; axis++) {
+        if (scale[axis] == 0)
+            continue;
+        float right_cost[max_bin_count];
+        AABB accumulated;
+        uint32_t accumulated_count = 0;
+        for (unsigned i = bin_count - 1; i > 0; i--) {
+            accumulated.Extend(binning.bins[axis][i].bounds);
+            accumulated_count += binning.bins[axis][i].count;
+            right_cost[i] = accumulated_count > 0 ? accumulated.SurfaceArea() * accumulated_count : -1.0f;
+        }
+        accumulated = AABB();
+        accumulated_count = 0;
+        for (unsigned split = 1; split < bin_count; split++) {
+            accumulated.Extend(binning.bins[axis][split - 1].bounds);
+            accumulated_count += binning.bins[axis][split - 1].count;
+            if (accumulated_count == 0 || right_cost[split] < 0)
+                continue;
+            float cost = accumulated.SurfaceArea() * accumulated_count + right_cost[split];
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.split = split;
+            }
+        }
+    }
+    if (best.cost < std::numeric_limits<float>::max()) {
+        for (unsigned i = 0; i < bin_count; i++) {
+            const Bin& bin = binning.bins[best.axis][i];
+            if (i < best.split) {
+                best.left_bounds.Extend(bin.bounds);
+                best.left_count += bin.count;
+            } else {
+                best.right_bounds.Extend(bin.bounds);
+            }
+        }
+    }
+    return best;
+}
+
+void BVH::BuildRecursive(BuildContext& context, Binning& binning, uint32_t begin, uint32_t end, uint32_t node_index, unsigned depth, const AABB& bounds) {
+    const BVHBuildOptions& options = context.options;
+    uint32_t primitive_count = end - begin;
+    context.used[node_index] = 1;
+    BVHNode node;
+    node.bounds_min = bounds.min;
+    node.bounds_max = bounds.max;
+    node.axis = 0;
+    node.upper_first = 0;
+    node.offset = begin;
+    node.count = primitive_count;
+    if (primitive_count == 1 || depth >= max_depth) {
+        assert(primitive_count <= std::numeric_limits<uint16_t>::max());
+        nodes[node_index] = node;
+        return;
+    }
+
+    //several threads share the passes over large ranges
+    unsigned chunk_count = primitive_count >= parallel_threshold ? std::min(context.thread_count, primitive_count / (parallel_threshold / 4)) : 1;
+    std::vector<AABB> partial_bounds(chunk_count);
+    ParallelForChunks(begin, end, chunk_count, [&](unsigned chunk, size_t chunk_begin, size_t chunk_end) {
+        for (size_t i = chunk_begin; i < chunk_end; i++)
+            partial_bounds[chunk].Extend(context.references[i].bounds.Center());
+    });
+    AABB centroid_bounds;
+    for (unsigned chunk = 0; chunk < chunk_count; chunk++)
+        centroid_bounds.Extend(partial_bounds[chunk]);
+
+    //bin the centroids along all three axes
+    unsigned bin_count = std::min(max_bin_count, std::max(4u, primitive_count));
+    vec3f centroid_extent = centroid_bounds.Extent();
+    float scale[3];
+    for (unsigned axis = 0; axis < 3; axis++)
+        scale[axis] = centroid_extent[axis] > 0 ? bin_count / centroid_extent[axis] : 0.0f;
+    if (chunk_count == 1) {
+        BinReferences(&context.references[begin], primitive_count, centroid_bounds, scale, bin_count, binning);
+    } else {
+        //the first chunk is binned into the task's own binning, the others into extra ones merged into it
+        std::vector<Binning> extra_binnings(chunk_count - 1);
+        ParallelForChunks(begin, end, chunk_count, [&](unsigned chunk, size_t chunk_begin, size_t chunk_end) {
+            Binning& chunk_binning = chunk == 0 ? binning : extra_binnings[chunk - 1];
+            BinReferences(&context.references[chunk_begin], chunk_end - chunk_begin, centroid_bounds, scale, bin_count, chunk_binning);
+        });
+        for (unsigned chunk = 1; chunk < chunk_count; chunk++)
+            binning.Extend(extra_binnings[chunk - 1], bin_count);
+    }
+    ObjectSplit split = FindObjectSplit(binning, scale, bin_count);
+    float best_cost = split.cost;
+    unsigned best_axis = split.axis;
+    unsigned best_split = split.split;
+
+    float area = bounds.SurfaceArea();
+    bool split_found = best_cost < std::numeric_limits<float>::max();
+    float split_cost = split_found && area > 0 ? traversal_cost + best_cost / area : std::numeric_limits<float>::max();
+    bool halve = MustHalve(primitive_count, max_depth - depth);
+    if (!halve && primitive_count <= std::min(options.max_leaf_size, max_leaf_primitives) && primitive_count <= split_cost) {
+        nodes[node_index] = node;
+        return;
+    }
+
+    uint32_t middle;
+    AABB left_bounds, right_bounds;
+    if (split_found && !halve) {
+        left_bounds = split.left_bounds;
+        right_bounds = split.right_bounds;
+        middle = begin + split.left_count;
+        float centroid_min = centroid_bounds.min[best_axis];
+        float axis_scale = scale[best_axis];
+        Partition(context, begin, end, middle, [&](const Reference& reference) {
+            return BinIndex(reference.Centroid(best_axis), centroid_min, axis_scale, bin_count) < best_split;
+        });
+    } else {
+        //all centroids coincide (any split is as good as another) or the range is too large for the depth left
+        middle = (begin + end) / 2;
+        best_axis = centroid_bounds.LargestAxis();
+        for (uint32_t i = begin; i < middle; i++)
+            left_bounds.Extend(context.references[i].bounds);
+        for (uint32_t i = middle; i < end; i++)
+            right_bounds.Extend(context.references[i].bounds);
+    }
+
+    bool swap_children = options.reorder_treelets && right_bounds.SurfaceArea() > left_bounds.SurfaceArea();
+
+    //depth-first layout: the first child always directly follows its parent
+    uint32_t first_begin = swap_children ? middle : begin;
+    uint32_t first_end = swap_children ? end : middle;
+    uint32_t second_begin = swap_children ? begin : middle;
+    uint32_t second_end = swap_children ? middle : end;
+    const AABB& first_bounds = swap_children ? right_bounds : left_bounds;
+    const AABB& second_bounds = swap_children ? left_bounds : right_bounds;
+    uint32_t first_index = node_index + 1;
+    uint32_t second_index = node_index + 2 * (first_end - first_begin);
+
+    node.offset = second_index;
+    node.count = 0;
+    node.axis = best_axis;
+    node.upper_first = swap_children;
+    nodes[node_index] = node;
+
+    if (depth <= context.task_depth && primitive_count >= task_threshold) {
+        std::future<void> first_task = std::async(std::launch::async, [&]() {
+            Binning task_binning;
+            BuildRecursive(context, task_binning, first_begin, first_end, first_index, depth + 1, first_bounds);
+        });
+        BuildRecursive(context, binning, second_begin, second_end, second_index, depth + 1, second_bounds);
+        first_task.get();
+    } else {
+        BuildRecursive(context, binning, first_begin, first_end, first_index, depth + 1, first_bounds);
+        BuildRecursive(context, binning, second_begin, second_end, second_index, depth + 1, second_bounds);
+    }
+}
+
+//two-way partition of [begin, end) so that the primitives going left end up in [begin, middle);
+//large ranges are counted and scattered by several threads through the scratch buffer
+template <typename Predicate> void BVH::Partition(BuildContext& context, uint32_t begin, uint32_t end, uint32_t middle, Predicate goes_left) {
+    uint32_t primitive_count = end - begin;
+    if (primitive_count < parallel_threshold) {
+        std::partition(context.references.begin() + begin, context.references.begin() + end, goes_left);
+        return;
+    }
+    unsigned chunk_count = std::min(context.thread_count, primitive_count / (parallel_threshold / 4));
+    std::vector<uint32_t> left_counts(chunk_count + 1, 0);
+    ParallelForChunks(begin, end, chunk_count, [&](unsigned chunk, size_t chunk_begin, size_t chunk_end) {
+        uint32_t left_count = 0;
+        for (size_t i = chunk_begin; i < chunk_end; i++)
+            left_count += goes_left(context.references[i]);
+        left_counts[chunk + 1] = left_count;
+    });
+    for (unsigned chunk = 0; chunk < chunk_count; chunk++)
+        left_counts[chunk + 1] += left_counts[chunk];
+    assert(begin + left_counts[chunk_count] == middle);
+    ParallelForChunks(begin, end, chunk_count, [&](unsigned chunk, size_t chunk_begin, size_t chunk_end) {
+        uint32_t left = begin + left_counts[chunk];
+        uint32_t right = middle + (chunk_begin - begin) - left_counts[chunk];
+        for (size_t i = chunk_begin; i < chunk_end; i++) {
+            const Reference& reference = context.references[i];
+            if (goes_left(reference))
+                context.scratch_references[left++] = reference;
+            else
+                context.scratch_references[right++] = reference;
+        }
+    });
+    ParallelForChunks(begin, end, chunk_count, [&](unsigned, size_t chunk_begin, size_t chunk_end) {
+        std::copy(context.scratch_references.begin() + chunk_begin, context.scratch_references.begin() + chunk_end, context.references.begin() + chunk_begin);
+    });
+}
+
+//_______spatial split (SBVH) builder_____________________
+//serial: the reference count grows with every duplication, so the node and slot ranges are not known up front
+
+AABB BVH::ClipReference(const BuildContext& context, const Reference& reference, unsigned axis, float slab_min, float slab_max) {
+    AABB clipped = (*context.clipper)(reference.primitive, axis, slab_min, slab_max).Intersection(reference.bounds);
+    clipped.min[axis] = std::max(clipped.min[axis], slab_min);
+    clipped.max[axis] = std::min(clipped.max[axis], slab_max);
+    return clipped;
+}
+
+BVH::SpatialSplit BVH::FindSpatialSplit(const BuildContext& context, const std::vector<Reference>& references, const AABB& bounds, unsigned bin_count) {
+    struct SpatialBin {
+        AABB bounds;
+        uint32_t entries;
+        uint32_t exits;
+    };
+    SpatialSplit best;
+    best.cost = std::numeric_limits<float>::max();
+    best.axis = 0;
+    best.position = 0.0f;
+    SpatialBin bins[max_bin_count];
+    for (unsigned axis = 0; axis < 3; axis++) {
+        float axis_min = bounds.min[axis];
+        float bin_width = bounds.Extent()[axis] / bin_count;
+        if (!(bin_width > 0))
+            continue;
+        for (unsigned i = 0; i < bin_count; i++) {
+            bins[i].bounds = AABB();
+            bins[i].entries = 0;
+            bins[i].exits = 0;
+        }
+        //every reference is chopped into the bins it overlaps
+        for (size_t r = 0; r < references.size(); r++) {
+            const Reference& reference = references[r];
+            unsigned first_bin = BinIndex(reference.bounds.min[axis], axis_min, 1 / bin_width, bin_count);
+            unsigned last_bin = BinIndex(reference.bounds.max[axis], axis_min, 1 / bin_width, bin_count);
+            bins[first_bin].entries++;
+            bins[last_bin].exits++;
+            if (first_bin == last_bin) {
+                bins[first_bin].bounds.Extend(reference.bounds);
+                continue;
+            }
+            for (unsigned i = first_bin; i <= last_bin; i++) {
+                AABB part = ClipReference(context, reference, axis, axis_min + i * bin_width, axis_min + (i + 1) * bin_width);
+                if (!part.Empty())
+                    bins[i].bounds.Extend(part);
+            }
+        }
+        float right_cost[max_bin_count];
+        AABB accumulated;
+        uint32_t accumulated_count = 0;
+        for (unsigned i = bin_count - 1; i > 0; i--) {
+            accumulated.Extend(bins[i].bounds);
+            accumulated_count += bins[i].exits;
+            right_cost[i] = accumulated_count > 0 ? accumulated.SurfaceArea() * accumulated_count : -1.0f;
+        }
+        accumulated = AABB();
+        accumulated_count = 0;
+        for (unsigned split = 1; split < bin_count; split++) {
+            accumulated.Extend(bins[split - 1].bounds);
+            accumulated_count += bins[split - 1].entries;
+            if (accumulated_count == 0 || right_cost[split] < 0)
+                continue;
+            float cost = accumulated.SurfaceArea() * accumulated_count + right_cost[split];
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.position = axis_min + split * bin_width;
+            }
+        }
+    }
+    return best;
+}
+
+uint32_t BVH::BuildSpatialRecursive(BuildContext& context, Binning& binning, std::vector<Reference>& references, unsigned depth, const AABB& bounds) {
+    const BVHBuildOptions& options = context.options;
+    uint32_t node_index = nodes.size();
+    nodes.emplace_back();
+    uint32_t reference_count = references.size();
+    BVHNode node;
+    node.bounds_min = bounds.min;
+    node.bounds_max = bounds.max;
+    node.axis = 0;
+    node.upper_first = 0;
+    node.offset = primitive_indices.size();
+    node.count = reference_count;
+    auto make_leaf = [&]() {
+        assert(reference_count <= std::numeric_limits<uint16_t>::max());
+        for (uint32_t i = 0; i < reference_count; i++)
+            primitive_indices.push_back(references[i].primitive);
+        nodes[node_index] = node;
+        return node_index;
+    };
+    if (reference_count == 1 || depth >= max_depth)
+        return make_leaf();
+
+    AABB centroid_bounds;
+    for (uint32_t i = 0; i < reference_count; i++)
+        centroid_bounds.Extend(references[i].bounds.Center());
+    unsigned bin_count = std::min(max_bin_count, std::max(4u, reference_count));
+    vec3f centroid_extent = centroid_bounds.Extent();
+    float scale[3];
+    for (unsigned axis = 0; axis < 3; axis++)
+        scale[axis] = centroid_extent[axis] > 0 ? bin_count / centroid_extent[axis] : 0.0f;
+    BinReferences(references.data(), reference_count, centroid_bounds, scale, bin_count, binning);
+    ObjectSplit object_split = FindObjectSplit(binning, scale, bin_count);
+    bool object_split_found = object_split.cost < std::numeric_limits<float>::max();
+
+    //spatial splits only pay off where the object split children overlap noticeably
+    SpatialSplit spatial_split;
+    spatial_split.cost = std::numeric_limits<float>::max();
+    AABB overlap = object_split.left_bounds.Intersection(object_split.right_bounds);
+    if (!object_split_found || (!overlap.Empty() && overlap.SurfaceArea() > options.spatial_split_alpha * context.root_area))
+        spatial_split = FindSpatialSplit(context, references, bounds, bin_count);
+    bool use_spatial_split = spatial_split.cost < object_split.cost;
+
+    float best_cost = std::min(object_split.cost, spatial_split.cost);
+    float area = bounds.SurfaceArea();
+    float split_cost = best_cost < std::numeric_limits<float>::max() && area > 0 ? traversal_cost + best_cost / area : std::numeric_limits<float>::max();
+    bool halve = MustHalve(reference_count, max_depth - depth);
+    if (!halve && reference_count <= std::min(options.max_leaf_size, max_leaf_primitives) && reference_count <= split_cost)
+        return make_leaf();
+
+    std::vector<Reference> left, right;
+    AABB left_bounds, right_bounds;
+    unsigned axis;
+    if (use_spatial_split && !halve) {
+        axis = spatial_split.axis;
+        float position = spatial_split.position;
+        std::vector<Reference> straddling;
+        for (uint32_t i = 0; i < reference_count; i++) {
+            const Reference& reference = references[i];
+            if (reference.bounds.max[axis] <= position) {
+                left.push_back(reference);
+                left_bounds.Extend(reference.bounds);
+            } else if (reference.bounds.min[axis] >= position) {
+                right.push_back(reference);
+                right_bounds.Extend(reference.bounds);
+            } else {
+                straddling.push_back(reference);
+            }
+        }
+        //a straddling reference is split in two unless moving it whole to one side is cheaper (reference unsplitting)
+        for (size_t i = 0; i < straddling.size(); i++) {
+            const Reference& reference = straddling[i];
+            Reference left_part{ ClipReference(context, reference, axis, reference.bounds.min[axis], position), reference.primitive };
+            Reference right_part{ ClipReference(context, reference, axis, position, reference.bounds.max[axis]), reference.primitive };
+            AABB left_split = left_bounds, right_split = right_bounds, left_whole = left_bounds, right_whole = right_bounds;
+            left_split.Extend(left_part.bounds);
+            right_split.Extend(right_part.bounds);
+            left_whole.Extend(reference.bounds);
+            right_whole.Extend(reference.bounds);
+            float left_count = left.size(), right_count = right.size();
+            float cost_split = left_split.SurfaceArea() * (left_count + 1) + right_split.SurfaceArea() * (right_count + 1);
+            float cost_left = left_whole.SurfaceArea() * (left_count + 1) + right_bounds.SurfaceArea() * right_count;
+            float cost_right = left_bounds.SurfaceArea() * left_count + right_whole.SurfaceArea() * (right_count + 1);
+            if (left_part.bounds.Empty() || cost_right <= std::min(cost_split, cost_left)) {
+                right.push_back(reference);
+                right_bounds = right_whole;
+            } else if (right_part.bounds.Empty() || cost_left <= cost_split) {
+                left.push_back(reference);
+                left_bounds = left_whole;
+            } else {
+                left.push_back(left_part);
+                right.push_back(right_part);
+                left_bounds = left_split;
+                right_bounds = right_split;
+            }
+        }
+    } else if (object_split_found && !halve) {
+        axis = object_split.axis;
+        for (uint32_t i = 0; i < reference_count; i++) {
+            const Reference& reference = references[i];
+            if (BinIndex(reference.Centroid(axis), centroid_bounds.min[axis], scale[axis], bin_count) < object_split.split)
+                left.push_back(reference);
+            else
+                right.push_back(reference);
+        }
+        left_bounds = object_split.left_bounds;
+        right_bounds = object_split.right_bounds;
+    } else {
+        axis = centroid_bounds.LargestAxis();
+    }
+    if (halve || left.empty() || right.empty()) {
+        //all centroids coincide or unsplitting moved everything to one side (any split is as good as another), or
+        //the references are too many for the depth left
+        left.assign(references.begin(), references.begin() + reference_count / 2);
+        right.assign(references.begin() + reference_count / 2, references.end());
+        left_bounds = AABB();
+        right_bounds = AABB();
+        for (size_t i = 0; i < left.size(); i++)
+            left_bounds.Extend(left[i].bounds);
+        for (size_t i = 0; i < right.size(); i++)
+            right_bounds.Extend(right[i].bounds);
+    }
+    std::vector<Reference>().swap(references);
+
+    bool swap_children = options.reorder_treelets && right_bounds.SurfaceArea() > left_bounds.SurfaceArea();
+    if (swap_children) {
+        BuildSpatialRecursive(context, binning, right, depth + 1, right_bounds);
+        node.offset = BuildSpatialRecursive(context, binning, left, depth + 1, left_bounds);
+    } else {
+        BuildSpatialRecursive(context, binning, left, depth + 1, left_bounds);
+        node.offset = BuildSpatialRecursive(context, binning, right, depth + 1, right_bounds);
+    }
+    node.count = 0;
+    node.axis = axis;
+    node.upper_first = swap_children;
+    nodes[node_index] = node;
+    return node_index;
+}
+
+template <unsigned wide> void BVH::Collapse(std::vector<WideBVHNode<wide>, AlignedAllocator<WideBVHNode<wide>, 64>>& wide_nodes) {
+    wide_nodes.reserve(nodes.size() / 2 + 1);
+    CollapseRecursive<wide>(wide_nodes, 0);
+}
+
+//pulls the grandchildren of the largest interior children up until the node has `wide` children
+template <unsigned wide> uint32_t BVH::CollapseRecursive(std::vector<WideBVHNode<wide>, AlignedAllocator<WideBVHNode<wide>, 64>>& wide_nodes, uint32_t binary_index) {
+    uint32_t node_index = wide_nodes.size();
+    wide_nodes.emplace_back();
+    uint32_t children[wide];
+    unsigned child_count = 0;
+    if (nodes[binary_index].IsLeaf()) {
+        children[child_count++] = binary_index;
+    } else {
+        children[child_count++] = binary_index + 1;
+        children[child_count++] = nodes[binary_index].offset;
+    }
+    while (child_count < wide) {
+        int largest = -1;
+        float largest_area = -1.0f;
+        for (unsigned i = 0; i < child_count; i++) {
+            const BVHNode& child = nodes[children[i]];
+            float area = AABB(child.bounds_min, child.bounds_max).SurfaceArea();
+            if (!child.IsLeaf() && area > largest_area) {
+                largest = i;
+                largest_area = area;
+            }
+        }
+        if (largest < 0)
+            break;
+        uint32_t expanded = children[largest];
+        children[largest] = expanded + 1;
+        children[child_count++] = nodes[expanded].offset;
+    }
+
+    WideBVHNode<wide> node;
+    for (unsigned axis = 0; axis < 3; axis++) {
+        for (unsigned i = 0; i < wide; i++) {
+            node.bounds_min[axis][i] = std::numeric_limits<float>::max();
+            node.bounds_max[axis][i] = -std::numeric_limits<float>::max();
+        }
+    }
+    for (unsigned i = 0; i < wide; i++) {
+        node.child[i] = 0;
+        node.count[i] = 0;
+    }
+    node.child_count = child_count;
+    for (unsigned i = 0; i < child_count; i++) {
+        const BVHNode& child = nodes[children[i]];
+        for (unsigned axis = 0; axis < 3; axis++) {
+            node.bounds_min[axis][i] = child.bounds_min[axis];
+            node.bounds_max[axis][i] = child.bounds_max[axis];
+        }
+        if (child.IsLeaf()) {
+            node.child[i] = child.offset;
+            node.count[i] = child.count;
+        } else {
+            node.child[i] = CollapseRecursive<wide>(wide_nodes, children[i]);
+        }
+    }
+    wide_nodes[node_index] = node;
+    return node_index;
+}
+
+//_______dynamic BVH________________________________________
+
+namespace {
+
+AABB Union(const AABB& a, const AABB& b) {
+    AABB bounds = a;
+    bounds.Extend(b);
+    return bounds;
+}
+
+}
+
+uint32_t DynamicBVH::AllocateNode() {
+    if (free_list == null_node) {
+        nodes.push_back(Node());
+        return uint32_t(nodes.size() - 1);
+    }
+    uint32_t index = free_list;
+    free_list = nodes[index].parent;
+    return index;
+}
+
+void DynamicBVH::FreeNode(uint32_t index) {
+    nodes[index].parent = free_list;
+    nodes[index].height = -1;
+    free_list = index;
+}
+
+uint32_t DynamicBVH::Insert(const AABB& bounds, uint32_t primitive) {
+    uint32_t leaf = AllocateNode();
+    nodes[leaf].bounds = bounds;
+    nodes[leaf].primitive = primitive;
+    nodes[leaf].height = 0;
+    nodes[leaf].child[0] = nodes[leaf].child[1] = null_node;
+    InsertLeaf(leaf);
+    leaf_count++;
+    return leaf;
+}
+
+void DynamicBVH::Remove(uint32_t leaf) {
+    assert(nodes[leaf].IsLeaf());
+    RemoveLeaf(leaf);
+    FreeNode(leaf);
+    leaf_count--;
+}
+
+void DynamicBVH::Move(uint32_t leaf, const AABB& bounds) {
+    RemoveLeaf(leaf);
+    nodes[leaf].bounds = bounds;
+    InsertLeaf(leaf);
+}
+
+void DynamicBVH::Clear() {
+    nodes.clear();
+    root = null_node;
+    free_list = null_node;
+    leaf_count = 0;
+}
+
+void DynamicBVH::InsertLeaf(uint32_t leaf) {
+    if (root == null_node) {
+        root = leaf;
+        nodes[leaf].parent = null_node;
+        return;
+    }
+    //descend towards the sibling with the least surface area increase, stopping once
+    //pairing with the current node is cheaper than pushing the leaf further down
+    const AABB leaf_bounds = nodes[leaf].bounds;
+    uint32_t index = root;
+    while (!nodes[index].IsLeaf()) {
+        float area = nodes[index].bounds.SurfaceArea();
+        float combined_area = Union(nodes[index].bounds, leaf_bounds).SurfaceArea();
+        float cost = 2 * combined_area;
+        float inheritance_cost = 2 * (combined_area - area);
+        float child_cost[2];
+        for (unsigned i = 0; i < 2; i++) {
+            const Node& child = nodes[nodes[index].child[i]];
+            float enlarged_area = Union(child.bounds, leaf_bounds).SurfaceArea();
+            child_cost[i] = (child.IsLeaf() ? enlarged_area : enlarged_area - child.bounds.SurfaceArea()) + inheritance_cost;
+        }
+        if (cost < child_cost[0] && cost < child_cost[1])
+            break;
+        index = nodes[index].child[child_cost[0] < child_cost[1] ? 0 : 1];
+    }
+
+    uint32_t sibling = index;
+    uint32_t old_parent = nodes[sibling].parent;
+    uint32_t new_parent = AllocateNode();
+    nodes[new_parent].parent = old_parent;
+    nodes[new_parent].bounds = Union(leaf_bounds, nodes[sibling].bounds);
+    nodes[new_parent].height = nodes[sibling].height + 1;
+    nodes[new_parent].child[0] = sibling;
+    nodes[new_parent].child[1] = leaf;
+    nodes[sibling].parent = new_parent;
+    nodes[leaf].parent = new_parent;
+    if (old_parent == null_node) {
+        root = new_parent;
+    } else {
+        Node& parent = nodes[old_parent];
+        parent.child[parent.child[0] == sibling ? 0 : 1] = new_parent;
+    }
+    FixUpwards(old_parent);
+}
+
+void DynamicBVH::RemoveLeaf(uint32_t leaf) {
+    if (leaf == root) {
+        root = null_node;
+        return;
+    }
+    uint32_t parent = nodes[leaf].parent;
+    uint32_t grand_parent = nodes[parent].parent;
+    uint32_t sibling = nodes[parent].child[nodes[parent].child[0] == leaf ? 1 : 0];
+    nodes[sibling].parent = grand_parent;
+    if (grand_parent == null_node) {
+        root = sibling;
+    } else {
+        Node& node = nodes[grand_parent];
+        node.child[node.child[0] == parent ? 0 : 1] = sibling;
+    }
+    FreeNode(parent);
+    FixUpwards(grand_parent);
+}
+
+//rebalances and refits the ancestors of a changed subtree up to the root
+void DynamicBVH::FixUpwards(uint32_t index) {
+    while (index != null_node) {
+        index = Balance(index);
+        Node& node = nodes[index];
+        node.height = 1 + std::max(nodes[node.child[0]].height, nodes[node.child[1]].height);
+        node.bounds = Union(nodes[node.child[0]].bounds, nodes[node.child[1]].bounds);
+        index = node.parent;
+    }
+}
+
+//rotates the higher child of an unbalanced node above it; returns the node now in its place
+uint32_t DynamicBVH::Balance(uint32_t index) {
+    Node& node = nodes[index];
+    if (node.IsLeaf() || node.height < 2)
+        return index;
+    int balance = nodes[node.child[1]].height - nodes[node.child[0]].height;
+    if (balance >= -1 && balance <= 1)
+        return index;
+
+    unsigned heavy_side = balance > 1 ? 1 : 0;
+    uint32_t heavy_index = node.child[heavy_side];
+    uint32_t light_index = node.child[1 - heavy_side];
+    Node& heavy = nodes[heavy_index];
+    uint32_t first_grandchild = heavy.child[0];
+    uint32_t second_grandchild = heavy.child[1];
+
+    //the heavy child takes the node's place and adopts it
+    heavy.child[0] = index;
+    heavy.parent = node.parent;
+    node.parent = heavy_index;
+    if (heavy.parent == null_node) {
+        root = heavy_index;
+    } else {
+        Node& parent = nodes[heavy.parent];
+        parent.child[parent.child[0] == index ? 0 : 1] = heavy_index;
+    }
+
+    //the higher grandchild stays with the heavy child, the lower one moves under the node
+    uint32_t kept = first_grandchild, moved = second_grandchild;
+    if (nodes[second_grandchild].height > nodes[first_grandchild].height)
+        std::swap(kept, moved);
+    heavy.child[1] = kept;
+    node.child[heavy_side] = moved;
+    nodes[moved].parent = index;
+
+    node.bounds = Union(nodes[light_index].bounds, nodes[moved].bounds);
+    node.height = 1 + std::max(nodes[light_index].height, nodes[moved].height);
+    heavy.bounds = Union(node.bounds, nodes[kept].bounds);
+    heavy.height = 1 + std::max(node.height, nodes[kept].height);
+    return heavy_index;
+}
@@ -0,0 +1,561 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <functional>
+#include <cstring>
+#include "geometry.h"
+#include "ray.h"
+#include "allocator.h"
+#include "dispatch.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define BVH_USE_SSE
+#endif
+
+//_______axis-aligned bounding box______________________
+
+struct AABB {
+    vec3f min;
+    vec3f max;
+    AABB() : min(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max()),
+             max(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max()) {}
+    AABB(const vec3f& in_min, const vec3f& in_max) : min(in_min), max(in_max) {}
+    void Extend(const vec3f& point) {
+        min.x = std::min(min.x, point.x); min.y = std::min(min.y, point.y); min.z = std::min(min.z, point.z);
+        max.x = std::max(max.x, point.x); max.y = std::max(max.y, point.y); max.z = std::max(max.z, point.z);
+    }
+    void Extend(const AABB& box) {
+        min.x = std::min(min.x, box.min.x); min.y = std::min(min.y, box.min.y); min.z = std::min(min.z, box.min.z);
+        max.x = std::max(max.x, box.max.x); max.y = std::max(max.y, box.max.y); max.z = std::max(max.z, box.max.z);
+    }
+    AABB Intersection(const AABB& box) const {
+        return AABB(vec3f(std::max(min.x, box.min.x), std::max(min.y, box.min.y), std::max(min.z, box.min.z)),
+                    vec3f(std::min(max.x, box.max.x), std::min(max.y, box.max.y), std::min(max.z, box.max.z)));
+    }
+    bool Empty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+    vec3f Center() const { return (min + max) * 0.5f; }
+    vec3f Extent() const { return max - min; }
+    float SurfaceArea() const;
+    unsigned LargestAxis() const;
+};
+
+//_______flattened BVH node (32 bytes, two per cache line)_______
+
+struct alignas(32) BVHNode {
+    vec3f bounds_min;
+    uint32_t offset;    //leaf: first primitive slot, interior: index of the second child (the first one is the next node)
+    vec3f bounds_max;
+    uint16_t count;     //number of primitives in a leaf, 0 for interior nodes
+    uint8_t axis;       //split axis, the child on the ray's side of it is visited first
+    uint8_t upper_first;//1 if the first child holds the upper half along the axis
+    bool IsLeaf() const { return count > 0; }
+};
+
+static_assert(sizeof(BVHNode) == 32, "BVHNode must stay 32 bytes");
+
+//_______wide BVH node: child boxes stored SoA for SIMD slab tests_____
+
+template <unsigned width> struct alignas(64) WideBVHNode {
+    float bounds_min[3][width];
+    float bounds_max[3][width];
+    uint32_t child[width];      //node index for interior children, first primitive slot for leaves
+    uint16_t count[width];      //number of primitives in a leaf child, 0 for interior children
+    uint32_t child_count;
+};
+
+//_______compressed wide node: child boxes quantized to 8 or 16 bits inside the node box_____
+//a child coordinate decodes to origin + q * 2^exponent; with a power of two scale the product is exact,
+//so decoding repeats the encoder's float arithmetic bit for bit and the decoded box always contains the child
+
+template <unsigned width, typename Quantized> struct alignas(16) QuantizedBVHNode {
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t child_count;
+    Quantized bounds_min[3][width];
+    Quantized bounds_max[3][width];
+    uint32_t child[width];
+    uint16_t count[width];
+};
+
+static_assert(sizeof(QuantizedBVHNode<4, uint8_t>) == 64, "an 8-bit 4-wide node must fill one cache line");
+
+inline float ExponentToScale(int exponent) {
+    uint32_t bits = uint32_t(exponent + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return scale;
+}
+
+struct BVHBuildOptions {
+    unsigned max_leaf_size = 4;
+    unsigned width = 4;             //2 keeps the binary tree, 4 and 8 collapse it into a wide BVH
+    bool reorder_treelets = false;  //put the child with the larger surface area (more likely to be entered) right after its parent
+    bool spatial_splits = false;    //SBVH: also try splitting primitives by a plane and referencing them from both children (serial, slower build)
+    float spatial_split_alpha = 1e-5f; //spatial splits are only tried where the object split children overlap by more than this fraction of the root area
+    unsigned quantization_bits = 0; //8 or 16 keeps only the wide nodes with quantized child boxes (width 4 or 8), the tree can then not be refitted
+    bool lazy = false;              //the owner builds on the first ray that enters its bounds (PolygonalObject), so unseen geometry costs nothing
+};
+
+//bounds of the part of a primitive that lies within [slab_min, slab_max] along the axis (SBVH clipping)
+typedef std::function<AABB(uint32_t primitive, unsigned axis, float slab_min, float slab_max)> PrimitiveClipper;
+
+//_______slab test against one box, tentry is clamped to the ray origin___
+
+inline bool IntersectBox(const vec3f& bounds_min, const vec3f& bounds_max, const vec3f& origin, const vec3f& inv_direction, float tmax, float& tentry) {
+    float tx1 = (bounds_min.x - origin.x) * inv_direction.x;
+    float tx2 = (bounds_max.x - origin.x) * inv_direction.x;
+    float tnear = std::min(tx1, tx2);
+    float tfar = std::max(tx1, tx2);
+    float ty1 = (bounds_min.y - origin.y) * inv_direction.y;
+    float ty2 = (bounds_max.y - origin.y) * inv_direction.y;
+    tnear = std::max(tnear, std::min(ty1, ty2));
+    tfar = std::min(tfar, std::max(ty1, ty2));
+    float tz1 = (bounds_min.z - origin.z) * inv_direction.z;
+    float tz2 = (bounds_max.z - origin.z) * inv_direction.z;
+    tnear = std::max(tnear, std::min(tz1, tz2));
+    tfar = std::min(tfar, std::max(tz1, tz2));
+    tentry = std::max(tnear, 0.0f);
+    return tfar >= tentry && tentry <= tmax;
+}
+
+//_______slab test against all children of a wide node, returns the mask of hit children___
+
+template <unsigned width> unsigned IntersectWideBoxes(const WideBVHNode<width>& node, const vec3f& origin, const vec3f& inv_direction, float tmax, float* tentry) {
+    const float o[3] = { origin.x, origin.y, origin.z };
+    const float inv[3] = { inv_direction.x, inv_direction.y, inv_direction.z };
+    unsigned mask = 0;
+    for (unsigned i = 0; i < node.child_count; i++) {
+        float tnear = 0.0f;
+        float tfar = tmax;
+        for (unsigned axis = 0; axis < 3; axis++) {
+            float t1 = (node.bounds_min[axis][i] - o[axis]) * inv[axis];
+            float t2 = (node.bounds_max[axis][i] - o[axis]) * inv[axis];
+            tnear = std::max(tnear, std::min(t1, t2));
+            tfar = std::min(tfar, std::max(t1, t2));
+        }
+        tentry[i] = tnear;
+        mask |= unsigned(tnear <= tfar) << i;
+    }
+    return mask;
+}
+
+#ifdef BVH_USE_SSE
+template <> inline unsigned IntersectWideBoxes<4>(const WideBVHNode<4>& node, const vec3f& origin, const vec3f& inv_direction, float tmax, float* tentry) {
+    __m128 tnear = _mm_setzero_ps();
+    __m128 tfar = _mm_set1_ps(tmax);
+    const float o[3] = { origin.x, origin.y, origin.z };
+    const float inv[3] = { inv_direction.x, inv_direction.y, inv_direction.z };
+    for (unsigned axis = 0; axis < 3; axis++) {
+        __m128 axis_origin = _mm_set1_ps(o[axis]);
+        __m128 axis_inv = _mm_set1_ps(inv[axis]);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds_min[axis]), axis_origin), axis_inv);
+        __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds_max[axis]), axis_origin), axis_inv);
+        tnear = _mm_max_ps(tnear, _mm_min_ps(t1, t2));
+        tfar = _mm_min_ps(tfar, _mm_max_ps(t1, t2));
+    }
+    _mm_storeu_ps(tentry, tnear);
+    return unsigned(_mm_movemask_ps(_mm_cmple_ps(tnear, tfar))) & ((1u << node.child_count) - 1);
+}
+#endif
+
+#ifdef __AVX__
+template <> inline unsigned IntersectWideBoxes<8>(const WideBVHNode<8>& node, const vec3f& origin, const vec3f& inv_direction, float tmax, float* tentry) {
+    __m256 tnear = _mm256_setzero_ps();
+    __m256 tfar = _mm256_set1_ps(tmax);
+    const float o[3] = { origin.x, origin.y, origin.z };
+    const float inv[3] = { inv_direction.x, inv_direction.y, inv_direction.z };
+    for (unsigned axis = 0; axis < 3; axis++) {
+        __m256 axis_origin = _mm256_set1_ps(o[axis]);
+        __m256 axis_inv = _mm256_set1_ps(inv[axis]);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds_min[axis]), axis_origin), axis_inv);
+        __m256 t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds_max[axis]), axis_origin), axis_inv);
+        tnear = _mm256_max_ps(tnear, _mm256_min_ps(t1, t2));
+        tfar = _mm256_min_ps(tfar, _mm256_max_ps(t1, t2));
+    }
+    _mm256_storeu_ps(tentry, tnear);
+    return unsigned(_mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ))) & ((1u << node.child_count) - 1);
+}
+#else
+//a build without AVX leaves the eight children to the kernel picked for the CPU at startup
+template <> inline unsigned IntersectWideBoxes<8>(const WideBVHNode<8>& node, const vec3f& origin, const vec3f& inv_direction, float tmax, float* tentry) {
+    return GetKernels().intersect_boxes8(node.bounds_min[0], node.bounds_max[0], node.child_count, origin, inv_direction, tmax, tentry);
+}
+#endif
+
+//decodes the children conservatively and runs the float kernel on them
+template <unsigned width, typename Quantized> unsigned IntersectWideBoxes(const QuantizedBVHNode<width, Quantized>& node, const vec3f& origin, const vec3f& inv_direction, float tmax, float* tentry) {
+    WideBVHNode<width> decoded;
+    for (unsigned axis = 0; axis < 3; axis++) {
+        float scale = ExponentToScale(node.exponent[axis]);
+        for (unsigned i = 0; i < width; i++) {
+            decoded.bounds_min[axis][i] = node.origin[axis] + float(node.bounds_min[axis][i]) * scale;
+            decoded.bounds_max[axis][i] = node.origin[axis] + float(node.bounds_max[axis][i]) * scale;
+        }
+    }
+    decoded.child_count = node.child_count;
+    return IntersectWideBoxes<width>(decoded, origin, inv_direction, tmax, tentry);
+}
+
+#ifdef BVH_USE_SSE
+//slab test of four children whose codes are already widened to floats
+inline unsigned IntersectQuantizedBoxes4(const float* node_origin, const int8_t* exponent, const __m128* low_codes, const __m128* high_codes, unsigned child_count,
+                                         const vec3f& origin, const vec3f& inv_direction, float tmax, float* tentry) {
+    __m128 tnear = _mm_setzero_ps();
+    __m128 tfar = _mm_set1_ps(tmax);
+    const float o[3] = { origin.x, origin.y, origin.z };
+    const float inv[3] = { inv_direction.x, inv_direction.y, inv_direction.z };
+    for (unsigned axis = 0; axis < 3; axis++) {
+        __m128 scale = _mm_set1_ps(ExponentToScale(exponent[axis]));
+        __m128 base = _mm_set1_ps(node_origin[axis]);
+        __m128 axis_origin = _mm_set1_ps(o[axis]);
+        __m128 axis_inv = _mm_set1_ps(inv[axis]);
+        __m128 bounds_min = _mm_add_ps(base, _mm_mul_ps(low_codes[axis], scale));
+        __m128 bounds_max = _mm_add_ps(base, _mm_mul_ps(high_codes[axis], scale));
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(bounds_min, axis_origin), axis_inv);
+        __m128 t2 = _mm_mul_ps(_mm_sub_ps(bounds_max, axis_origin), axis_inv);
+        tnear = _mm_max_ps(tnear, _mm_min_ps(t1, t2));
+        tfar = _mm_min_ps(tfar, _mm_max_ps(t1, t2));
+    }
+    _mm_storeu_ps(tentry, tnear);
+    return unsigned(_mm_movemask_ps(_mm_cmple_ps(tnear, tfar))) & ((1u << child_count) - 1);
+}
+
+template <> inline unsigned IntersectWideBoxes<4, uint8_t>(const QuantizedBVHNode<4, uint8_t>& node, const vec3f& origin, const vec3f& inv_direction, float tmax, float* tentry) {
+    __m128i zero = _mm_setzero_si128();
+    __m128 low_codes[3], high_codes[3];
+    for (unsigned axis = 0; axis < 3; axis++) {
+        int32_t low, high;
+        memcpy(&low, node.bounds_min[axis], sizeof(low));
+        memcpy(&high, node.bounds_max[axis], sizeof(high));
+        low_codes[axis] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(low), zero), zero));
+        high_codes[axis] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(high), zero), zero));
+    }
+    return IntersectQuantizedBoxes4(node.origin, node.exponent, low_codes, high_codes, node.child_count, origin, inv_direction, tmax, tentry);
+}
+
+template <> inline unsigned IntersectWideBoxes<4, uint16_t>(const QuantizedBVHNode<4, uint16_t>& node, const vec3f& origin, const vec3f& inv_direction, float tmax, float* tentry) {
+    __m128i zero = _mm_setzero_si128();
+    __m128 low_codes[3], high_codes[3];
+    for (unsigned axis = 0; axis < 3; axis++) {
+        low_codes[axis] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(node.bounds_min[axis])), zero));
+        high_codes[axis] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(node.bounds_max[axis])), zero));
+    }
+    return IntersectQuantizedBoxes4(node.origin, node.exponent, low_codes, high_codes, node.child_count, origin, inv_direction, tmax, tentry);
+}
+#endif
+
+inline unsigned LowestBit(unsigned mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+//_______flat image of the traversed nodes, for storing a built BVH and attaching it again without copying_____
+
+struct BVHImage {
+    unsigned width;
+    unsigned quantization_bits;
+    AABB bounds;
+    const void* nodes;      //node array of the layout given by width and quantization_bits
+    size_t node_count;
+    size_t node_size;
+};
+
+//_______bounding volume hierarchy over abstract primitives________
+//primitives are given by their bounds; after Build the owner lays out its own primitives
+//by GetPrimitiveIndices() so that every leaf covers a contiguous range of slots
+
+class BVH {
+    std::vector<BVHNode, AlignedAllocator<BVHNode, 64>> nodes;
+    std::vector<WideBVHNode<4>, AlignedAllocator<WideBVHNode<4>, 64>> nodes4;
+    std::vector<WideBVHNode<8>, AlignedAllocator<WideBVHNode<8>, 64>> nodes8;
+    std::vector<QuantizedBVHNode<4, uint8_t>, AlignedAllocator<QuantizedBVHNode<4, uint8_t>, 64>> quantized4_8;
+    std::vector<QuantizedBVHNode<4, uint16_t>, AlignedAllocator<QuantizedBVHNode<4, uint16_t>, 64>> quantized4_16;
+    std::vector<QuantizedBVHNode<8, uint8_t>, AlignedAllocator<QuantizedBVHNode<8, uint8_t>, 64>> quantized8_8;
+    std::vector<QuantizedBVHNode<8, uint16_t>, AlignedAllocator<QuantizedBVHNode<8, uint16_t>, 64>> quantized8_16;
+    std::vector<uint32_t> primitive_indices;
+    AABB bounds;
+    unsigned width = 2;
+    unsigned quantization_bits = 0;
+    const void* external_nodes = nullptr;   //set by Attach, the owned arrays are empty then
+    size_t external_node_count = 0;
+    float cost = 0.0f;          //SAH cost of the tree relative to one primitive intersection
+    float build_cost = 0.0f;    //the cost right after the last Build, refits compare against it
+    struct Reference;
+    struct BuildContext;
+    struct Binning;
+    struct ObjectSplit;
+    static void BinReferences(const Reference* references, size_t count, const AABB& centroid_bounds, const float* scale, unsigned bin_count, Binning& binning);
+    static ObjectSplit FindObjectSplit(const Binning& binning, const float* scale, unsigned bin_count);
+    struct SpatialSplit;
+    static AABB ClipReference(const BuildContext& context, const Reference& reference, unsigned axis, float slab_min, float slab_max);
+    static SpatialSplit FindSpatialSplit(const BuildContext& context, const std::vector<Reference>& references, const AABB& bounds, unsigned bin_count);
+    uint32_t BuildSpatialRecursive(BuildContext& context, Binning& binning, std::vector<Reference>& references, unsigned depth, const AABB& bounds);
+    float RefitSubtree(uint32_t root, const std::vector<AABB>& slot_bounds);
+    float ComputeCost() const;
+    void BuildRecursive(BuildContext& context, Binning& binning, uint32_t begin, uint32_t end, uint32_t node_index, unsigned depth, const AABB& bounds);
+    template <typename Predicate> void Partition(BuildContext& context, uint32_t begin, uint32_t end, uint32_t middle, Predicate goes_left);
+    template <unsigned wide> void Collapse(std::vector<WideBVHNode<wide>, AlignedAllocator<WideBVHNode<wide>, 64>>& wide_nodes);
+    template <unsigned wide> uint32_t CollapseRecursive(std::vector<WideBVHNode<wide>, AlignedAllocator<WideBVHNode<wide>, 64>>& wide_nodes, uint32_t binary_index);
+    template <typename Node> const Node* GetNodes(const std::vector<Node, AlignedAllocator<Node, 64>>& owned_nodes) const {
+        return external_nodes != nullptr ? static_cast<const Node*>(external_nodes) : owned_nodes.data();
+    }
+    template <typename LeafIntersector> bool TraverseLeaves(const vec3f& origin, const vec3f& inv_direction, unsigned sign_bits, float& tmax, LeafIntersector intersect) const;
+    template <unsigned wide, typename Node, typename Intersector> bool TraverseWide(const Node* wide_nodes, const vec3f& origin, const vec3f& inv_direction, float& tmax, Intersector intersect) const;
+    template <typename Intersector> bool TraverseBinary(const BVHNode* binary_nodes, const vec3f& origin, const vec3f& inv_direction, unsigned sign_bits, float& tmax, Intersector intersect) const;
+public:
+    static constexpr unsigned max_depth = 64;
+    //with spatial splits a primitive may be referenced from several leaves, so GetPrimitiveIndices() can be
+    //longer than primitive_bounds; without a clipper primitives are clipped by their bounding boxes
+    void Build(const std::vector<AABB>& primitive_bounds, const BVHBuildOptions& options = BVHBuildOptions(), const PrimitiveClipper& clipper = PrimitiveClipper());
+    bool Empty() const { return GetNodeCount() == 0; }
+    AABB GetBounds() const { return bounds; }
+    size_t GetNodeCount() const;
+    size_t GetMemoryUsage() const;
+    unsigned GetWidth() const { return width; }
+    unsigned GetQuantizationBits() const { return quantization_bits; }
+    bool CanRefit() const { return quantization_bits == 0 && external_nodes == nullptr; }
+    //size of one traversed node for the layout, as in BVHImage::node_size
+    static size_t GetNodeSize(unsigned width, unsigned quantization_bits);
+    //the traversed nodes as one flat, pointer-free array
+    BVHImage GetImage() const;
+    //traverses the image's nodes in place (e.g. in a mapped file), they must outlive the BVH or the next Build;
+    //primitive indices are not kept, the owner's primitives must already be in slot order
+    void Attach(const BVHImage& image);
+    float GetCost() const { return cost; }
+    float GetBuildCost() const { return build_cost; }
+    //recomputes all node bounds bottom-up for moved primitives, given the new bounds of every slot;
+    //the topology is kept, so the cost may grow until the owner decides to rebuild (requires CanRefit())
+    void Refit(const std::vector<AABB>& slot_bounds);
+    const std::vector<uint32_t>& GetPrimitiveIndices() const { return primitive_indices; }
+    //cuts the slots into contiguous [begin, end) ranges, each holding the slots of a largest subtree with at most
+    //max_slots of them (or of a single bigger leaf), in slot order; used to page geometry in spatially coherent
+    //clusters (requires CanRefit(), i.e. the binary nodes)
+    std::vector<std::pair<uint32_t, uint32_t>> GetSubtreeSlotRanges(size_t max_slots) const;
+    //calls intersect(slot, tmax) for primitives whose leaves the ray enters before tmax;
+    //the callback returns true on a hit and shrinks tmax to the hit distance
+    template <typename Intersector> bool Traverse(const vec3f& origin, const vec3f& direction, float& tmax, Intersector intersect) const;
+    //the same with one call intersect(first_slot, count, tmax) per leaf, for owners that test a leaf's primitives at once
+    template <typename LeafIntersector> bool TraverseLeaves(const vec3f& origin, const vec3f& direction, float& tmax, LeafIntersector intersect) const;
+    //the same with the inverse direction and signs the ray carries, nothing is computed per traversal
+    template <typename Intersector> bool Traverse(const Ray& ray, float& tmax, Intersector intersect) const;
+    template <typename LeafIntersector> bool TraverseLeaves(const Ray& ray, float& tmax, LeafIntersector intersect) const;
+};
+
+template <typename Intersector> bool BVH::Traverse(const vec3f& origin, const vec3f& direction, float& tmax, Intersector intersect) const {
+    return TraverseLeaves(origin, direction, tmax, [&](uint32_t first, uint32_t count, float& leaf_tmax) {
+        bool hit = false;
+        for (uint32_t i = first; i < first + count; i++)
+            hit |= intersect(i, leaf_tmax);
+        return hit;
+    });
+}
+
+template <typename Intersector> bool BVH::Traverse(const Ray& ray, float& tmax, Intersector intersect) const {
+    return TraverseLeaves(ray, tmax, [&](uint32_t first, uint32_t count, float& leaf_tmax) {
+        bool hit = false;
+        for (uint32_t i = first; i < first + count; i++)
+            hit |= intersect(i, leaf_tmax);
+        return hit;
+    });
+}
+
+template <typename LeafIntersector> bool BVH::TraverseLeaves(const vec3f& origin, const vec3f& direction, float& tmax, LeafIntersector intersect) const {
+    vec3f inv_direction = SafeInverse(direction);
+    unsigned sign_bits = unsigned(inv_direction.x < 0) | unsigned(inv_direction.y < 0) << 1 | unsigned(inv_direction.z < 0) << 2;
+    return TraverseLeaves(origin, inv_direction, sign_bits, tmax, intersect);
+}
+
+template <typename LeafIntersector> bool BVH::TraverseLeaves(const Ray& ray, float& tmax, LeafIntersector intersect) const {
+    return TraverseLeaves(ray.GetStartingPoint(), ray.GetInverseDirection(), ray.GetSignBits(), tmax, intersect);
+}
+
+template <typename LeafIntersector> bool BVH::TraverseLeaves(const vec3f& origin, const vec3f& inv_direction, unsigned sign_bits, float& tmax, LeafIntersector intersect) const {
+    if (Empty())
+        return false;
+    if (quantization_bits == 8)
+        return width == 8 ? TraverseWide<8>(GetNodes(quantized8_8), origin, inv_direction, tmax, intersect) : TraverseWide<4>(GetNodes(quantized4_8), origin, inv_direction, tmax, intersect);
+    if (quantization_bits == 16)
+        return width == 8 ? TraverseWide<8>(GetNodes(quantized8_16), origin, inv_direction, tmax, intersect) : TraverseWide<4>(GetNodes(quantized4_16), origin, inv_direction, tmax, intersect);
+    if (width == 4)
+        return TraverseWide<4>(GetNodes(nodes4), origin, inv_direction, tmax, intersect);
+    if (width == 8)
+        return TraverseWide<8>(GetNodes(nodes8), origin, inv_direction, tmax, intersect);
+    return TraverseBinary(GetNodes(nodes), origin, inv_direction, sign_bits, tmax, intersect);
+}
+
+template <typename Intersector> bool BVH::TraverseBinary(const BVHNode* binary_nodes, const vec3f& origin, const vec3f& inv_direction, unsigned sign_bits, float& tmax, Intersector intersect) const {
+    uint32_t stack[max_depth];
+    unsigned stack_size = 0;
+    uint32_t current = 0;
+    bool hit = false;
+    while (true) {
+        const BVHNode& node = binary_nodes[current];
+        float tentry;
+        if (IntersectBox(node.bounds_min, node.bounds_max, origin, inv_direction, tmax, tentry)) {
+            if (node.IsLeaf()) {
+                hit |= intersect(node.offset, node.count, tmax);
+            } else if (bool((sign_bits >> node.axis) & 1) != bool(node.upper_first)) {
+                stack[stack_size++] = current + 1;
+                current = node.offset;
+                continue;
+            } else {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+        if (stack_size == 0)
+            break;
+        current = stack[--stack_size];
+    }
+    return hit;
+}
+
+template <unsigned wide, typename Node, typename Intersector> bool BVH::TraverseWide(const Node* wide_nodes, const vec3f& origin, const vec3f& inv_direction, float& tmax, Intersector intersect) const {
+    struct StackEntry {
+        uint32_t child;
+        uint32_t count;
+        float tentry;
+    };
+    StackEntry stack[max_depth * (wide - 1) + 1];
+    unsigned stack_size = 0;
+    stack[stack_size++] = StackEntry{ 0, 0, 0.0f };
+    bool hit = false;
+    while (stack_size > 0) {
+        StackEntry entry = stack[--stack_size];
+        if (entry.tentry > tmax)
+            continue;
+        if (entry.count > 0) {
+            hit |= intersect(entry.child, entry.count, tmax);
+            continue;
+        }
+        const Node& node = wide_nodes[entry.child];
+        float tentry[wide];
+        unsigned mask = IntersectWideBoxes<wide>(node, origin, inv_direction, tmax, tentry);
+        //push hit children farthest first so that the nearest one is popped next
+        unsigned first = stack_size;
+        while (mask) {
+            unsigned i = LowestBit(mask);
+            mask &= mask - 1;
+            StackEntry child_entry{ node.child[i], node.count[i], tentry[i] };
+            unsigned j = stack_size++;
+            while (j > first && stack[j - 1].tentry < child_entry.tentry) {
+                stack[j] = stack[j - 1];
+                j--;
+            }
+            stack[j] = child_entry;
+        }
+    }
+    return hit;
+}
+
+//_______dynamic BVH for objects inserted and removed one at a time________
+//a pointer-free binary tree with parent links: leaves are inserted next to the sibling that adds the least
+//surface area and the ancestors are rebalanced with rotations, so every edit is O(log n); a static BVH
+//built from scratch traces faster, so owners fold the dynamic leaves into it from time to time
+
+class DynamicBVH {
+    struct Node {
+        AABB bounds;
+        uint32_t parent;    //next free node while the node is on the free list
+        uint32_t child[2];
+        uint32_t primitive;
+        int height;         //0 for leaves
+        bool IsLeaf() const { return height == 0; }
+    };
+    std::vector<Node> nodes;
+    uint32_t root = null_node;
+    uint32_t free_list = null_node;
+    size_t leaf_count = 0;
+    uint32_t AllocateNode();
+    void FreeNode(uint32_t index);
+    void InsertLeaf(uint32_t leaf);
+    void RemoveLeaf(uint32_t leaf);
+    void FixUpwards(uint32_t index);
+    uint32_t Balance(uint32_t index);
+public:
+    static constexpr uint32_t null_node = 0xffffffff;
+    //returns the leaf handle, valid until the leaf is removed
+    uint32_t Insert(const AABB& bounds, uint32_t primitive);
+    void Remove(uint32_t leaf);
+    void Move(uint32_t leaf, const AABB& bounds);
+    void Clear();
+    uint32_t GetPrimitive(uint32_t leaf) const { return nodes[leaf].primitive; }
+    void SetPrimitive(uint32_t leaf, uint32_t primitive) { nodes[leaf].primitive = primitive; }
+    const AABB& GetLeafBounds(uint32_t leaf) const { return nodes[leaf].bounds; }
+    size_t GetLeafCount() const { return leaf_count; }
+    bool Empty() const { return root == null_node; }
+    int GetHeight() const { return root == null_node ? 0 : nodes[root].height; }
+    //same contract as BVH::Traverse, the callback gets the primitive given to Insert
+    template <typename Intersector> bool Traverse(const vec3f& origin, const vec3f& direction, float& tmax, Intersector intersect) const;
+    template <typename Intersector> bool Traverse(const Ray& ray, float& tmax, Intersector intersect) const;
+private:
+    template <typename Intersector> bool TraverseInverse(const vec3f& origin, const vec3f& inv_direction, float& tmax, Intersector intersect) const;
+};
+
+template <typename Intersector> bool DynamicBVH::Traverse(const vec3f& origin, const vec3f& direction, float& tmax, Intersector intersect) const {
+    return TraverseInverse(origin, SafeInverse(direction), tmax, intersect);
+}
+
+template <typename Intersector> bool DynamicBVH::Traverse(const Ray& ray, float& tmax, Intersector intersect) const {
+    return TraverseInverse(ray.GetStartingPoint(), ray.GetInverseDirection(), tmax, intersect);
+}
+
+template <typename Intersector> bool DynamicBVH::TraverseInverse(const vec3f& origin, const vec3f& inv_direction, float& tmax, Intersector intersect) const {
+    struct StackEntry {
+        uint32_t node;
+        float tentry;
+    };
+    if (root == null_node)
+        return false;
+    float tentry;
+    if (!IntersectBox(nodes[root].bounds.min, nodes[root].bounds.max, origin, inv_direction, tmax, tentry))
+        return false;
+    //the tree is height balanced, so its height stays far below max_depth for any realistic leaf count
+    StackEntry stack[BVH::max_depth];
+    unsigned stack_size = 0;
+    stack[stack_size++] = StackEntry{ root, tentry };
+    bool hit = false;
+    while (stack_size > 0) {
+        StackEntry entry = stack[--stack_size];
+        if (entry.tentry > tmax)
+            continue;
+        const Node& node = nodes[entry.node];
+        if (node.IsLeaf()) {
+            hit |= intersect(node.primitive, tmax);
+            continue;
+        }
+        const Node& first = nodes[node.child[0]];
+        const Node& second = nodes[node.child[1]];
+        float tfirst, tsecond;
+        bool hit_first = IntersectBox(first.bounds.min, first.bounds.max, origin, inv_direction, tmax, tfirst);
+        bool hit_second = IntersectBox(second.bounds.min, second.bounds.max, origin, inv_direction, tmax, tsecond);
+        if (hit_first && hit_second) {
+            if (tfirst <= tsecond) {
+                stack[stack_size++] = StackEntry{ node.child[1], tsecond };
+                stack[stack_size++] = StackEntry{ node.child[0], tfirst };
+            } else {
+                stack[stack_size++] = StackEntry{ node.child[0], tfirst };
+                stack[stack_size++] = StackEntry{ node.child[1], tsecond };
+            }
+        } else if (hit_first) {
+            stack[stack_size++] = StackEntry{ node.child[0], tfirst };
+        } else if (hit_second) {
+            stack[stack_size++] = StackEntry{ node.child[1], tsecond };
+        }
+    }
+    return hit;
+}
+
+#endif
@@ -36,11 +36,29 @@ Ray Camera::Gen_ray(unsigned x, unsigned y) {
     rand_x /= RAND_MAX;
     vec3f pixel_coords(leftdown_screen_angle + (up * pixel_size * (y + rand_y)) + (right * pixel_size * (x + rand_x)));
     Ray ray(pixel_coords - location, location, 1.0f, 0);
+    ray.SetCone(0.0f, pixel_size / screen_dist);    //the angle of one pixel
     return ray;
 }
 
+PinholeView Camera::GetView() const {
+    PinholeView view;
+    view.location = location;
+    view.right = right;
+    view.up = up;
+    view.front = front;
+    view.leftdown_screen_angle = leftdown_screen_angle;
+    view.screen_dist = screen_dist;
+    view.pixel_size = pixel_size;
+    view.width = pixel_screensize.x;
+    view.height = pixel_screensize.y;
+    return view;
+}
+
 void Camera::Render(Image& screenBuffer, Scene& scene) { 
     unsigned max_rays_number = 1;
+    VisibilityBuffer visibility;
+    if (use_visibility_buffer)
+        visibility.Build(scene, GetView());
     Pixel pixel;
     vec3f zero(0.0f, 0.0f, 0.0f);
     vec3f colour = zero;
@@ -49,10 +67,15 @@ void Camera::Render(Image& screenBuffer, Scene& scene) {
             if (i == 27 && j == 465)
                 colour = colour * 2;
             for (int k = 0; k < max_rays_number; k++){
+                if (use_visibility_buffer) {
+                    colour = colour + visibility.Shade(j, i, scene);
+                    continue;
+                }
                 Ray origin_ray = Gen_ray(j, i);
                 colour = colour + scene.Intersect(origin_ray);
             }
             colour = colour * (1.0f / max_rays_number);
+            screenBuffer.PutRadiance(j, i, colour.x, colour.y, colour.z);
             pixel.r = int(255.99 * colour.x);
             pixel.g = int(255.99 * colour.y);
             pixel.b = int(255.99 * colour.z); 
@@ -5,6 +5,7 @@
 #include "ray.h"
 #include "Image.h"
 #include "objects.h"
+#include "visibility.h"
 
 
 
@@ -19,9 +20,14 @@ class Camera {
     float screen_dist;
     vec3f leftdown_screen_angle;
     float pixel_size;
+    bool use_visibility_buffer = false;
 public:
     Camera (vec3f& location_vec, vec3f& view_vec, vec2f& phisical_screensize, vec2u& screensize, float input_fov);
     Ray Gen_ray(unsigned x, unsigned y);            //generates origin ray
+    PinholeView GetView() const;
+    //with the visibility buffer the first hits of the camera rays are rasterized once before rendering and shared by
+    //all the samples of a pixel, which then go through the pixel center instead of a random point of it
+    void SetVisibilityBuffer(bool enable) { use_visibility_buffer = enable; };
     void Render(Image& screenBuffer, Scene& scene); //renders the image of the scene to buffer
 };
 
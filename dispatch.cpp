@@ -0,0 +1,103 @@
+#include "dispatch.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define DISPATCH_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+//the tables of the kernels_<set>.cpp, only the baseline one is built off x86
+extern const Kernels baseline_kernels;
+#ifdef DISPATCH_X86
+extern const Kernels sse4_kernels;
+extern const Kernels avx2_kernels;
+extern const Kernels avx512_kernels;
+#endif
+
+namespace {
+
+#ifdef DISPATCH_X86
+void CPUID(unsigned leaf, unsigned subleaf, unsigned (&registers)[4]) {
+#ifdef _MSC_VER
+    int values[4];
+    __cpuidex(values, int(leaf), int(subleaf));
+    for (unsigned i = 0; i < 4; i++)
+        registers[i] = unsigned(values[i]);
+#else
+    __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+//the register states the operating system saves, XCR0
+uint64_t ReadXCR0() {
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    uint32_t low, high;
+    __asm__ volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+    return (uint64_t(high) << 32) | low;
+#endif
+}
+#endif
+
+const Kernels* SelectKernels(InstructionSet instruction_set) {
+#ifdef DISPATCH_X86
+    switch (instruction_set) {
+    case ISA_AVX512:
+        return &avx512_kernels;
+    case ISA_AVX2:
+        return &avx2_kernels;
+    case ISA_SSE4:
+        return &sse4_kernels;
+    default:
+        break;
+    }
+#endif
+    return &baseline_kernels;
+}
+
+}
+
+constexpr unsigned Kernels::max_triangles;
+
+const Kernels* active_kernels = SelectKernels(DetectInstructionSet());
+
+InstructionSet DetectInstructionSet() {
+#ifdef DISPATCH_X86
+    unsigned registers[4];
+    CPUID(0, 0, registers);
+    unsigned max_leaf = registers[0];
+    CPUID(1, 0, registers);
+    bool sse4 = registers[2] & (1u << 19);
+    bool osxsave = registers[2] & (1u << 27);
+    bool avx = registers[2] & (1u << 28);
+    if (!sse4)
+        return ISA_BASELINE;
+    if (!osxsave || !avx || max_leaf < 7)
+        return ISA_SSE4;
+    uint64_t xcr0 = ReadXCR0();
+    if ((xcr0 & 0x6) != 0x6)            //xmm and ymm state
+        return ISA_SSE4;
+    CPUID(7, 0, registers);
+    bool avx2 = registers[1] & (1u << 5);
+    bool avx512 = registers[1] & (1u << 16);
+    if (!avx2)
+        return ISA_SSE4;
+    if (avx512 && (xcr0 & 0xe0) == 0xe0)   //opmask and both halves of the zmm registers
+        return ISA_AVX512;
+    return ISA_AVX2;
+#else
+    return ISA_BASELINE;
+#endif
+}
+
+InstructionSet SetInstructionSet(InstructionSet instruction_set) {
+    InstructionSet detected = DetectInstructionSet();
+    if (instruction_set > detected)
+        instruction_set = detected;
+    active_kernels = SelectKernels(instruction_set);
+    return instruction_set;
+}
@@ -0,0 +1,51 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include <cstdint>
+#include <cstddef>
+#include "geometry.h"
+
+//_______hot kernels compiled once per instruction set, the best one for the CPU picked at startup_______
+//the program itself is built for the baseline (SSE2 on x86-64) and runs everywhere; kernels_<set>.cpp compile the
+//templates of kernels.h again with -msse4.1, -mavx2 or -mavx512f, and the cpuid of the machine decides which of the
+//tables below the BVH, the polygonal objects and the diffuse sampling call through
+
+enum InstructionSet {
+    ISA_BASELINE,
+    ISA_SSE4,
+    ISA_AVX2,
+    ISA_AVX512
+};
+
+struct Kernels {
+    static constexpr unsigned max_triangles = 8;
+    InstructionSet instruction_set;
+    const char* name;
+    //slab test of the eight child boxes of a wide node, bounds as [axis][child]; same contract as IntersectWideBoxes
+    unsigned (*intersect_boxes8)(const float* bounds_min, const float* bounds_max, unsigned child_count, const vec3f& origin,
+                                 const vec3f& inv_direction, float tmax, float* tentry);
+    //Moller-Trumbore against count (up to max_triangles) triangles from slot first of nine coordinate arrays
+    //([vertex][axis], stride apart, readable max_triangles past the last slot); returns the mask of those hit in
+    //front of the origin and no closer than tmin with their distances along the direction in t and the back-facing
+    //ones in inside; the operations are the ones of Polygon::Hitted, so are the results
+    unsigned (*intersect_triangles)(const float* coordinates, size_t stride, size_t first, unsigned count, const vec3f& origin,
+                                    const vec3f& direction, float tmin, float* t, unsigned& inside);
+    //the same against positions stored as 16-bit codes ([vertex][axis] arrays), decoded in the lanes as
+    //code_origin + code * code_scale per axis (VERTEX_QUANTIZED)
+    unsigned (*intersect_quantized_triangles)(const uint16_t* codes, size_t stride, const float* code_origin, const float* code_scale, size_t first,
+                                              unsigned count, const vec3f& origin, const vec3f& direction, float tmin, float* t, unsigned& inside);
+    //cosine-weighted directions around basis[2] (tangent, bitangent, normal) from count pairs of uniform numbers
+    void (*sample_cosine_hemisphere)(const vec3f* basis, unsigned count, const float* radius_squared, const float* angle, vec3f* directions);
+};
+
+//the widest set both the CPU and the operating system support (AVX state saved on context switches)
+InstructionSet DetectInstructionSet();
+//forces a narrower set than the detected one (a wider one is clamped), e.g. to compare the nodes of a farm;
+//not thread-safe, call before rendering
+InstructionSet SetInstructionSet(InstructionSet instruction_set);
+
+//the kernels in use, selected from cpuid during static initialization
+extern const Kernels* active_kernels;
+inline const Kernels& GetKernels() { return *active_kernels; }
+
+#endif
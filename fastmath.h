@@ -0,0 +1,87 @@
+#ifndef FASTMATH_H
+#define FASTMATH_H
+
+#include <cmath>
+#include "geometry.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define FASTMATH_USE_SSE
+#endif
+
+//_______polynomial approximations of libm functions for the shading path_______
+//sine and cosine are within 1e-7 of libm for |x| < 1e4 (reduced to [-pi/4, pi/4] by quadrants), rsqrt within 5e-7
+//relative; the packet version of sine and cosine gives the same results as the scalar one (checked by fastmath_test)
+
+namespace fastmath {
+
+const float two_over_pi = 0.636619772f;
+//pi / 2 split in three, the first two short enough for q * part to be exact
+const float half_pi_high = 1.5703125f;
+const float half_pi_middle = 4.837512969970703125e-4f;
+const float half_pi_low = 7.54978995489188216e-8f;
+
+//floor for the range of int, without the libm call
+inline int Floor(float x) {
+    int truncated = int(x);
+    return truncated - (float(truncated) > x);
+}
+
+//templates so that packets of floatn evaluate them in the same order as single floats
+template <typename T> inline T SinPolynomial(const T& r, const T& r2) {
+    return r + r * r2 * (-1.6666654611e-1f + r2 * (8.3321608736e-3f + r2 * -1.9515295891e-4f));
+}
+
+template <typename T> inline T CosPolynomial(const T& r2) {
+    return 1.0f - 0.5f * r2 + r2 * r2 * (4.166664568298827e-2f + r2 * (-1.388731625493765e-3f + r2 * 2.443315711809948e-5f));
+}
+
+}
+
+inline void FastSinCos(float x, float& sine, float& cosine) {
+    int quadrant = fastmath::Floor(x * fastmath::two_over_pi + 0.5f);
+    float q = float(quadrant);
+    float r = ((x - q * fastmath::half_pi_high) - q * fastmath::half_pi_middle) - q * fastmath::half_pi_low;
+    float r2 = r * r;
+    float s = fastmath::SinPolynomial(r, r2);
+    float c = fastmath::CosPolynomial(r2);
+    //odd quadrants swap sine and cosine, the signs come from bit 1 of q and of q + 1
+    bool swap = quadrant & 1;
+    sine = swap ? c : s;
+    cosine = swap ? s : c;
+    sine = (quadrant & 2) ? -sine : sine;
+    cosine = ((quadrant + 1) & 2) ? -cosine : cosine;
+}
+
+//the same for a packet of any width, equal to the scalar version lane by lane; the quadrant bits come from q in floats
+template <unsigned width> void FastSinCos(const floatn<width>& x, floatn<width>& sine, floatn<width>& cosine) {
+    floatn<width> q = Floor(x * fastmath::two_over_pi + 0.5f);
+    floatn<width> r = ((x - q * fastmath::half_pi_high) - q * fastmath::half_pi_middle) - q * fastmath::half_pi_low;
+    floatn<width> r2 = r * r;
+    floatn<width> s = fastmath::SinPolynomial(r, r2);
+    floatn<width> c = fastmath::CosPolynomial(r2);
+    floatn<width> odd = q - Floor(q * 0.5f) * 2.0f;
+    floatn<width> quadrant = q - Floor(q * 0.25f) * 4.0f;
+    maskn<width> swap = odd > 0.5f;
+    floatn<width> swapped_sine = Select(swap, c, s);
+    floatn<width> swapped_cosine = Select(swap, s, c);
+    sine = Select(quadrant > 1.5f, -swapped_sine, swapped_sine);
+    cosine = Select((quadrant > 0.5f) & (quadrant < 2.5f), -swapped_cosine, swapped_cosine);
+}
+
+inline float Pow5(float x) {
+    float x2 = x * x;
+    return x2 * x2 * x;
+}
+
+//the hardware estimate refined by one Newton step
+inline float FastRsqrt(float x) {
+#ifdef FASTMATH_USE_SSE
+    float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    return y * (1.5f - 0.5f * x * y * y);
+#else
+    return 1.0f / std::sqrt(x);
+#endif
+}
+
+#endif
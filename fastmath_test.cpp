@@ -0,0 +1,80 @@
+#include <cstdio>
+#include <cmath>
+#include <cstring>
+
+#include "fastmath.h"
+
+//checks the approximations of fastmath.h against libm over their documented ranges
+//usage: fastmath_test, returns non-zero if a bound is exceeded
+
+namespace {
+
+int failures = 0;
+
+void Check(const char* name, double max_error, double bound) {
+    bool passed = max_error <= bound;
+    printf("%-24s %12.3e %12.3e %s\n", name, max_error, bound, passed ? "ok" : "FAILED");
+    if (!passed)
+        failures++;
+}
+
+void CheckSinCos() {
+    const int steps = 4000000;
+    const float range = 1e4f;
+    double sine_error = 0.0, cosine_error = 0.0;
+    unsigned packet_mismatches = 0;
+    float x[4], packet_sine[4], packet_cosine[4];
+    for (int i = 0; i < steps; i += 4) {
+        for (int lane = 0; lane < 4; lane++)
+            x[lane] = -range + 2.0f * range * float(i + lane) / steps;
+        floatn<4> sine4, cosine4;
+        FastSinCos(floatn<4>::Load(x), sine4, cosine4);
+        sine4.Store(packet_sine);
+        cosine4.Store(packet_cosine);
+        for (int lane = 0; lane < 4; lane++) {
+            float sine, cosine;
+            FastSinCos(x[lane], sine, cosine);
+            sine_error = std::fmax(sine_error, std::fabs(sine - std::sin(double(x[lane]))));
+            cosine_error = std::fmax(cosine_error, std::fabs(cosine - std::cos(double(x[lane]))));
+            if (memcmp(&sine, &packet_sine[lane], sizeof(float)) != 0 || memcmp(&cosine, &packet_cosine[lane], sizeof(float)) != 0)
+                packet_mismatches++;
+        }
+    }
+    Check("FastSinCos sine abs", sine_error, 1e-7);
+    Check("FastSinCos cosine abs", cosine_error, 1e-7);
+    Check("FastSinCos packet diff", packet_mismatches, 0);
+}
+
+//Schlick's term takes 1 - cos in [0, 1]
+void CheckPow5() {
+    const int steps = 1000000;
+    double error = 0.0;
+    for (int i = 1; i <= steps; i++) {
+        float x = float(i) / steps;
+        double exact = std::pow(double(x), 5.0);
+        error = std::fmax(error, std::fabs(Pow5(x) - exact) / exact);
+    }
+    Check("Pow5 rel", error, 1e-6);
+}
+
+//squared lengths of directions, from tiny to huge
+void CheckRsqrt() {
+    const int steps = 1000000;
+    double error = 0.0;
+    for (int i = 0; i <= steps; i++) {
+        float x = std::pow(10.0f, -30.0f + 60.0f * float(i) / steps);
+        double exact = 1.0 / std::sqrt(double(x));
+        error = std::fmax(error, std::fabs(FastRsqrt(x) - exact) / exact);
+    }
+    Check("FastRsqrt rel", error, 5e-7);
+}
+
+}
+
+int main() {
+    printf("%-24s %12s %12s\n", "function", "max error", "bound");
+    CheckSinCos();
+    CheckPow5();
+    CheckRsqrt();
+    return failures == 0 ? 0 : 1;
+}
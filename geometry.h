@@ -3,7 +3,224 @@
 
 #include <cmath>
 #include <cassert>
+#include <cstdint>
 #include <iostream>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define GEOMETRY_USE_SSE
+#endif
+
+inline float Sqrt(float x) { return std::sqrt(x); }
+
+//_______SIMD lanes for SoA packets_______________________
+//floatn<4> is four floats in an SSE register, floatn<8> eight in an AVX one and floatn<16> sixteen in an AVX-512 one,
+//other widths (or no SIMD) fall back to loops over an array; comparisons give lane masks. vec<3, float4> is then a packet of four 3D vectors with the same
+//operators, dot (*), cross and normalize as vec3f, so packet kernels are written once for every instruction set.
+//The same lanes compile to other instructions in the translation units built for wider sets (dispatch.h), the inline
+//namespace gives each set its own symbols so that the linker never hands an AVX copy to code running on an SSE machine
+
+#if defined(__AVX512F__)
+#define GEOMETRY_ISA isa_avx512
+#elif defined(__AVX2__)
+#define GEOMETRY_ISA isa_avx2
+#elif defined(__AVX__)
+#define GEOMETRY_ISA isa_avx
+#elif defined(__SSE4_1__)
+#define GEOMETRY_ISA isa_sse4
+#else
+#define GEOMETRY_ISA isa_baseline
+#endif
+
+inline namespace GEOMETRY_ISA {
+
+template <unsigned width> struct maskn {
+    bool lane[width];
+    unsigned Bits() const { unsigned bits = 0; for (unsigned i = 0; i < width; i++) bits |= unsigned(lane[i]) << i; return bits; }
+    friend maskn operator&(maskn lhs, const maskn& rhs) { for (unsigned i = 0; i < width; i++) lhs.lane[i] = lhs.lane[i] && rhs.lane[i]; return lhs; }
+    friend maskn operator|(maskn lhs, const maskn& rhs) { for (unsigned i = 0; i < width; i++) lhs.lane[i] = lhs.lane[i] || rhs.lane[i]; return lhs; }
+    friend maskn operator~(maskn mask) { for (unsigned i = 0; i < width; i++) mask.lane[i] = !mask.lane[i]; return mask; }
+};
+
+template <unsigned width> struct floatn {
+    float lane[width];
+    floatn() { for (unsigned i = 0; i < width; i++) lane[i] = 0.0f; }
+    floatn(float value) { for (unsigned i = 0; i < width; i++) lane[i] = value; }     //broadcast
+    static floatn Load(const float* values) { floatn res; for (unsigned i = 0; i < width; i++) res.lane[i] = values[i]; return res; }
+    static floatn LoadU16(const uint16_t* values) { floatn res; for (unsigned i = 0; i < width; i++) res.lane[i] = float(values[i]); return res; }   //widened exactly
+    void Store(float* values) const { for (unsigned i = 0; i < width; i++) values[i] = lane[i]; }
+    floatn& operator+=(const floatn& rhs) { for (unsigned i = 0; i < width; i++) lane[i] += rhs.lane[i]; return *this; }
+    floatn& operator-=(const floatn& rhs) { for (unsigned i = 0; i < width; i++) lane[i] -= rhs.lane[i]; return *this; }
+    floatn& operator*=(const floatn& rhs) { for (unsigned i = 0; i < width; i++) lane[i] *= rhs.lane[i]; return *this; }
+    floatn& operator/=(const floatn& rhs) { for (unsigned i = 0; i < width; i++) lane[i] /= rhs.lane[i]; return *this; }
+    friend floatn operator+(floatn lhs, const floatn& rhs) { return lhs += rhs; }
+    friend floatn operator-(floatn lhs, const floatn& rhs) { return lhs -= rhs; }
+    friend floatn operator*(floatn lhs, const floatn& rhs) { return lhs *= rhs; }
+    friend floatn operator/(floatn lhs, const floatn& rhs) { return lhs /= rhs; }
+    friend floatn operator-(floatn value) { for (unsigned i = 0; i < width; i++) value.lane[i] = -value.lane[i]; return value; }
+    friend maskn<width> operator<(const floatn& lhs, const floatn& rhs) { maskn<width> res; for (unsigned i = 0; i < width; i++) res.lane[i] = lhs.lane[i] < rhs.lane[i]; return res; }
+    friend maskn<width> operator<=(const floatn& lhs, const floatn& rhs) { maskn<width> res; for (unsigned i = 0; i < width; i++) res.lane[i] = lhs.lane[i] <= rhs.lane[i]; return res; }
+    friend maskn<width> operator>(const floatn& lhs, const floatn& rhs) { return rhs < lhs; }
+    friend maskn<width> operator>=(const floatn& lhs, const floatn& rhs) { return rhs <= lhs; }
+    //the second operand when either is NaN, like minps and maxps
+    friend floatn Min(floatn lhs, const floatn& rhs) { for (unsigned i = 0; i < width; i++) lhs.lane[i] = lhs.lane[i] < rhs.lane[i] ? lhs.lane[i] : rhs.lane[i]; return lhs; }
+    friend floatn Max(floatn lhs, const floatn& rhs) { for (unsigned i = 0; i < width; i++) lhs.lane[i] = lhs.lane[i] > rhs.lane[i] ? lhs.lane[i] : rhs.lane[i]; return lhs; }
+    friend floatn Sqrt(floatn value) { for (unsigned i = 0; i < width; i++) value.lane[i] = std::sqrt(value.lane[i]); return value; }
+    friend floatn Floor(floatn value) { for (unsigned i = 0; i < width; i++) value.lane[i] = std::floor(value.lane[i]); return value; }
+    friend floatn Select(const maskn<width>& mask, floatn lhs, const floatn& rhs) { for (unsigned i = 0; i < width; i++) lhs.lane[i] = mask.lane[i] ? lhs.lane[i] : rhs.lane[i]; return lhs; }
+};
+
+#ifdef GEOMETRY_USE_SSE
+template <> struct maskn<4> {
+    __m128 v;
+    maskn() : v(_mm_setzero_ps()) {}
+    explicit maskn(__m128 in_v) : v(in_v) {}
+    unsigned Bits() const { return unsigned(_mm_movemask_ps(v)); }
+    friend maskn operator&(const maskn& lhs, const maskn& rhs) { return maskn(_mm_and_ps(lhs.v, rhs.v)); }
+    friend maskn operator|(const maskn& lhs, const maskn& rhs) { return maskn(_mm_or_ps(lhs.v, rhs.v)); }
+    friend maskn operator~(const maskn& mask) { return maskn(_mm_xor_ps(mask.v, _mm_castsi128_ps(_mm_set1_epi32(-1)))); }
+};
+
+template <> struct floatn<4> {
+    __m128 v;
+    floatn() : v(_mm_setzero_ps()) {}
+    floatn(float value) : v(_mm_set1_ps(value)) {}
+    explicit floatn(__m128 in_v) : v(in_v) {}
+    static floatn Load(const float* values) { return floatn(_mm_loadu_ps(values)); }
+    static floatn LoadU16(const uint16_t* values) {
+        return floatn(_mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(values)), _mm_setzero_si128())));
+    }
+    void Store(float* values) const { _mm_storeu_ps(values, v); }
+    floatn& operator+=(const floatn& rhs) { v = _mm_add_ps(v, rhs.v); return *this; }
+    floatn& operator-=(const floatn& rhs) { v = _mm_sub_ps(v, rhs.v); return *this; }
+    floatn& operator*=(const floatn& rhs) { v = _mm_mul_ps(v, rhs.v); return *this; }
+    floatn& operator/=(const floatn& rhs) { v = _mm_div_ps(v, rhs.v); return *this; }
+    friend floatn operator+(floatn lhs, const floatn& rhs) { return lhs += rhs; }
+    friend floatn operator-(floatn lhs, const floatn& rhs) { return lhs -= rhs; }
+    friend floatn operator*(floatn lhs, const floatn& rhs) { return lhs *= rhs; }
+    friend floatn operator/(floatn lhs, const floatn& rhs) { return lhs /= rhs; }
+    friend floatn operator-(const floatn& value) { return floatn(_mm_xor_ps(value.v, _mm_set1_ps(-0.0f))); }
+    friend maskn<4> operator<(const floatn& lhs, const floatn& rhs) { return maskn<4>(_mm_cmplt_ps(lhs.v, rhs.v)); }
+    friend maskn<4> operator<=(const floatn& lhs, const floatn& rhs) { return maskn<4>(_mm_cmple_ps(lhs.v, rhs.v)); }
+    friend maskn<4> operator>(const floatn& lhs, const floatn& rhs) { return maskn<4>(_mm_cmpgt_ps(lhs.v, rhs.v)); }
+    friend maskn<4> operator>=(const floatn& lhs, const floatn& rhs) { return maskn<4>(_mm_cmpge_ps(lhs.v, rhs.v)); }
+    friend floatn Min(const floatn& lhs, const floatn& rhs) { return floatn(_mm_min_ps(lhs.v, rhs.v)); }
+    friend floatn Max(const floatn& lhs, const floatn& rhs) { return floatn(_mm_max_ps(lhs.v, rhs.v)); }
+    friend floatn Sqrt(const floatn& value) { return floatn(_mm_sqrt_ps(value.v)); }
+#ifdef __SSE4_1__
+    friend floatn Floor(const floatn& value) { return floatn(_mm_floor_ps(value.v)); }
+    friend floatn Select(const maskn<4>& mask, const floatn& lhs, const floatn& rhs) { return floatn(_mm_blendv_ps(rhs.v, lhs.v, mask.v)); }
+#else
+    //truncation corrected below zero; from 2^23 up every float is an integer already (and may not fit an int)
+    friend floatn Floor(const floatn& value) {
+        __m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(value.v));
+        __m128 floored = _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, value.v), _mm_set1_ps(1.0f)));
+        return Select(maskn<4>(_mm_cmplt_ps(_mm_andnot_ps(_mm_set1_ps(-0.0f), value.v), _mm_set1_ps(8388608.0f))), floatn(floored), value);
+    }
+    friend floatn Select(const maskn<4>& mask, const floatn& lhs, const floatn& rhs) { return floatn(_mm_or_ps(_mm_and_ps(mask.v, lhs.v), _mm_andnot_ps(mask.v, rhs.v))); }
+#endif
+};
+#endif
+
+#ifdef __AVX__
+template <> struct maskn<8> {
+    __m256 v;
+    maskn() : v(_mm256_setzero_ps()) {}
+    explicit maskn(__m256 in_v) : v(in_v) {}
+    unsigned Bits() const { return unsigned(_mm256_movemask_ps(v)); }
+    friend maskn operator&(const maskn& lhs, const maskn& rhs) { return maskn(_mm256_and_ps(lhs.v, rhs.v)); }
+    friend maskn operator|(const maskn& lhs, const maskn& rhs) { return maskn(_mm256_or_ps(lhs.v, rhs.v)); }
+    friend maskn operator~(const maskn& mask) { return maskn(_mm256_xor_ps(mask.v, _mm256_castsi256_ps(_mm256_set1_epi32(-1)))); }
+};
+
+template <> struct floatn<8> {
+    __m256 v;
+    floatn() : v(_mm256_setzero_ps()) {}
+    floatn(float value) : v(_mm256_set1_ps(value)) {}
+    explicit floatn(__m256 in_v) : v(in_v) {}
+    static floatn Load(const float* values) { return floatn(_mm256_loadu_ps(values)); }
+#ifdef __AVX2__
+    static floatn LoadU16(const uint16_t* values) { return floatn(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(values))))); }
+#else
+    static floatn LoadU16(const uint16_t* values) {
+        __m128i codes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values));
+        __m128 low = _mm_cvtepi32_ps(_mm_unpacklo_epi16(codes, _mm_setzero_si128()));
+        __m128 high = _mm_cvtepi32_ps(_mm_unpackhi_epi16(codes, _mm_setzero_si128()));
+        return floatn(_mm256_insertf128_ps(_mm256_castps128_ps256(low), high, 1));
+    }
+#endif
+    void Store(float* values) const { _mm256_storeu_ps(values, v); }
+    floatn& operator+=(const floatn& rhs) { v = _mm256_add_ps(v, rhs.v); return *this; }
+    floatn& operator-=(const floatn& rhs) { v = _mm256_sub_ps(v, rhs.v); return *this; }
+    floatn& operator*=(const floatn& rhs) { v = _mm256_mul_ps(v, rhs.v); return *this; }
+    floatn& operator/=(const floatn& rhs) { v = _mm256_div_ps(v, rhs.v); return *this; }
+    friend floatn operator+(floatn lhs, const floatn& rhs) { return lhs += rhs; }
+    friend floatn operator-(floatn lhs, const floatn& rhs) { return lhs -= rhs; }
+    friend floatn operator*(floatn lhs, const floatn& rhs) { return lhs *= rhs; }
+    friend floatn operator/(floatn lhs, const floatn& rhs) { return lhs /= rhs; }
+    friend floatn operator-(const floatn& value) { return floatn(_mm256_xor_ps(value.v, _mm256_set1_ps(-0.0f))); }
+    friend maskn<8> operator<(const floatn& lhs, const floatn& rhs) { return maskn<8>(_mm256_cmp_ps(lhs.v, rhs.v, _CMP_LT_OQ)); }
+    friend maskn<8> operator<=(const floatn& lhs, const floatn& rhs) { return maskn<8>(_mm256_cmp_ps(lhs.v, rhs.v, _CMP_LE_OQ)); }
+    friend maskn<8> operator>(const floatn& lhs, const floatn& rhs) { return maskn<8>(_mm256_cmp_ps(lhs.v, rhs.v, _CMP_GT_OQ)); }
+    friend maskn<8> operator>=(const floatn& lhs, const floatn& rhs) { return maskn<8>(_mm256_cmp_ps(lhs.v, rhs.v, _CMP_GE_OQ)); }
+    friend floatn Min(const floatn& lhs, const floatn& rhs) { return floatn(_mm256_min_ps(lhs.v, rhs.v)); }
+    friend floatn Max(const floatn& lhs, const floatn& rhs) { return floatn(_mm256_max_ps(lhs.v, rhs.v)); }
+    friend floatn Sqrt(const floatn& value) { return floatn(_mm256_sqrt_ps(value.v)); }
+    friend floatn Floor(const floatn& value) { return floatn(_mm256_floor_ps(value.v)); }
+    friend floatn Select(const maskn<8>& mask, const floatn& lhs, const floatn& rhs) { return floatn(_mm256_blendv_ps(rhs.v, lhs.v, mask.v)); }
+};
+#endif
+
+#ifdef __AVX512F__
+template <> struct maskn<16> {
+    __mmask16 k;
+    maskn() : k(0) {}
+    explicit maskn(__mmask16 in_k) : k(in_k) {}
+    unsigned Bits() const { return unsigned(k); }
+    friend maskn operator&(const maskn& lhs, const maskn& rhs) { return maskn(__mmask16(lhs.k & rhs.k)); }
+    friend maskn operator|(const maskn& lhs, const maskn& rhs) { return maskn(__mmask16(lhs.k | rhs.k)); }
+    friend maskn operator~(const maskn& mask) { return maskn(__mmask16(~mask.k)); }
+};
+
+template <> struct floatn<16> {
+    __m512 v;
+    floatn() : v(_mm512_setzero_ps()) {}
+    floatn(float value) : v(_mm512_set1_ps(value)) {}
+    explicit floatn(__m512 in_v) : v(in_v) {}
+    static floatn Load(const float* values) { return floatn(_mm512_loadu_ps(values)); }
+    static floatn LoadU16(const uint16_t* values) { return floatn(_mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(values))))); }
+    void Store(float* values) const { _mm512_storeu_ps(values, v); }
+    floatn& operator+=(const floatn& rhs) { v = _mm512_add_ps(v, rhs.v); return *this; }
+    floatn& operator-=(const floatn& rhs) { v = _mm512_sub_ps(v, rhs.v); return *this; }
+    floatn& operator*=(const floatn& rhs) { v = _mm512_mul_ps(v, rhs.v); return *this; }
+    floatn& operator/=(const floatn& rhs) { v = _mm512_div_ps(v, rhs.v); return *this; }
+    friend floatn operator+(floatn lhs, const floatn& rhs) { return lhs += rhs; }
+    friend floatn operator-(floatn lhs, const floatn& rhs) { return lhs -= rhs; }
+    friend floatn operator*(floatn lhs, const floatn& rhs) { return lhs *= rhs; }
+    friend floatn operator/(floatn lhs, const floatn& rhs) { return lhs /= rhs; }
+    friend floatn operator-(const floatn& value) { return floatn(_mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(value.v), _mm512_set1_epi32(int(0x80000000u))))); }
+    friend maskn<16> operator<(const floatn& lhs, const floatn& rhs) { return maskn<16>(_mm512_cmp_ps_mask(lhs.v, rhs.v, _CMP_LT_OQ)); }
+    friend maskn<16> operator<=(const floatn& lhs, const floatn& rhs) { return maskn<16>(_mm512_cmp_ps_mask(lhs.v, rhs.v, _CMP_LE_OQ)); }
+    friend maskn<16> operator>(const floatn& lhs, const floatn& rhs) { return maskn<16>(_mm512_cmp_ps_mask(lhs.v, rhs.v, _CMP_GT_OQ)); }
+    friend maskn<16> operator>=(const floatn& lhs, const floatn& rhs) { return maskn<16>(_mm512_cmp_ps_mask(lhs.v, rhs.v, _CMP_GE_OQ)); }
+    friend floatn Min(const floatn& lhs, const floatn& rhs) { return floatn(_mm512_min_ps(lhs.v, rhs.v)); }
+    friend floatn Max(const floatn& lhs, const floatn& rhs) { return floatn(_mm512_max_ps(lhs.v, rhs.v)); }
+    friend floatn Sqrt(const floatn& value) { return floatn(_mm512_sqrt_ps(value.v)); }
+    friend floatn Floor(const floatn& value) { return floatn(_mm512_roundscale_ps(value.v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)); }
+    friend floatn Select(const maskn<16>& mask, const floatn& lhs, const floatn& rhs) { return floatn(_mm512_mask_blend_ps(mask.k, rhs.v, lhs.v)); }
+};
+#endif
+
+typedef floatn<4> float4;
+typedef floatn<8> float8;
+typedef maskn<4> mask4;
+typedef maskn<8> mask8;
+
+template <unsigned width> bool Any(const maskn<width>& mask) { return mask.Bits() != 0; }
+template <unsigned width> bool All(const maskn<width>& mask) { return mask.Bits() == (1u << width) - 1; }
+
+}
 
 template <size_t dim, typename T> struct vec {
     vec() { for (size_t i = 0; i < dim; i++) data[i] = T(); }
@@ -17,6 +234,8 @@ typedef vec<2, float> vec2f;
 typedef vec<2, unsigned> vec2u;
 typedef vec<3, float> vec3f;
 typedef vec<3, unsigned> vec3u;
+typedef vec<3, float4> vec3f4;     //SoA packets of 3D vectors
+typedef vec<3, float8> vec3f8;
 
 template <typename T> struct vec<2, T> {
     vec() : x(), y() {} 
@@ -27,13 +246,16 @@ template <typename T> struct vec<2, T> {
     T x, y; 
 };
 
+//lengths of integer vectors are floats, those of float and packet vectors have their own type
+template <typename T> using NormType = typename std::conditional<std::is_integral<T>::value, float, T>::type;
+
 template <typename T> struct vec<3, T> {
     vec() : x(), y(), z() {} 
     vec(const T X, const T Y, const T Z) : x(X), y(Y), z(Z) {}
     T&       operator[](const size_t i)       { assert(i < 3); return i <= 0 ? x : (1 == i ? y : z); }
     const T& operator[](const size_t i) const { assert(i < 3); return i <= 0 ? x : (1 == i ? y : z); }
     void operator=(const vec<2,T>& rhs) {x = rhs.x; y = rhs.y; z = rhs.z;}
-    float norm() const {return std::sqrt(x*x + y*y + z*z);}
+    NormType<T> norm() const {return Sqrt(NormType<T>(x*x + y*y + z*z));}
     vec<3, T>& normalize() { *this = (*this) * (1 / norm()); return *this; }
     T x, y, z; 
 };
@@ -72,6 +294,75 @@ template <typename T> vec<3,T> cross(vec<3,T> v1, vec<3,T> v2) {
     return vec<3,T>(v1.y*v2.z - v1.z*v2.y, v1.z*v2.x - v1.x*v2.z, v1.x*v2.y - v1.y*v2.x);
 }
 
+//the same vector in every lane of a packet
+template <unsigned width> vec<3, floatn<width>> Broadcast(const vec<3, float>& v) {
+    return vec<3, floatn<width>>(floatn<width>(v.x), floatn<width>(v.y), floatn<width>(v.z));
+}
+
+template <unsigned width> vec<3, floatn<width>> Select(const maskn<width>& mask, const vec<3, floatn<width>>& lhs, const vec<3, floatn<width>>& rhs) {
+    return vec<3, floatn<width>>(Select(mask, lhs.x, rhs.x), Select(mask, lhs.y, rhs.y), Select(mask, lhs.z, rhs.z));
+}
+
+//_______3x4 affine transform: 3x3 linear part with the translation in the last column_______
+
+template <typename T> struct mat3x4 {
+    mat3x4() { for (size_t i = 0; i < 3; i++) for (size_t j = 0; j < 4; j++) data[i][j] = (i == j) ? T(1) : T(0); }
+    T*       operator[](const size_t i)       { assert(i < 3); return data[i]; }
+    const T* operator[](const size_t i) const { assert(i < 3); return data[i]; }
+    static mat3x4<T> Translation(const vec<3,T>& offset) { mat3x4<T> res; res[0][3] = offset.x; res[1][3] = offset.y; res[2][3] = offset.z; return res; }
+    static mat3x4<T> Scale(const vec<3,T>& factors) { mat3x4<T> res; res[0][0] = factors.x; res[1][1] = factors.y; res[2][2] = factors.z; return res; }
+    static mat3x4<T> Rotation(vec<3,T> axis, T angle);     //rotation around the axis through the origin, Rodrigues' formula
+    vec<3,T> TransformPoint(const vec<3,T>& p) const  { return vec<3,T>(data[0][0]*p.x + data[0][1]*p.y + data[0][2]*p.z + data[0][3], data[1][0]*p.x + data[1][1]*p.y + data[1][2]*p.z + data[1][3], data[2][0]*p.x + data[2][1]*p.y + data[2][2]*p.z + data[2][3]); }
+    vec<3,T> TransformVector(const vec<3,T>& v) const { return vec<3,T>(data[0][0]*v.x + data[0][1]*v.y + data[0][2]*v.z, data[1][0]*v.x + data[1][1]*v.y + data[1][2]*v.z, data[2][0]*v.x + data[2][1]*v.y + data[2][2]*v.z); }
+    vec<3,T> TransformTransposed(const vec<3,T>& v) const { return vec<3,T>(data[0][0]*v.x + data[1][0]*v.y + data[2][0]*v.z, data[0][1]*v.x + data[1][1]*v.y + data[2][1]*v.z, data[0][2]*v.x + data[1][2]*v.y + data[2][2]*v.z); } //normals go through the transposed inverse
+    mat3x4<T> Inverse() const;
+private:
+    T data[3][4];
+};
+
+typedef mat3x4<float> mat3x4f;
+
+template <typename T> mat3x4<T> mat3x4<T>::Rotation(vec<3,T> axis, T angle) {
+    axis.normalize();
+    T c = std::cos(angle), s = std::sin(angle), t = 1 - c;
+    mat3x4<T> res;
+    res[0][0] = t*axis.x*axis.x + c;        res[0][1] = t*axis.x*axis.y - s*axis.z; res[0][2] = t*axis.x*axis.z + s*axis.y;
+    res[1][0] = t*axis.x*axis.y + s*axis.z; res[1][1] = t*axis.y*axis.y + c;        res[1][2] = t*axis.y*axis.z - s*axis.x;
+    res[2][0] = t*axis.x*axis.z - s*axis.y; res[2][1] = t*axis.y*axis.z + s*axis.x; res[2][2] = t*axis.z*axis.z + c;
+    return res;
+}
+
+template <typename T> mat3x4<T> mat3x4<T>::Inverse() const {
+    const mat3x4<T>& m = *this;
+    T det = m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1]) - m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0]) + m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+    T inv_det = T(1) / det;
+    mat3x4<T> res;
+    res[0][0] = (m[1][1]*m[2][2] - m[1][2]*m[2][1]) * inv_det;
+    res[0][1] = (m[0][2]*m[2][1] - m[0][1]*m[2][2]) * inv_det;
+    res[0][2] = (m[0][1]*m[1][2] - m[0][2]*m[1][1]) * inv_det;
+    res[1][0] = (m[1][2]*m[2][0] - m[1][0]*m[2][2]) * inv_det;
+    res[1][1] = (m[0][0]*m[2][2] - m[0][2]*m[2][0]) * inv_det;
+    res[1][2] = (m[0][2]*m[1][0] - m[0][0]*m[1][2]) * inv_det;
+    res[2][0] = (m[1][0]*m[2][1] - m[1][1]*m[2][0]) * inv_det;
+    res[2][1] = (m[0][1]*m[2][0] - m[0][0]*m[2][1]) * inv_det;
+    res[2][2] = (m[0][0]*m[1][1] - m[0][1]*m[1][0]) * inv_det;
+    vec<3,T> translation = -res.TransformVector(vec<3,T>(m[0][3], m[1][3], m[2][3]));
+    res[0][3] = translation.x; res[1][3] = translation.y; res[2][3] = translation.z;
+    return res;
+}
+
+template <typename T> mat3x4<T> operator*(const mat3x4<T>& lhs, const mat3x4<T>& rhs) {   //applies rhs first
+    mat3x4<T> res;
+    for (size_t i = 0; i < 3; i++) {
+        for (size_t j = 0; j < 4; j++) {
+            res[i][j] = lhs[i][0]*rhs[0][j] + lhs[i][1]*rhs[1][j] + lhs[i][2]*rhs[2][j];
+            if (j == 3)
+                res[i][j] += lhs[i][3];
+        }
+    }
+    return res;
+}
+
 template <size_t dim, typename T> std::ostream& operator<<(std::ostream& out, const vec<dim,T>& v) {
     for(size_t i = 0; i < dim; i++)
         out << v[i] << " " ;
@@ -0,0 +1,69 @@
+#include <cmath>
+#include <numeric>
+
+#include "grid.h"
+
+void UniformGrid::GetCellRange(const AABB& box, unsigned* first, unsigned* last) const {
+    float box_min[3] = { box.min.x - bounds.min.x, box.min.y - bounds.min.y, box.min.z - bounds.min.z };
+    float box_max[3] = { box.max.x - bounds.min.x, box.max.y - bounds.min.y, box.max.z - bounds.min.z };
+    for (unsigned axis = 0; axis < 3; axis++) {
+        int lower = int(box_min[axis] * inv_cell_size[axis]);
+        int upper = int(box_max[axis] * inv_cell_size[axis]);
+        first[axis] = unsigned(std::min(std::max(lower, 0), int(resolution[axis]) - 1));
+        last[axis] = unsigned(std::min(std::max(upper, 0), int(resolution[axis]) - 1));
+    }
+}
+
+void UniformGrid::Build(const std::vector<AABB>& primitive_bounds, const GridBuildOptions& options) {
+    bounds = AABB();
+    cell_offsets.clear();
+    cell_primitives.clear();
+    primitive_indices.resize(primitive_bounds.size());
+    std::iota(primitive_indices.begin(), primitive_indices.end(), 0u);
+    if (primitive_bounds.empty())
+        return;
+    for (size_t i = 0; i < primitive_bounds.size(); i++)
+        bounds.Extend(primitive_bounds[i]);
+
+    //cubic-ish cells, sized so that there are about density cells per primitive; flat scenes get a thin slab
+    vec3f extent = bounds.Extent();
+    float largest_extent = std::max(extent.x, std::max(extent.y, extent.z));
+    float min_extent = std::max(largest_extent * 1e-3f, 1e-6f);
+    float grid_extent[3] = { std::max(extent.x, min_extent), std::max(extent.y, min_extent), std::max(extent.z, min_extent) };
+    float volume = grid_extent[0] * grid_extent[1] * grid_extent[2];
+    float cells_per_unit = std::cbrt(options.density * primitive_bounds.size() / volume);
+    for (unsigned axis = 0; axis < 3; axis++) {
+        float cells = std::floor(grid_extent[axis] * cells_per_unit);
+        resolution[axis] = unsigned(std::min(std::max(cells, 1.0f), float(options.max_resolution)));
+        cell_size[axis] = grid_extent[axis] / resolution[axis];
+        inv_cell_size[axis] = 1.0f / cell_size[axis];
+    }
+    bounds.max = bounds.min + vec3f(grid_extent[0], grid_extent[1], grid_extent[2]);
+
+    //count the references of every cell, turn the counts into offsets and scatter
+    size_t cell_count = size_t(resolution[0]) * resolution[1] * resolution[2];
+    cell_offsets.assign(cell_count + 1, 0);
+    unsigned first[3], last[3];
+    for (size_t i = 0; i < primitive_bounds.size(); i++) {
+        GetCellRange(primitive_bounds[i], first, last);
+        for (unsigned z = first[2]; z <= last[2]; z++)
+            for (unsigned y = first[1]; y <= last[1]; y++)
+                for (unsigned x = first[0]; x <= last[0]; x++)
+                    cell_offsets[x + resolution[0] * (y + resolution[1] * z) + 1]++;
+    }
+    for (size_t i = 0; i < cell_count; i++)
+        cell_offsets[i + 1] += cell_offsets[i];
+    cell_primitives.resize(cell_offsets[cell_count]);
+    std::vector<uint32_t> fill(cell_offsets.begin(), cell_offsets.end() - 1);
+    for (size_t i = 0; i < primitive_bounds.size(); i++) {
+        GetCellRange(primitive_bounds[i], first, last);
+        for (unsigned z = first[2]; z <= last[2]; z++)
+            for (unsigned y = first[1]; y <= last[1]; y++)
+                for (unsigned x = first[0]; x <= last[0]; x++)
+                    cell_primitives[fill[x + resolution[0] * (y + resolution[1] * z)]++] = uint32_t(i);
+    }
+}
+
+size_t UniformGrid::GetMemoryUsage() const {
+    return cell_offsets.capacity() * sizeof(uint32_t) + cell_primitives.capacity() * sizeof(uint32_t) + primitive_indices.capacity() * sizeof(uint32_t);
+}
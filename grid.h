@@ -0,0 +1,93 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include <vector>
+#include <cstdint>
+#include "geometry.h"
+#include "bvh.h"
+
+struct GridBuildOptions {
+    float density = 4.0f;           //cells per primitive
+    unsigned max_resolution = 512;  //cells along one axis
+};
+
+//_______uniform grid traversed with 3D-DDA________________________
+//cells list the primitives overlapping them in one compressed array; a primitive overlapping
+//several cells is skipped after its first test along a ray thanks to a small per-ray mailbox
+
+class UniformGrid {
+    AABB bounds;
+    unsigned resolution[3] = { 0, 0, 0 };
+    float cell_size[3];
+    float inv_cell_size[3];
+    std::vector<uint32_t> cell_offsets;     //primitives of cell i are cell_primitives[cell_offsets[i], cell_offsets[i + 1])
+    std::vector<uint32_t> cell_primitives;
+    std::vector<uint32_t> primitive_indices;
+    void GetCellRange(const AABB& box, unsigned* first, unsigned* last) const;
+public:
+    static constexpr unsigned mailbox_size = 16;
+    void Build(const std::vector<AABB>& primitive_bounds, const GridBuildOptions& options = GridBuildOptions());
+    bool Empty() const { return cell_offsets.empty(); }
+    AABB GetBounds() const { return bounds; }
+    size_t GetMemoryUsage() const;
+    //slots are the primitives themselves, kept for the same layout contract as BVH
+    const std::vector<uint32_t>& GetPrimitiveIndices() const { return primitive_indices; }
+    //same contract as BVH::Traverse, cells are visited front to back until one starts beyond tmax
+    template <typename Intersector> bool Traverse(const vec3f& origin, const vec3f& direction, float& tmax, Intersector intersect) const;
+};
+
+template <typename Intersector> bool UniformGrid::Traverse(const vec3f& origin, const vec3f& direction, float& tmax, Intersector intersect) const {
+    if (cell_offsets.empty())
+        return false;
+    vec3f inv_direction = SafeInverse(direction);
+    float tentry;
+    if (!IntersectBox(bounds.min, bounds.max, origin, inv_direction, tmax, tentry))
+        return false;
+
+    float ray_origin[3] = { origin.x, origin.y, origin.z };
+    float ray_direction[3] = { direction.x, direction.y, direction.z };
+    float ray_inv_direction[3] = { inv_direction.x, inv_direction.y, inv_direction.z };
+    float grid_min[3] = { bounds.min.x, bounds.min.y, bounds.min.z };
+    int cell[3], step[3], stop[3];
+    float tnext[3], tdelta[3];
+    for (unsigned axis = 0; axis < 3; axis++) {
+        float entry = ray_origin[axis] + ray_direction[axis] * tentry;
+        int index = int((entry - grid_min[axis]) * inv_cell_size[axis]);
+        cell[axis] = std::min(std::max(index, 0), int(resolution[axis]) - 1);
+        if (ray_inv_direction[axis] >= 0) {
+            step[axis] = 1;
+            stop[axis] = int(resolution[axis]);
+            tnext[axis] = (grid_min[axis] + (cell[axis] + 1) * cell_size[axis] - ray_origin[axis]) * ray_inv_direction[axis];
+        } else {
+            step[axis] = -1;
+            stop[axis] = -1;
+            tnext[axis] = (grid_min[axis] + cell[axis] * cell_size[axis] - ray_origin[axis]) * ray_inv_direction[axis];
+        }
+        tdelta[axis] = cell_size[axis] * std::fabs(ray_inv_direction[axis]);
+    }
+
+    uint32_t mailbox[mailbox_size];
+    for (unsigned i = 0; i < mailbox_size; i++)
+        mailbox[i] = 0xffffffff;
+    bool hit = false;
+    while (true) {
+        uint32_t cell_index = cell[0] + resolution[0] * (cell[1] + resolution[1] * cell[2]);
+        for (uint32_t i = cell_offsets[cell_index]; i < cell_offsets[cell_index + 1]; i++) {
+            uint32_t primitive = cell_primitives[i];
+            if (mailbox[primitive % mailbox_size] == primitive)
+                continue;
+            mailbox[primitive % mailbox_size] = primitive;
+            hit |= intersect(primitive, tmax);
+        }
+        unsigned axis = tnext[0] < tnext[1] ? (tnext[0] < tnext[2] ? 0 : 2) : (tnext[1] < tnext[2] ? 1 : 2);
+        if (tnext[axis] > tmax)
+            break;
+        cell[axis] += step[axis];
+        if (cell[axis] == stop[axis])
+            break;
+        tnext[axis] += tdelta[axis];
+    }
+    return hit;
+}
+
+#endif
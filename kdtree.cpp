@@ -0,0 +1,158 @@
+#include <cmath>
+#include <numeric>
+#include <algorithm>
+
+#include "kdtree.h"
+
+constexpr unsigned KDTree::max_depth;
+
+namespace {
+
+//bound events of one axis, sorted so that at equal positions ending primitives come first
+struct Event {
+    float position;
+    uint8_t type;   //0 end, 1 planar, 2 start
+    bool operator<(const Event& rhs) const { return position < rhs.position || (position == rhs.position && type < rhs.type); }
+};
+
+}
+
+struct KDTree::BuildContext {
+    const std::vector<AABB>& primitive_bounds;
+    const KDTreeBuildOptions& options;
+    unsigned max_depth;
+    std::vector<Event> events;
+    BuildContext(const std::vector<AABB>& in_primitive_bounds, const KDTreeBuildOptions& in_options, unsigned in_max_depth) :
+        primitive_bounds(in_primitive_bounds), options(in_options), max_depth(in_max_depth) {}
+};
+
+void KDTree::MakeLeaf(const std::vector<uint32_t>& primitives) {
+    KDNode node;
+    node.primitive_offset = uint32_t(leaf_primitives.size());
+    node.flags = 3 | (uint32_t(primitives.size()) << 2);
+    leaf_primitives.insert(leaf_primitives.end(), primitives.begin(), primitives.end());
+    nodes.push_back(node);
+}
+
+void KDTree::BuildRecursive(BuildContext& context, std::vector<uint32_t>& primitives, const AABB& node_bounds, unsigned depth) {
+    const KDTreeBuildOptions& options = context.options;
+    size_t count = primitives.size();
+    float node_area = node_bounds.SurfaceArea();
+    if (count <= options.max_leaf_size || depth >= context.max_depth || node_area <= 0) {
+        MakeLeaf(primitives);
+        return;
+    }
+
+    float node_min[3] = { node_bounds.min.x, node_bounds.min.y, node_bounds.min.z };
+    float node_max[3] = { node_bounds.max.x, node_bounds.max.y, node_bounds.max.z };
+    float best_cost = options.intersection_cost * count;
+    int best_axis = -1;
+    float best_split = 0.0f;
+    bool best_planar_lower = true;
+    for (unsigned axis = 0; axis < 3; axis++) {
+        if (node_max[axis] <= node_min[axis])
+            continue;
+        std::vector<Event>& events = context.events;
+        events.clear();
+        for (size_t i = 0; i < count; i++) {
+            AABB clipped = context.primitive_bounds[primitives[i]].Intersection(node_bounds);
+            float lower = std::max(clipped.min[axis], node_min[axis]);
+            float upper = std::min(clipped.max[axis], node_max[axis]);
+            if (lower == upper) {
+                events.push_back(Event{ lower, 1 });
+            } else {
+                events.push_back(Event{ lower, 2 });
+                events.push_back(Event{ upper, 0 });
+            }
+        }
+        std::sort(events.begin(), events.end());
+
+        //sweep the candidate planes keeping the primitive counts on both sides
+        size_t lower_count = 0, upper_count = count;
+        unsigned other_axis1 = (axis + 1) % 3, other_axis2 = (axis + 2) % 3;
+        float side_extent1 = node_max[other_axis1] - node_min[other_axis1];
+        float side_extent2 = node_max[other_axis2] - node_min[other_axis2];
+        for (size_t i = 0; i < events.size();) {
+            float position = events[i].position;
+            size_t ending = 0, planar = 0, starting = 0;
+            for (; i < events.size() && events[i].position == position && events[i].type == 0; i++)
+                ending++;
+            for (; i < events.size() && events[i].position == position && events[i].type == 1; i++)
+                planar++;
+            for (; i < events.size() && events[i].position == position && events[i].type == 2; i++)
+                starting++;
+            upper_count -= planar + ending;
+            if (position > node_min[axis] && position < node_max[axis]) {
+                float lower_length = position - node_min[axis];
+                float upper_length = node_max[axis] - position;
+                float cap_area = 2 * side_extent1 * side_extent2;
+                float lower_area = cap_area + 2 * lower_length * (side_extent1 + side_extent2);
+                float upper_area = cap_area + 2 * upper_length * (side_extent1 + side_extent2);
+                for (unsigned planar_lower = 0; planar_lower < 2; planar_lower++) {
+                    size_t lower_side = lower_count + (planar_lower ? planar : 0);
+                    size_t upper_side = upper_count + (planar_lower ? 0 : planar);
+                    float cost = options.traversal_cost + options.intersection_cost * (lower_area * lower_side + upper_area * upper_side) / node_area;
+                    if (lower_side == 0 || upper_side == 0)
+                        cost *= 1.0f - options.empty_bonus;
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = int(axis);
+                        best_split = position;
+                        best_planar_lower = planar_lower != 0;
+                    }
+                }
+            }
+            lower_count += starting + planar;
+        }
+    }
+    if (best_axis < 0) {
+        MakeLeaf(primitives);
+        return;
+    }
+
+    std::vector<uint32_t> lower_primitives, upper_primitives;
+    for (size_t i = 0; i < count; i++) {
+        AABB clipped = context.primitive_bounds[primitives[i]].Intersection(node_bounds);
+        float lower = clipped.min[best_axis];
+        float upper = clipped.max[best_axis];
+        if (lower == best_split && upper == best_split) {
+            (best_planar_lower ? lower_primitives : upper_primitives).push_back(primitives[i]);
+        } else {
+            if (lower < best_split)
+                lower_primitives.push_back(primitives[i]);
+            if (upper > best_split)
+                upper_primitives.push_back(primitives[i]);
+        }
+    }
+    std::vector<uint32_t>().swap(primitives);
+    AABB lower_bounds = node_bounds, upper_bounds = node_bounds;
+    lower_bounds.max[best_axis] = best_split;
+    upper_bounds.min[best_axis] = best_split;
+
+    uint32_t node_index = uint32_t(nodes.size());
+    nodes.push_back(KDNode());
+    BuildRecursive(context, lower_primitives, lower_bounds, depth + 1);
+    nodes[node_index].split = best_split;
+    nodes[node_index].flags = uint32_t(best_axis) | (uint32_t(nodes.size()) << 2);
+    BuildRecursive(context, upper_primitives, upper_bounds, depth + 1);
+}
+
+void KDTree::Build(const std::vector<AABB>& primitive_bounds, const KDTreeBuildOptions& options) {
+    nodes.clear();
+    leaf_primitives.clear();
+    bounds = AABB();
+    primitive_indices.resize(primitive_bounds.size());
+    std::iota(primitive_indices.begin(), primitive_indices.end(), 0u);
+    if (primitive_bounds.empty())
+        return;
+    for (size_t i = 0; i < primitive_bounds.size(); i++)
+        bounds.Extend(primitive_bounds[i]);
+    unsigned depth_limit = options.max_depth > 0 ? options.max_depth : unsigned(8 + 1.3f * std::log2(float(primitive_bounds.size())));
+    BuildContext context(primitive_bounds, options, std::min(depth_limit, max_depth));
+    std::vector<uint32_t> primitives(primitive_indices);
+    BuildRecursive(context, primitives, bounds, 0);
+}
+
+size_t KDTree::GetMemoryUsage() const {
+    return nodes.capacity() * sizeof(KDNode) + leaf_primitives.capacity() * sizeof(uint32_t) + primitive_indices.capacity() * sizeof(uint32_t);
+}
@@ -0,0 +1,129 @@
+#ifndef KDTREE_H
+#define KDTREE_H
+
+#include <vector>
+#include <cstdint>
+#include "geometry.h"
+#include "bvh.h"
+
+struct KDTreeBuildOptions {
+    float traversal_cost = 1.0f;
+    float intersection_cost = 1.5f;
+    float empty_bonus = 0.2f;       //SAH discount for cutting off empty space
+    unsigned max_leaf_size = 2;
+    unsigned max_depth = 0;         //0 picks 8 + 1.3 log2(n)
+};
+
+//_______8-byte kd-tree node: split plane or leaf primitive range_______
+
+struct KDNode {
+    union {
+        float split;
+        uint32_t primitive_offset;  //leaf: first entry in leaf_primitives
+    };
+    uint32_t flags;                 //low 2 bits: split axis or 3 for a leaf; the rest: index of the upper child or the leaf's primitive count
+    bool IsLeaf() const { return (flags & 3) == 3; }
+    unsigned Axis() const { return flags & 3; }
+    uint32_t UpperChild() const { return flags >> 2; }  //the lower child is the next node
+    uint32_t PrimitiveCount() const { return flags >> 2; }
+};
+
+static_assert(sizeof(KDNode) == 8, "KDNode must stay 8 bytes");
+
+//_______SAH kd-tree over primitive bounds________________________
+//splits are found by sweeping sorted bound events on every axis (O(n log^2 n) build); primitives straddling
+//a split are referenced from both sides and a per-ray mailbox avoids testing them twice
+
+class KDTree {
+    std::vector<KDNode> nodes;
+    std::vector<uint32_t> leaf_primitives;
+    std::vector<uint32_t> primitive_indices;
+    AABB bounds;
+    struct BuildContext;
+    void BuildRecursive(BuildContext& context, std::vector<uint32_t>& primitives, const AABB& node_bounds, unsigned depth);
+    void MakeLeaf(const std::vector<uint32_t>& primitives);
+public:
+    static constexpr unsigned max_depth = 64;
+    static constexpr unsigned mailbox_size = 16;
+    void Build(const std::vector<AABB>& primitive_bounds, const KDTreeBuildOptions& options = KDTreeBuildOptions());
+    bool Empty() const { return nodes.empty(); }
+    AABB GetBounds() const { return bounds; }
+    size_t GetNodeCount() const { return nodes.size(); }
+    size_t GetMemoryUsage() const;
+    //slots are the primitives themselves, kept for the same layout contract as BVH
+    const std::vector<uint32_t>& GetPrimitiveIndices() const { return primitive_indices; }
+    //same contract as BVH::Traverse, leaves are visited front to back until one starts beyond tmax
+    template <typename Intersector> bool Traverse(const vec3f& origin, const vec3f& direction, float& tmax, Intersector intersect) const;
+};
+
+template <typename Intersector> bool KDTree::Traverse(const vec3f& origin, const vec3f& direction, float& tmax, Intersector intersect) const {
+    struct StackEntry {
+        uint32_t node;
+        float tmin;
+        float tmax;
+    };
+    if (nodes.empty())
+        return false;
+    vec3f inv_direction = SafeInverse(direction);
+    float ray_origin[3] = { origin.x, origin.y, origin.z };
+    float ray_direction[3] = { direction.x, direction.y, direction.z };
+    float ray_inv_direction[3] = { inv_direction.x, inv_direction.y, inv_direction.z };
+    float box_min[3] = { bounds.min.x, bounds.min.y, bounds.min.z };
+    float box_max[3] = { bounds.max.x, bounds.max.y, bounds.max.z };
+    float tnear = 0.0f;
+    float tfar = tmax;
+    for (unsigned axis = 0; axis < 3; axis++) {
+        float t1 = (box_min[axis] - ray_origin[axis]) * ray_inv_direction[axis];
+        float t2 = (box_max[axis] - ray_origin[axis]) * ray_inv_direction[axis];
+        tnear = std::max(tnear, std::min(t1, t2));
+        tfar = std::min(tfar, std::max(t1, t2));
+    }
+    if (tnear > tfar)
+        return false;
+
+    uint32_t mailbox[mailbox_size];
+    for (unsigned i = 0; i < mailbox_size; i++)
+        mailbox[i] = 0xffffffff;
+    StackEntry stack[max_depth];
+    unsigned stack_size = 0;
+    uint32_t current = 0;
+    bool hit = false;
+    while (true) {
+        if (tnear > tmax)
+            break;
+        const KDNode& node = nodes[current];
+        if (!node.IsLeaf()) {
+            unsigned axis = node.Axis();
+            float tplane = (node.split - ray_origin[axis]) * ray_inv_direction[axis];
+            bool lower_first = ray_origin[axis] < node.split || (ray_origin[axis] == node.split && ray_direction[axis] <= 0);
+            uint32_t first = lower_first ? current + 1 : node.UpperChild();
+            uint32_t second = lower_first ? node.UpperChild() : current + 1;
+            if (tplane > tfar || tplane <= 0) {
+                current = first;
+            } else if (tplane < tnear) {
+                current = second;
+            } else {
+                stack[stack_size++] = StackEntry{ second, tplane, tfar };
+                current = first;
+                tfar = tplane;
+            }
+            continue;
+        }
+        for (uint32_t i = node.primitive_offset; i < node.primitive_offset + node.PrimitiveCount(); i++) {
+            uint32_t primitive = leaf_primitives[i];
+            if (mailbox[primitive % mailbox_size] == primitive)
+                continue;
+            mailbox[primitive % mailbox_size] = primitive;
+            hit |= intersect(primitive, tmax);
+        }
+        if (stack_size == 0)
+            break;
+        StackEntry entry = stack[--stack_size];
+        current = entry.node;
+        tnear = entry.tmin;
+        tfar = entry.tmax;
+    }
+    return hit;
+}
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include "dispatch.h"
+#include "geometry.h"
+#include "fastmath.h"
+
+//_______kernel templates behind the tables of dispatch.h, included once by every kernels_<set>.cpp_______
+//each of those translation units is compiled for its own instruction set, so everything here is in an anonymous
+//namespace and uses only intrinsics, the floatn lanes (kept apart per set by their inline namespace) and plain data:
+//an inline function shared with the rest of the program (vec3f constructors, std::min...) compiled here would be
+//emitted with the wider instructions, and the linker is free to keep that copy for the baseline code too
+
+namespace {
+
+template <unsigned width> unsigned IntersectBoxes8(const float* bounds_min, const float* bounds_max, unsigned child_count, const vec3f& origin,
+                                                   const vec3f& inv_direction, float tmax, float* tentry) {
+    typedef floatn<width> lanes;
+    const float o[3] = { origin.x, origin.y, origin.z };
+    const float inv[3] = { inv_direction.x, inv_direction.y, inv_direction.z };
+    unsigned mask = 0;
+    for (unsigned first = 0; first < 8; first += width) {
+        lanes tnear(0.0f);
+        lanes tfar(tmax);
+        for (unsigned axis = 0; axis < 3; axis++) {
+            lanes t1 = (lanes::Load(bounds_min + axis * 8 + first) - lanes(o[axis])) * lanes(inv[axis]);
+            lanes t2 = (lanes::Load(bounds_max + axis * 8 + first) - lanes(o[axis])) * lanes(inv[axis]);
+            tnear = Max(tnear, Min(t1, t2));
+            tfar = Min(tfar, Max(t1, t2));
+        }
+        tnear.Store(tentry + first);
+        mask |= (tnear <= tfar).Bits() << first;
+    }
+    return mask & ((1u << child_count) - 1);
+}
+
+//vertices of the slots from slot on: nine float arrays ([vertex][axis], stride apart) or the same as 16-bit codes
+//decoded as origin + code * scale per axis
+struct FloatVertices {
+    const float* coordinates;
+    size_t stride;
+    template <unsigned width> vec<3, floatn<width>> Get(unsigned vertex, size_t slot) const {
+        typedef floatn<width> lanes;
+        const float* x = coordinates + 3 * vertex * stride + slot;
+        return vec<3, lanes>(lanes::Load(x), lanes::Load(x + stride), lanes::Load(x + 2 * stride));
+    }
+};
+
+struct QuantizedVertices {
+    const uint16_t* codes;
+    size_t stride;
+    const float* origin;
+    const float* scale;
+    template <unsigned width> vec<3, floatn<width>> Get(unsigned vertex, size_t slot) const {
+        typedef floatn<width> lanes;
+        const uint16_t* x = codes + 3 * vertex * stride + slot;
+        return vec<3, lanes>(lanes(origin[0]) + lanes::LoadU16(x) * lanes(scale[0]),
+                             lanes(origin[1]) + lanes::LoadU16(x + stride) * lanes(scale[1]),
+                             lanes(origin[2]) + lanes::LoadU16(x + 2 * stride) * lanes(scale[2]));
+    }
+};
+
+//the operations of Polygon::Hitted in the same order, lane by lane
+template <unsigned width, typename Vertices> unsigned IntersectTriangles(const Vertices& vertices, size_t first, unsigned count, const vec3f& origin,
+                                                                         const vec3f& direction, float tmin, float* t, unsigned& inside) {
+    if (width > 4 && count <= 4)   //leaves mostly hold a few polygons
+        return IntersectTriangles<4>(vertices, first, count, origin, direction, tmin, t, inside);
+    typedef floatn<width> lanes;
+    typedef vec<3, lanes> vec3n;
+    const float eps = 1e-8f;
+    vec3n o = Broadcast<width>(origin);
+    vec3n d = Broadcast<width>(direction);
+    unsigned mask = 0;
+    inside = 0;
+    for (unsigned lane = 0; lane < count; lane += width) {
+        vec3n v[3];
+        for (unsigned i = 0; i < 3; i++)
+            v[i] = vertices.template Get<width>(i, first + lane);
+        vec3n e1 = v[1] - v[0];
+        vec3n e2 = v[2] - v[0];
+        vec3n pvec = cross(d, e2);
+        lanes det = e1 * pvec;
+        maskn<width> hit = ~((det < lanes(eps)) & (det > lanes(-eps)));
+        lanes inv_det = lanes(1.0f) / det;
+        vec3n tvec = o - v[0];
+        lanes u = (tvec * pvec) * inv_det;
+        hit = hit & ~((u < lanes(0.0f)) | (u > lanes(1.0f)));
+        vec3n qvec = cross(tvec, e1);
+        lanes w = (d * qvec) * inv_det;
+        hit = hit & ~((w < lanes(0.0f)) | (u + w > lanes(1.0f)));
+        lanes distance = (e2 * qvec) * inv_det;
+        hit = hit & (distance > lanes(0.0f)) & (distance >= lanes(tmin));
+        distance.Store(t + lane);
+        mask |= hit.Bits() << lane;
+        inside |= (det < lanes(0.0f)).Bits() << lane;
+    }
+    return mask & ((1u << count) - 1);
+}
+
+template <unsigned width> unsigned IntersectFloatTriangles(const float* coordinates, size_t stride, size_t first, unsigned count, const vec3f& origin,
+                                                           const vec3f& direction, float tmin, float* t, unsigned& inside) {
+    return IntersectTriangles<width>(FloatVertices{ coordinates, stride }, first, count, origin, direction, tmin, t, inside);
+}
+
+template <unsigned width> unsigned IntersectQuantizedTriangles(const uint16_t* codes, size_t stride, const float* code_origin, const float* code_scale,
+                                                               size_t first, unsigned count, const vec3f& origin, const vec3f& direction, float tmin, float* t,
+                                                               unsigned& inside) {
+    return IntersectTriangles<width>(QuantizedVertices{ codes, stride, code_origin, code_scale }, first, count, origin, direction, tmin, t, inside);
+}
+
+//Malley's method: points uniform on the unit disk lifted to the hemisphere
+template <unsigned width> void SampleCosineHemisphere(const vec3f* basis, unsigned count, const float* radius_squared, const float* angle, vec3f* directions) {
+    typedef floatn<width> lanes;
+    vec<3, lanes> tangent = Broadcast<width>(basis[0]);
+    vec<3, lanes> bitangent = Broadcast<width>(basis[1]);
+    vec<3, lanes> normal = Broadcast<width>(basis[2]);
+    for (unsigned first = 0; first < count; first += width) {
+        unsigned batch = count - first < width ? count - first : width;
+        float padded_radius_squared[width] = {}, padded_angle[width] = {};
+        for (unsigned i = 0; i < batch; i++) {
+            padded_radius_squared[i] = radius_squared[first + i];
+            padded_angle[i] = angle[first + i];
+        }
+        lanes r2 = lanes::Load(padded_radius_squared);
+        lanes sine, cosine;
+        FastSinCos(lanes::Load(padded_angle), sine, cosine);
+        lanes radius = Sqrt(r2);
+        lanes height = Sqrt(Max(lanes(1.0f) - r2, lanes(0.0f)));
+        vec<3, lanes> world = (tangent * (radius * cosine)) + (bitangent * (radius * sine)) + (normal * height);
+        float x[width], y[width], z[width];
+        world.x.Store(x);
+        world.y.Store(y);
+        world.z.Store(z);
+        for (unsigned i = 0; i < batch; i++) {
+            directions[first + i].x = x[i];
+            directions[first + i].y = y[i];
+            directions[first + i].z = z[i];
+        }
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,5 @@
+#include "kernels.h"
+
+//_______kernels compiled with -mavx2 (/arch:AVX2): eight lanes in a ymm register_______
+
+extern const Kernels avx2_kernels = { ISA_AVX2, "avx2", &IntersectBoxes8<8>, &IntersectFloatTriangles<8>, &IntersectQuantizedTriangles<8>, &SampleCosineHemisphere<8> };
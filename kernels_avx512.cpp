@@ -0,0 +1,6 @@
+#include "kernels.h"
+
+//_______kernels compiled with -mavx512f (/arch:AVX512): nodes and leaves hold at most eight boxes or triangles,
+//so those stay in ymm registers, the diffuse fans are sampled sixteen at a time_______
+
+extern const Kernels avx512_kernels = { ISA_AVX512, "avx512", &IntersectBoxes8<8>, &IntersectFloatTriangles<8>, &IntersectQuantizedTriangles<8>, &SampleCosineHemisphere<16> };
@@ -0,0 +1,5 @@
+#include "kernels.h"
+
+//_______kernels with the flags of the rest of the program, for CPUs without any of the wider sets_______
+
+extern const Kernels baseline_kernels = { ISA_BASELINE, "baseline", &IntersectBoxes8<4>, &IntersectFloatTriangles<4>, &IntersectQuantizedTriangles<4>, &SampleCosineHemisphere<4> };
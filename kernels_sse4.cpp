@@ -0,0 +1,5 @@
+#include "kernels.h"
+
+//_______kernels compiled with -msse4.1: rounding and blends in one instruction each_______
+
+extern const Kernels sse4_kernels = { ISA_SSE4, "sse4", &IntersectBoxes8<4>, &IntersectFloatTriangles<4>, &IntersectQuantizedTriangles<4>, &SampleCosineHemisphere<4> };
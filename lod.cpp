@@ -0,0 +1,309 @@
+#include <algorithm>
+#include <queue>
+#include <unordered_map>
+#include <limits>
+#include <cstdint>
+
+#include "lod.h"
+
+namespace {
+
+const double boundary_weight = 10.0;    //keeps open borders in place compared to the surface planes
+const float flip_threshold = 0.2f;      //a collapse may turn a triangle's normal by less than ~78 degrees
+
+//_______quadric error: sum of squared distances to a set of planes, as a symmetric 4x4 matrix_______
+
+struct Quadric {
+    double a2 = 0, ab = 0, ac = 0, ad = 0, b2 = 0, bc = 0, bd = 0, c2 = 0, cd = 0, d2 = 0;
+    void AddPlane(const vec3f& normal, float d, double weight) {
+        double a = normal.x, b = normal.y, c = normal.z;
+        a2 += weight * a * a; ab += weight * a * b; ac += weight * a * c; ad += weight * a * d;
+        b2 += weight * b * b; bc += weight * b * c; bd += weight * b * d;
+        c2 += weight * c * c; cd += weight * c * d; d2 += weight * double(d) * d;
+    }
+    Quadric operator+(const Quadric& other) const {
+        Quadric sum;
+        sum.a2 = a2 + other.a2; sum.ab = ab + other.ab; sum.ac = ac + other.ac; sum.ad = ad + other.ad;
+        sum.b2 = b2 + other.b2; sum.bc = bc + other.bc; sum.bd = bd + other.bd;
+        sum.c2 = c2 + other.c2; sum.cd = cd + other.cd; sum.d2 = d2 + other.d2;
+        return sum;
+    }
+    double Evaluate(const vec3f& p) const {
+        double x = p.x, y = p.y, z = p.z;
+        double error = a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x + b2 * y * y + 2 * bc * y * z + 2 * bd * y +
+                       c2 * z * z + 2 * cd * z + d2;
+        return std::max(error, 0.0);
+    }
+    //the point of least error, if the planes pin one down
+    bool Minimum(vec3f& p) const {
+        double det = a2 * (b2 * c2 - bc * bc) - ab * (ab * c2 - bc * ac) + ac * (ab * bc - b2 * ac);
+        double scale = a2 * a2 + b2 * b2 + c2 * c2;
+        if (std::fabs(det) < 1e-9 * scale * std::sqrt(scale))
+            return false;
+        double inv_det = 1.0 / det;
+        p.x = float(-(ad * (b2 * c2 - bc * bc) - ab * (bd * c2 - bc * cd) + ac * (bd * bc - b2 * cd)) * inv_det);
+        p.y = float(-(a2 * (bd * c2 - cd * bc) - ad * (ab * c2 - bc * ac) + ac * (ab * cd - bd * ac)) * inv_det);
+        p.z = float(-(a2 * (b2 * cd - bc * bd) - ab * (ab * cd - bd * ac) + ad * (ab * bc - b2 * ac)) * inv_det);
+        return true;
+    }
+};
+
+struct Collapse {
+    double cost;
+    uint32_t kept;
+    uint32_t removed;
+    uint32_t kept_version;
+    uint32_t removed_version;
+    vec3f position;
+    bool operator<(const Collapse& other) const { return cost > other.cost; }   //the cheapest on top of the heap
+};
+
+struct Triangle {
+    uint32_t vertex[3];
+    bool removed;
+};
+
+class Simplifier {
+    std::vector<vec3f> positions;
+    std::vector<Quadric> quadrics;
+    std::vector<uint32_t> versions;     //bumped on every change of a vertex, stale heap entries are skipped
+    std::vector<bool> removed_vertices;
+    std::vector<Triangle> triangles;
+    std::vector<std::vector<uint32_t>> vertex_triangles;
+    std::priority_queue<Collapse> heap;
+    size_t live_triangle_count = 0;
+    double max_cost = 0.0;
+    void Weld(const std::vector<vec3f>& vertices);
+    void InitQuadrics();
+    void PushCollapse(uint32_t kept, uint32_t removed);
+    bool FlipsTriangles(uint32_t vertex, uint32_t other, const vec3f& position) const;
+    bool Apply(const Collapse& collapse);
+public:
+    explicit Simplifier(const std::vector<vec3f>& vertices);
+    //collapses edges until at most target triangles are left, returns false if it ran out of edges first
+    bool Reduce(size_t target);
+    size_t GetTriangleCount() const { return live_triangle_count; }
+    SimplifiedMesh GetMesh() const;
+};
+
+Simplifier::Simplifier(const std::vector<vec3f>& vertices) {
+    Weld(vertices);
+    InitQuadrics();
+    for (size_t i = 0; i < triangles.size(); i++) {
+        for (unsigned corner = 0; corner < 3; corner++) {
+            uint32_t a = triangles[i].vertex[corner], b = triangles[i].vertex[(corner + 1) % 3];
+            if (a < b) {
+                PushCollapse(a, b);
+                PushCollapse(b, a);
+            }
+        }
+    }
+}
+
+//corners at the same position become one vertex, triangles that collapse to a line or a point are dropped
+void Simplifier::Weld(const std::vector<vec3f>& vertices) {
+    std::vector<uint32_t> order(vertices.size());
+    for (uint32_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    auto less = [&vertices](uint32_t i, uint32_t j) {
+        const vec3f& a = vertices[i];
+        const vec3f& b = vertices[j];
+        return a.x != b.x ? a.x < b.x : (a.y != b.y ? a.y < b.y : a.z < b.z);
+    };
+    std::sort(order.begin(), order.end(), less);
+    std::vector<uint32_t> vertex_index(vertices.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        if (i == 0 || less(order[i - 1], order[i]))
+            positions.push_back(vertices[order[i]]);
+        vertex_index[order[i]] = uint32_t(positions.size() - 1);
+    }
+    vertex_triangles.resize(positions.size());
+    for (size_t i = 0; i + 2 < vertices.size(); i += 3) {
+        Triangle triangle = { { vertex_index[i], vertex_index[i + 1], vertex_index[i + 2] }, false };
+        if (triangle.vertex[0] == triangle.vertex[1] || triangle.vertex[1] == triangle.vertex[2] || triangle.vertex[0] == triangle.vertex[2])
+            continue;
+        for (unsigned corner = 0; corner < 3; corner++)
+            vertex_triangles[triangle.vertex[corner]].push_back(uint32_t(triangles.size()));
+        triangles.push_back(triangle);
+    }
+    live_triangle_count = triangles.size();
+    versions.assign(positions.size(), 0);
+    removed_vertices.assign(positions.size(), false);
+}
+
+//every vertex starts with the planes of its triangles; edges used by a single triangle also get a plane through
+//the edge perpendicular to the triangle, so that borders are not eaten away
+void Simplifier::InitQuadrics() {
+    quadrics.resize(positions.size());
+    std::unordered_map<uint64_t, uint32_t> edge_use;
+    for (size_t i = 0; i < triangles.size(); i++) {
+        for (unsigned corner = 0; corner < 3; corner++) {
+            uint64_t a = triangles[i].vertex[corner], b = triangles[i].vertex[(corner + 1) % 3];
+            edge_use[std::min(a, b) << 32 | std::max(a, b)]++;
+        }
+    }
+    for (size_t i = 0; i < triangles.size(); i++) {
+        const uint32_t* vertex = triangles[i].vertex;
+        vec3f normal = cross(positions[vertex[1]] - positions[vertex[0]], positions[vertex[2]] - positions[vertex[0]]);
+        if (normal.norm() == 0.0f)
+            continue;
+        normal.normalize();
+        for (unsigned corner = 0; corner < 3; corner++)
+            quadrics[vertex[corner]].AddPlane(normal, -(normal * positions[vertex[0]]), 1.0);
+        for (unsigned corner = 0; corner < 3; corner++) {
+            uint64_t a = vertex[corner], b = vertex[(corner + 1) % 3];
+            if (edge_use[std::min(a, b) << 32 | std::max(a, b)] != 1)
+                continue;
+            vec3f border_normal = cross(positions[b] - positions[a], normal);
+            if (border_normal.norm() == 0.0f)
+                continue;
+            border_normal.normalize();
+            float d = -(border_normal * positions[a]);
+            quadrics[a].AddPlane(border_normal, d, boundary_weight);
+            quadrics[b].AddPlane(border_normal, d, boundary_weight);
+        }
+    }
+}
+
+void Simplifier::PushCollapse(uint32_t kept, uint32_t removed) {
+    Quadric quadric = quadrics[kept] + quadrics[removed];
+    const vec3f& a = positions[kept];
+    const vec3f& b = positions[removed];
+    vec3f candidates[4] = { a, b, (a + b) * 0.5f, vec3f() };
+    unsigned candidate_count = 3;
+    //the optimum is only trusted near the edge, far away it comes from nearly parallel planes
+    vec3f minimum;
+    if (quadric.Minimum(minimum) && (minimum - (a + b) * 0.5f).norm() <= (a - b).norm())
+        candidates[candidate_count++] = minimum;
+    Collapse collapse = { std::numeric_limits<double>::max(), kept, removed, versions[kept], versions[removed], a };
+    for (unsigned i = 0; i < candidate_count; i++) {
+        double cost = quadric.Evaluate(candidates[i]);
+        if (cost < collapse.cost) {
+            collapse.cost = cost;
+            collapse.position = candidates[i];
+        }
+    }
+    heap.push(collapse);
+}
+
+bool Simplifier::FlipsTriangles(uint32_t vertex, uint32_t other, const vec3f& position) const {
+    const std::vector<uint32_t>& around = vertex_triangles[vertex];
+    for (size_t i = 0; i < around.size(); i++) {
+        const Triangle& triangle = triangles[around[i]];
+        if (triangle.removed)
+            continue;
+        const uint32_t* v = triangle.vertex;
+        if (v[0] == other || v[1] == other || v[2] == other)
+            continue;   //collapses to a line and disappears
+        vec3f corners[3] = { positions[v[0]], positions[v[1]], positions[v[2]] };
+        vec3f old_normal = cross(corners[1] - corners[0], corners[2] - corners[0]);
+        for (unsigned corner = 0; corner < 3; corner++) {
+            if (v[corner] == vertex)
+                corners[corner] = position;
+        }
+        vec3f new_normal = cross(corners[1] - corners[0], corners[2] - corners[0]);
+        if (old_normal * new_normal < flip_threshold * old_normal.norm() * new_normal.norm())
+            return true;
+    }
+    return false;
+}
+
+bool Simplifier::Apply(const Collapse& collapse) {
+    uint32_t kept = collapse.kept, removed = collapse.removed;
+    if (FlipsTriangles(kept, removed, collapse.position) || FlipsTriangles(removed, kept, collapse.position))
+        return false;
+    positions[kept] = collapse.position;
+    quadrics[kept] = quadrics[kept] + quadrics[removed];
+    removed_vertices[removed] = true;
+    versions[kept]++;
+    versions[removed]++;
+    std::vector<uint32_t>& kept_triangles = vertex_triangles[kept];
+    std::vector<uint32_t>& removed_triangles = vertex_triangles[removed];
+    for (size_t i = 0; i < removed_triangles.size(); i++) {
+        Triangle& triangle = triangles[removed_triangles[i]];
+        if (triangle.removed)
+            continue;
+        uint32_t* v = triangle.vertex;
+        if (v[0] == kept || v[1] == kept || v[2] == kept) {
+            triangle.removed = true;
+            live_triangle_count--;
+            continue;
+        }
+        for (unsigned corner = 0; corner < 3; corner++) {
+            if (v[corner] == removed)
+                v[corner] = kept;
+        }
+        kept_triangles.push_back(removed_triangles[i]);
+    }
+    std::vector<uint32_t>().swap(removed_triangles);
+    kept_triangles.erase(std::remove_if(kept_triangles.begin(), kept_triangles.end(), [this](uint32_t i) { return triangles[i].removed; }), kept_triangles.end());
+    max_cost = std::max(max_cost, collapse.cost);
+
+    //the edges around the moved vertex get new costs
+    std::vector<uint32_t> neighbours;
+    for (size_t i = 0; i < kept_triangles.size(); i++) {
+        for (unsigned corner = 0; corner < 3; corner++) {
+            uint32_t vertex = triangles[kept_triangles[i]].vertex[corner];
+            if (vertex != kept)
+                neighbours.push_back(vertex);
+        }
+    }
+    std::sort(neighbours.begin(), neighbours.end());
+    neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+    for (size_t i = 0; i < neighbours.size(); i++) {
+        PushCollapse(kept, neighbours[i]);
+        PushCollapse(neighbours[i], kept);
+    }
+    return true;
+}
+
+bool Simplifier::Reduce(size_t target) {
+    while (live_triangle_count > target) {
+        if (heap.empty())
+            return false;
+        Collapse collapse = heap.top();
+        heap.pop();
+        if (removed_vertices[collapse.kept] || removed_vertices[collapse.removed] ||
+            versions[collapse.kept] != collapse.kept_version || versions[collapse.removed] != collapse.removed_version)
+            continue;
+        Apply(collapse);    //a rejected collapse is pushed again when its neighbourhood changes
+    }
+    return true;
+}
+
+SimplifiedMesh Simplifier::GetMesh() const {
+    SimplifiedMesh mesh;
+    mesh.vertices.reserve(3 * live_triangle_count);
+    for (size_t i = 0; i < triangles.size(); i++) {
+        if (triangles[i].removed)
+            continue;
+        for (unsigned corner = 0; corner < 3; corner++)
+            mesh.vertices.push_back(positions[triangles[i].vertex[corner]]);
+    }
+    mesh.error = float(std::sqrt(max_cost));
+    return mesh;
+}
+
+}
+
+std::vector<SimplifiedMesh> SimplifyMesh(const std::vector<vec3f>& vertices, const LODOptions& options) {
+    std::vector<SimplifiedMesh> levels;
+    if (options.level_count == 0)
+        return levels;
+    Simplifier simplifier(vertices);
+    size_t previous_count = simplifier.GetTriangleCount();
+    for (unsigned level = 0; level < options.level_count; level++) {
+        size_t target = size_t(previous_count * options.reduction);
+        if (target < options.min_triangles)
+            break;
+        bool reached = simplifier.Reduce(target);
+        //a level that barely differs from the previous one is not worth its BVH
+        if (simplifier.GetTriangleCount() > previous_count * (1.0f + options.reduction) * 0.5f)
+            break;
+        levels.push_back(simplifier.GetMesh());
+        previous_count = simplifier.GetTriangleCount();
+        if (!reached)
+            break;
+    }
+    return levels;
+}
@@ -0,0 +1,27 @@
+#ifndef LOD_H
+#define LOD_H
+
+#include <vector>
+#include "geometry.h"
+
+//_______levels of detail for triangle meshes_______________
+
+struct LODOptions {
+    unsigned level_count = 0;           //coarser levels kept besides the full mesh, 0 disables LOD
+    float reduction = 0.25f;            //every level keeps about this fraction of the triangles of the previous one
+    unsigned min_triangles = 32;        //levels are not simplified below this many triangles
+    float error_scale = 1.0f;           //a level serves rays whose footprint at the object is at least error / error_scale
+    bool full_detail_primary = true;    //camera rays always see the full mesh
+};
+
+struct SimplifiedMesh {
+    std::vector<vec3f> vertices;        //three per triangle
+    float error;                        //bound on the distance of the surface from the full mesh
+};
+
+//simplifies a triangle soup (three vertices per triangle, shared corners welded by position) by collapsing edges
+//in the order of their quadric error; returns the levels from fine to coarse, fewer than requested when the mesh
+//cannot be reduced any further without destroying it
+std::vector<SimplifiedMesh> SimplifyMesh(const std::vector<vec3f>& vertices, const LODOptions& options);
+
+#endif
@@ -5,6 +5,7 @@
 #include "camera.h"
 #include "ray.h"
 #include "objects.h"
+#include "dispatch.h"
 
 
 //constexpr GLsizei WINDOW_WIDTH = 512, WINDOW_HEIGHT = 512;
@@ -29,6 +30,7 @@ int initGL() {
     std::cout << "Renderer: " << glGetString(GL_RENDERER) << std::endl;
     std::cout << "Version: " << glGetString(GL_VERSION) << std::endl;
     std::cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << std::endl;
+    std::cout << "Kernels: " << GetKernels().name << std::endl;
     return 0;
 }
 
@@ -62,17 +64,24 @@ int main(int argc, char** argv) {
     vec3f absorbation_spectre1(0.8f, 0.5f, 0.4f);
     vec3f absorbation_spectre2(0.3f, 0.4f, 0.8f);
 
-    EmissiveMaterial emissive1(colour1);
-    EmissiveMaterial emissive2(colour2);
-    EmissiveMaterial emissive3(colour3);
+//---------scene creation-----------------------------------------------------------
+//the scene owns the materials and the objects it creates, the meshes are kept on huge pages
+    ArenaOptions geometry_options;
+    geometry_options.huge_pages = true;
+    Scene scene(geometry_options);
+//----------------------------------------------------------------------------------
+
+    Material* emissive1 = scene.Create<EmissiveMaterial>(colour1);
+    Material* emissive2 = scene.Create<EmissiveMaterial>(colour2);
+    Material* emissive3 = scene.Create<EmissiveMaterial>(colour3);
 
-    DielectricMaterial glass(1.5f, 1.0f);
+    Material* glass = scene.Create<DielectricMaterial>(1.5f, 1.0f);
 
-    DielectricMaterial diamond(2.4f, 1.5f);
+    Material* diamond = scene.Create<DielectricMaterial>(2.4f, 1.5f);
 
-    DiffuseMaterial cement(absorbation_spectre);
-    DiffuseMaterial gips(absorbation_spectre1);
-    DiffuseMaterial blue_gips(absorbation_spectre2);
+    Material* cement = scene.Create<DiffuseMaterial>(absorbation_spectre);
+    Material* gips = scene.Create<DiffuseMaterial>(absorbation_spectre1);
+    Material* blue_gips = scene.Create<DiffuseMaterial>(absorbation_spectre2);
 
 //-------sphere creation------------------------------------------------------------
 
@@ -84,24 +93,24 @@ int main(int argc, char** argv) {
 
     vec3f diffuse_sphere_center(-7.0f, -3.0f, 1.0f);
 
-    Sphere light(&emissive1, light_center, 2.0f);
+    Sphere* light = scene.Create<Sphere>(emissive1, light_center, 2.0f);
 
-    Sphere sphere(&diamond, sphere_center, 0.5f);
+    Sphere* sphere = scene.Create<Sphere>(diamond, sphere_center, 0.5f);
 
-    Sphere glass_sphere(&glass, glass_sphere_center, 2.0f);
+    Sphere* glass_sphere = scene.Create<Sphere>(glass, glass_sphere_center, 2.0f);
 
-    Sphere diffuse_sphere(&blue_gips, diffuse_sphere_center, 1.5f);
+    Sphere* diffuse_sphere = scene.Create<Sphere>(blue_gips, diffuse_sphere_center, 1.5f);
 
-    Sphere sky(&emissive1, sphere_center, 40.0f);
+    Sphere* sky = scene.Create<Sphere>(emissive1, sphere_center, 40.0f);
 
 //----------------------------------------------------------------------------------
 
 //-------cilinder creation----------------------------------------------------------
 
     vec3f pedestal_center(0.0f, 0.0f, -0.5f);
-    Cilinder pedestal(&cement, pedestal_center, 2.0f, 1.0f);
+    Cilinder* pedestal = scene.Create<Cilinder>(cement, pedestal_center, 2.0f, 1.0f);
     vec3f table_center(0.0f, 0.0f, -1.5f);
-    Cilinder table(&gips, table_center, 10.0f, 1.0f);
+    Cilinder* table = scene.Create<Cilinder>(gips, table_center, 10.0f, 1.0f);
 
 //----------------------------------------------------------------------------------
 
@@ -140,18 +149,18 @@ int main(int argc, char** argv) {
     Polygon polygon8(vertex6, vertex5, vertex2);
     octahedron_polygons.push_back(polygon8);
 
-    PolygonalObject octahedron(&glass, octahedron_polygons);
-
-//---------scene creation-----------------------------------------------------------
-    Scene scene;
-    scene.AddObject(&light);
-    scene.AddObject(&pedestal);
-    scene.AddObject(&table);
-    scene.AddObject(&sphere);
-    scene.AddObject(&glass_sphere);
-    scene.AddObject(&octahedron);
-    scene.AddObject(&diffuse_sphere);
-//    scene.AddObject(&sky);
+    PolygonalObject* octahedron = scene.Create<PolygonalObject>(glass, octahedron_polygons);
+
+//---------scene filling------------------------------------------------------------
+    scene.AddObject(light);
+    scene.AddObject(pedestal);
+    scene.AddObject(table);
+    scene.AddObject(sphere);
+    scene.AddObject(glass_sphere);
+    scene.AddObject(octahedron);
+    scene.AddObject(diffuse_sphere);
+//    scene.AddObject(sky);
+    scene.Build();
 //----------------------------------------------------------------------------------
     
 //---------camera creation----------------------------------------------------------
@@ -164,6 +173,9 @@ int main(int argc, char** argv) {
 //----------------------------------------------------------------------------------
     
     camera.Render(screenBuffer, scene); //rendering
+    ImageWriter writer;                 //written in the background while the window is shown
+    writer.Save(screenBuffer, "../resources/night_test_image.png");
+    writer.Save(screenBuffer, "../resources/night_test_image.exr");   //unclamped radiance
 
 
     if(!glfwInit())
@@ -198,7 +210,6 @@ int main(int argc, char** argv) {
         
     	glfwSwapBuffers(window);
     }
-    screenBuffer.Save("../resources/night_test_image.png");
     
     glfwTerminate();
     return 0;
@@ -1,8 +1,15 @@
 #include <cmath>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include <unordered_set>
 
 #include "objects.h"
 #include "geometry.h"
 #include "ray.h"
+#include "parallel.h"
+#include "fastmath.h"
+#include "dispatch.h"
 
 
 vec3f DielectricMaterial::GetRayColour(const Ray& ray, const vec3f& hitpoint, const vec3f& normal, const Side& side, const Scene& scene) const {
@@ -16,7 +23,7 @@ vec3f DielectricMaterial::GetRayColour(const Ray& ray, const vec3f& hitpoint, co
         R0 *= R0;
     }
     Teta = (-ray.GetDirection()) * normal;
-    R = R0 + (1 - R0) * pow(1 - Teta, 5);
+    R = R0 + (1 - R0) * Pow5(1 - Teta);
     if (ray.GetCurRecursionDepth() < ray.GetMaxRecursionDepth()){
         if (side == OUTSIDE) {
             return ((scene.Intersect(ray.Reflect(hitpoint, normal)) * R) + (scene.Intersect(ray.Refract(hitpoint, normal, inner_refractive_index)) * (1 - R)));
@@ -36,31 +43,110 @@ vec3f DiffuseMaterial :: Absorb(const vec3f& colour) const {
     return absorbed_colour;
 }
 
+//the directions are drawn with the density of the cosine to the normal, so every ray carries the same weight
 vec3f DiffuseMaterial::GetRayColour(const Ray& ray, const vec3f& hitpoint, const vec3f& normal, const Side& side, const Scene& scene) const {
     vec3f max_recursion_colour(0.0f, 0.0f, 0.0f);
     vec3f result_colour(0.0f, 0.0f, 0.0f);
     unsigned number_of_diffused_rays = 4;
-    float intensivity;
-    float cosinus_sum = 0;
-    std::vector<Ray> diffused_rays;
-    std::vector<float> cosinuses;
+    RayVector diffused_rays;
     if (ray.GetCurRecursionDepth() < ray.GetMaxRecursionDepth()){
-        for (int i = 0; i < number_of_diffused_rays; i++) {
-            Ray diffused_ray = ray.Diffuse(hitpoint, normal);
-            diffused_rays.push_back(diffused_ray);
-            cosinuses.push_back(diffused_ray.GetDirection() * normal);
-            cosinus_sum += cosinuses.back();
-        }
-        for (int i = 0; i < number_of_diffused_rays; i++){
-            intensivity = cosinuses[i] / cosinus_sum;
-            result_colour = result_colour + Absorb((scene.Intersect(diffused_rays[i]) * intensivity));
-        }
-        return result_colour;
+        ray.DiffuseFan(hitpoint, normal, number_of_diffused_rays, diffused_rays);
+        for (int i = 0; i < number_of_diffused_rays; i++)
+            result_colour = result_colour + scene.Intersect(diffused_rays[i]);
+        return Absorb(result_colour * (1.0f / number_of_diffused_rays));
     } else {
         return max_recursion_colour;
     }
 }
 
+void Scene::AddObject(Object* new_object) {
+    if (!built) {
+        objects.push_back(new_object);
+        return;
+    }
+    dynamic_leaves.push_back(dynamic_bvh.Insert(new_object -> GetBounds(), uint32_t(dynamic_objects.size())));
+    dynamic_objects.push_back(new_object);
+}
+
+bool Scene::RemoveObject(const Object* object) {
+    if (object == nullptr)      //removed static slots hold nullptr
+        return false;
+    for (size_t i = 0; i < dynamic_objects.size(); i++) {
+        if (dynamic_objects[i] == object) {
+            //the last dynamic object fills the gap, its leaf is told its new index
+            dynamic_bvh.Remove(dynamic_leaves[i]);
+            dynamic_objects[i] = dynamic_objects.back();
+            dynamic_leaves[i] = dynamic_leaves.back();
+            dynamic_objects.pop_back();
+            dynamic_leaves.pop_back();
+            if (i < dynamic_objects.size())
+                dynamic_bvh.SetPrimitive(dynamic_leaves[i], uint32_t(i));
+            return true;
+        }
+    }
+    //static slots are only emptied, with spatial splits the object may occupy several of them
+    bool found = false;
+    for (size_t i = 0; i < objects.size(); i++) {
+        if (objects[i] == object) {
+            objects[i] = nullptr;
+            removed_slot_count++;
+            found = true;
+        }
+    }
+    return found;
+}
+
+void Scene::Build(const AcceleratorOptions& options) {
+    build_options = options;
+    for (size_t i = 0; i < owned_objects.size(); i++)
+        owned_objects[i] -> PlaceGeometry(geometry_arena);
+    //gather the live objects once each: slots may hold duplicates after a spatial split build
+    std::vector<Object*> distinct_objects;
+    std::unordered_set<const Object*> seen;
+    for (size_t i = 0; i < objects.size(); i++) {
+        if (objects[i] != nullptr && seen.insert(objects[i]).second)
+            distinct_objects.push_back(objects[i]);
+    }
+    distinct_objects.insert(distinct_objects.end(), dynamic_objects.begin(), dynamic_objects.end());
+    dynamic_objects.clear();
+    dynamic_leaves.clear();
+    dynamic_bvh.Clear();
+    removed_slot_count = 0;
+
+    std::vector<AABB> object_bounds;
+    for (size_t i = 0; i < distinct_objects.size(); i++)
+        object_bounds.push_back(distinct_objects[i] -> GetBounds());
+    accelerator.Build(object_bounds, options);
+    objects.clear();
+    for (size_t i = 0; i < accelerator.GetPrimitiveIndices().size(); i++)
+        objects.push_back(distinct_objects[accelerator.GetPrimitiveIndices()[i]]);
+    built = true;
+}
+
+bool Scene::Update(float max_cost_ratio, float max_edit_ratio) {
+    if (dynamic_objects.size() + removed_slot_count > max_edit_ratio * objects.size()) {
+        Build(build_options);
+        return true;
+    }
+    std::vector<AABB> slot_bounds(objects.size());
+    ParallelFor(0, objects.size(), [&](size_t i) {
+        if (objects[i] != nullptr)
+            slot_bounds[i] = objects[i] -> GetBounds();
+    }, 256);
+    if (!accelerator.Refit(slot_bounds) || accelerator.GetCost() > max_cost_ratio * accelerator.GetBuildCost()) {
+        Build(build_options);
+        return true;
+    }
+    for (size_t i = 0; i < dynamic_objects.size(); i++) {
+        AABB bounds = dynamic_objects[i] -> GetBounds();
+        const AABB& old_bounds = dynamic_bvh.GetLeafBounds(dynamic_leaves[i]);
+        if (bounds.min.x != old_bounds.min.x || bounds.min.y != old_bounds.min.y || bounds.min.z != old_bounds.min.z ||
+            bounds.max.x != old_bounds.max.x || bounds.max.y != old_bounds.max.y || bounds.max.z != old_bounds.max.z)
+            dynamic_bvh.Move(dynamic_leaves[i], bounds);
+    }
+    return false;
+}
+
 vec3f Scene::Intersect(const Ray& ray) const {
     vec3f background_colour(0.3f, 0.6f, 0.7f);
 //    vec3f background_colour(0.6f, 0.8f, 1.0f);
@@ -71,26 +157,48 @@ vec3f Scene::Intersect(const Ray& ray) const {
     vec3f min_hitpoint;
     vec3f min_normal;
     Side min_side;
-    vec3f infinity(1000.0f, 1000.0f, 1000.0f);
-    int closest_object = -1;
-    min_hitpoint = infinity;
-    for (int i = 0; i < objects.size(); i++){
-        if(objects[i] -> Hitted(ray, hitpoint, normal, side)) {
-            if ((hitpoint - ray.GetStartingPoint()).norm() < (min_hitpoint - ray.GetStartingPoint()).norm()) {
+    float min_distance = ray.GetTMax();
+    const Object* closest_object = nullptr;
+    auto intersect = [&](const Object* object, float& tmax) {
+        if (object != nullptr && object -> Hitted(ray, hitpoint, normal, side)) {
+            float distance = (hitpoint - ray.GetStartingPoint()).norm();
+            if (distance >= ray.GetTMin() && distance < tmax) {
+                tmax = distance;
                 min_hitpoint = hitpoint;
                 min_normal = normal;
                 min_side = side;
-                closest_object = i;
+                closest_object = object;
+                return true;
             }
         }
-    }
-    if (closest_object == -1)
+        return false;
+    };
+    accelerator.Traverse(ray, min_distance, [&](uint32_t i, float& tmax) {
+        return intersect(objects[i], tmax);
+    });
+    dynamic_bvh.Traverse(ray, min_distance, [&](uint32_t i, float& tmax) {
+        return intersect(dynamic_objects[i], tmax);
+    });
+    if (closest_object == nullptr)
         return background_colour;
     else {
-        return objects[closest_object] -> GetRayColour(ray, min_hitpoint, min_normal, min_side, *this);
+        return closest_object -> GetRayColour(ray, min_hitpoint, min_normal, min_side, *this);
     }
 }
 
+std::vector<Object*> Scene::GetObjects() const {
+    //with spatial splits an object may occupy several static slots, it is listed once
+    std::vector<Object*> scene_objects;
+    std::unordered_set<const Object*> listed;
+    for (size_t i = 0; i < objects.size(); i++)
+        if (objects[i] != nullptr && listed.insert(objects[i]).second)
+            scene_objects.push_back(objects[i]);
+    for (size_t i = 0; i < dynamic_objects.size(); i++)
+        if (dynamic_objects[i] != nullptr)
+            scene_objects.push_back(dynamic_objects[i]);
+    return scene_objects;
+}
+
 Polygon::Polygon(const vec3f& in_first_vertex, const vec3f& in_second_vertex, const vec3f& in_third_vertex) {
     first_vertex = in_first_vertex;
     second_vertex = in_second_vertex;
@@ -125,7 +233,7 @@ bool Polygon :: Hitted(const Ray& ray, vec3f& hitpoint, vec3f& in_normal, Side&
         return false;
     }
     float t = (e2 * qvec) * inv_det;
-    if (t > 0){
+    if (t > 0 && t >= ray.GetTMin()){
         hitpoint = ray.GetStartingPoint() + (ray.GetDirection() * t);
         if (det < 0) {
             side = INSIDE;
@@ -140,27 +248,313 @@ bool Polygon :: Hitted(const Ray& ray, vec3f& hitpoint, vec3f& in_normal, Side&
     }
 }
 
-bool PolygonalObject :: Hitted(const Ray& ray, vec3f& hitpoint, vec3f& normal, Side& side) const {
-    vec3f infinity(1000.0f, 1000.0f, 1000.0f);
-    vec3f min_hitpoint = infinity;
-    vec3f min_normal;
-    Side min_side;
-    unsigned closest_polygon = -1;
-    for (int i = 0; i < polygons.size(); i++) {
-        if (polygons[i].Hitted(ray, hitpoint, normal, side)){
-             if ((hitpoint - ray.GetStartingPoint()).norm() < (min_hitpoint - ray.GetStartingPoint()).norm()) {
-                min_hitpoint = hitpoint;
-                min_normal = normal;
-                min_side = side;
-                closest_polygon = i;
-            }           
+AABB Polygon::GetBounds() const {
+    AABB bounds;
+    bounds.Extend(first_vertex);
+    bounds.Extend(second_vertex);
+    bounds.Extend(third_vertex);
+    return bounds;
+}
+
+AABB Polygon::GetClippedBounds(unsigned axis, float slab_min, float slab_max) const {
+    //the clipped triangle's vertices are the original ones inside the slab plus the edge crossings of its planes
+    AABB bounds;
+    const vec3f vertices[3] = { first_vertex, second_vertex, third_vertex };
+    for (unsigned i = 0; i < 3; i++) {
+        const vec3f& start = vertices[i];
+        const vec3f& end = vertices[(i + 1) % 3];
+        if (start[axis] >= slab_min && start[axis] <= slab_max)
+            bounds.Extend(start);
+        const float planes[2] = { slab_min, slab_max };
+        for (unsigned j = 0; j < 2; j++) {
+            if ((start[axis] < planes[j]) != (end[axis] < planes[j])) {
+                vec3f crossing = start + (end - start) * ((planes[j] - start[axis]) / (end[axis] - start[axis]));
+                crossing[axis] = planes[j];
+                bounds.Extend(crossing);
+            }
         }
     }
-    if ( closest_polygon == -1){
-        return false;
+    return bounds;
+}
+
+PolygonalObject::PolygonalObject(Material* in_material, std::vector<Polygon>& in_polygons, const BVHBuildOptions& options, const LODOptions& in_lod_options,
+                                 VertexFormat in_vertex_format) : Object(in_material), built(false) {
+    polygons = in_polygons;
+    build_options = options;
+    lod_options = in_lod_options;
+    vertex_format = in_vertex_format;
+    for (size_t i = 0; i < polygons.size(); i++)
+        bounds.Extend(polygons[i].GetBounds());
+    if (vertex_format == VERTEX_QUANTIZED) {
+        //the BVH boxes, the bounds and GetPolygons describe the triangles the kernels decode, not the original ones
+        code_bounds = bounds;
+        TriangleLanes grid;
+        grid.BuildQuantized(polygons.data(), polygons.size(), code_bounds);
+        bounds = AABB();
+        for (size_t i = 0; i < polygons.size(); i++) {
+            polygons[i] = grid.Decode(i);
+            bounds.Extend(polygons[i].GetBounds());
+        }
+    }
+    if (!options.lazy)
+        std::call_once(build_flag, &PolygonalObject::BuildBVH, this);
+}
+
+PolygonalObject::PolygonalObject(Material* in_material, const Polygon* in_polygons, size_t in_polygon_count, const float* in_lane_coordinates,
+                                 const BVHImage& in_bvh) : Object(in_material), built(true) {
+    external_polygons = in_polygons;
+    external_polygon_count = in_polygon_count;
+    lanes.Attach(in_lane_coordinates, in_polygon_count);
+    bounds = in_bvh.bounds;
+    bvh.Attach(in_bvh);
+}
+
+void PolygonalObject::EnsureBuilt() const {
+    if (!built.load(std::memory_order_acquire))
+        std::call_once(build_flag, &PolygonalObject::BuildBVH, this);
+}
+
+const Polygon* PolygonalObject::GetPolygons() const {
+    EnsureBuilt();
+    if (lanes.quantized) {
+        std::call_once(decode_flag, [this]() {
+            decoded_polygons.reserve(lanes.count);
+            for (size_t i = 0; i < lanes.count; i++)
+                decoded_polygons.push_back(lanes.Decode(i));
+        });
+        return decoded_polygons.data();
+    }
+    return external_polygons != nullptr ? external_polygons : polygons.data();
+}
+
+size_t PolygonalObject::GetPolygonCount() const {
+    EnsureBuilt();
+    return external_polygons != nullptr ? external_polygon_count : lanes.count;
+}
+
+const BVH& PolygonalObject::GetBVH() const {
+    EnsureBuilt();
+    return bvh;
+}
+
+size_t PolygonalObject::GetLODLevelCount() const {
+    EnsureBuilt();
+    return lod_levels.size();
+}
+
+namespace {
+
+//builds the BVH over the polygons and puts them into leaf order
+void BuildPolygonBVH(std::vector<Polygon>& polygons, BVH& bvh, const BVHBuildOptions& options) {
+    std::vector<AABB> polygon_bounds;
+    for (size_t i = 0; i < polygons.size(); i++)
+        polygon_bounds.push_back(polygons[i].GetBounds());
+    bvh.Build(polygon_bounds, options, [&polygons](uint32_t polygon, unsigned axis, float slab_min, float slab_max) {
+        return polygons[polygon].GetClippedBounds(axis, slab_min, slab_max);
+    });
+    std::vector<Polygon> ordered_polygons;
+    ordered_polygons.reserve(bvh.GetPrimitiveIndices().size());
+    for (size_t i = 0; i < bvh.GetPrimitiveIndices().size(); i++)
+        ordered_polygons.push_back(polygons[bvh.GetPrimitiveIndices()[i]]);
+    polygons.swap(ordered_polygons);
+}
+
+}
+
+void PolygonalObject::BuildBVH() const {
+    if (lod_options.level_count > 0) {
+        std::vector<vec3f> vertices;
+        vertices.reserve(3 * polygons.size());
+        for (size_t i = 0; i < polygons.size(); i++) {
+            vertices.push_back(polygons[i].GetFirstVertex());
+            vertices.push_back(polygons[i].GetSecondVertex());
+            vertices.push_back(polygons[i].GetThirdVertex());
+        }
+        std::vector<SimplifiedMesh> meshes = SimplifyMesh(vertices, lod_options);
+        lod_levels.resize(meshes.size());
+        for (size_t level = 0; level < meshes.size(); level++) {
+            const std::vector<vec3f>& level_vertices = meshes[level].vertices;
+            for (size_t i = 0; i + 2 < level_vertices.size(); i += 3)
+                lod_levels[level].polygons.push_back(Polygon(level_vertices[i], level_vertices[i + 1], level_vertices[i + 2]));
+            lod_levels[level].error = meshes[level].error;
+            BuildPolygonBVH(lod_levels[level].polygons, lod_levels[level].bvh, build_options);
+            lod_levels[level].lanes.Build(lod_levels[level].polygons.data(), lod_levels[level].polygons.size());
+        }
+    }
+    BuildPolygonBVH(polygons, bvh, build_options);
+    if (vertex_format == VERTEX_QUANTIZED) {
+        lanes.BuildQuantized(polygons.data(), polygons.size(), code_bounds);
+        std::vector<Polygon>().swap(polygons);
     } else {
-        return true;
+        lanes.Build(polygons.data(), polygons.size());
+    }
+    built.store(true, std::memory_order_release);
+}
+
+size_t TriangleLanes::GetStride(size_t count) {
+    return (count + 2 * Kernels::max_triangles - 1) / Kernels::max_triangles * Kernels::max_triangles;
+}
+
+void TriangleLanes::Build(const Polygon* polygons, size_t in_count) {
+    count = in_count;
+    stride = GetStride(count);
+    coordinates.assign(9 * stride, 0.0f);
+    for (size_t i = 0; i < count; i++) {
+        const vec3f vertices[3] = { polygons[i].GetFirstVertex(), polygons[i].GetSecondVertex(), polygons[i].GetThirdVertex() };
+        for (unsigned vertex = 0; vertex < 3; vertex++)
+            for (unsigned axis = 0; axis < 3; axis++)
+                coordinates[(vertex * 3 + axis) * stride + i] = vertices[vertex][axis];
+    }
+}
+
+void TriangleLanes::Attach(const float* in_coordinates, size_t in_count) {
+    count = in_count;
+    stride = GetStride(count);
+    external_coordinates = in_coordinates;
+}
+
+//codes are the nearest of 65536 steps over the bounds, so that shared vertices stay shared and the mesh watertight
+void TriangleLanes::BuildQuantized(const Polygon* polygons, size_t in_count, const AABB& bounds) {
+    quantized = true;
+    count = in_count;
+    stride = GetStride(count);
+    for (unsigned axis = 0; axis < 3; axis++) {
+        code_origin[axis] = bounds.min[axis];
+        code_scale[axis] = (bounds.max[axis] - bounds.min[axis]) / 65535.0f;
+    }
+    codes.assign(9 * stride, 0);
+    normals.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        const vec3f vertices[3] = { polygons[i].GetFirstVertex(), polygons[i].GetSecondVertex(), polygons[i].GetThirdVertex() };
+        for (unsigned vertex = 0; vertex < 3; vertex++) {
+            for (unsigned axis = 0; axis < 3; axis++) {
+                float step = code_scale[axis] > 0.0f ? (vertices[vertex][axis] - code_origin[axis]) / code_scale[axis] : 0.0f;
+                codes[(vertex * 3 + axis) * stride + i] = uint16_t(std::lround(std::min(std::max(step, 0.0f), 65535.0f)));
+            }
+        }
+        normals[i] = EncodeOctahedral(polygons[i].GetNormal());
+    }
+}
+
+Polygon TriangleLanes::Decode(size_t slot) const {
+    const uint16_t* slot_codes = GetCodes() + slot;
+    vec3f vertices[3];
+    for (unsigned vertex = 0; vertex < 3; vertex++)
+        for (unsigned axis = 0; axis < 3; axis++)
+            vertices[vertex][axis] = code_origin[axis] + float(slot_codes[(vertex * 3 + axis) * stride]) * code_scale[axis];
+    return Polygon(vertices[0], vertices[1], vertices[2]);
+}
+
+void TriangleLanes::Place(Arena& arena) {
+    if (quantized) {
+        if (external_codes != nullptr)
+            return;
+        external_codes = arena.Copy(codes.data(), codes.size(), 64);
+        external_normals = arena.Copy(normals.data(), normals.size());
+        std::vector<uint16_t, AlignedAllocator<uint16_t, 32>>().swap(codes);
+        std::vector<uint32_t>().swap(normals);
+        return;
+    }
+    if (external_coordinates != nullptr)
+        return;
+    external_coordinates = arena.Copy(coordinates.data(), coordinates.size(), 64);
+    std::vector<float, AlignedAllocator<float, 32>>().swap(coordinates);
+}
+
+void PolygonalObject::PlaceGeometry(Arena& arena) {
+    if (!IsBuilt() || placed)
+        return;
+    placed = true;
+    lanes.Place(arena);
+    if (external_polygons != nullptr)   //owned by someone else (a mapped scene cache) together with the nodes
+        return;
+    if (!lanes.quantized) {
+        external_polygons = arena.Copy(polygons.data(), polygons.size());
+        external_polygon_count = polygons.size();
+        std::vector<Polygon>().swap(polygons);
     }
+    BVHImage image = bvh.GetImage();
+    image.nodes = arena.Copy(static_cast<const char*>(image.nodes), image.node_count * image.node_size, 64);
+    bvh.Attach(image);
+}
+
+bool PolygonalObject :: Hitted(const Ray& ray, vec3f& hitpoint, vec3f& normal, Side& side) const {
+    float tentry = 0.0f;
+    if (!built.load(std::memory_order_acquire) || lod_options.level_count > 0) {
+        //rays that miss the bounds never pay for the build; concurrent first rays wait for a single builder
+        if (!IntersectBox(bounds.min, bounds.max, ray.GetStartingPoint(), ray.GetInverseDirection(), ray.GetTMax(), tentry))
+            return false;
+        if (!built.load(std::memory_order_acquire))
+            std::call_once(build_flag, &PolygonalObject::BuildBVH, this);
+    }
+    const Polygon* leaf_polygons = external_polygons != nullptr ? external_polygons : polygons.data();
+    const TriangleLanes* leaf_lanes = &lanes;
+    const BVH* level_bvh = &bvh;
+    //the coarsest level whose error the ray cone cannot resolve where it reaches the object
+    if (!lod_levels.empty() && !(lod_options.full_detail_primary && ray.GetCurRecursionDepth() == 0)) {
+        float footprint = ray.GetFootprint(tentry) * lod_options.error_scale;
+        for (size_t level = lod_levels.size(); level-- > 0;) {
+            if (lod_levels[level].error <= footprint) {
+                leaf_polygons = lod_levels[level].polygons.data();
+                leaf_lanes = &lod_levels[level].lanes;
+                level_bvh = &lod_levels[level].bvh;
+                break;
+            }
+        }
+    }
+    float min_distance = std::numeric_limits<float>::max();
+    //the kernel for the CPU tests up to eight polygons of a leaf at once and the hits are taken in slot order, exactly
+    //as Polygon::Hitted would report them; a leaf of one or two polygons is cheaper to test directly, unless only
+    //the quantized vertices are kept
+    const Kernels& kernels = GetKernels();
+    vec3f origin = ray.GetStartingPoint();
+    vec3f direction = ray.GetDirection();
+    vec3f polygon_hitpoint;
+    vec3f polygon_normal;
+    Side polygon_side;
+    return level_bvh -> TraverseLeaves(ray, min_distance, [&](uint32_t first, uint32_t count, float& tmax) {
+        bool hit = false;
+        if (count <= 2 && !leaf_lanes -> quantized) {
+            for (uint32_t i = first; i < first + count; i++) {
+                if (leaf_polygons[i].Hitted(ray, polygon_hitpoint, polygon_normal, polygon_side)) {
+                    float distance = (polygon_hitpoint - origin).norm();
+                    if (distance < tmax) {
+                        tmax = distance;
+                        hitpoint = polygon_hitpoint;
+                        normal = polygon_normal;
+                        side = polygon_side;
+                        hit = true;
+                    }
+                }
+            }
+            return hit;
+        }
+        for (uint32_t begin = first; begin < first + count; begin += Kernels::max_triangles) {
+            unsigned batch = std::min<uint32_t>(first + count - begin, Kernels::max_triangles);
+            float t[Kernels::max_triangles];
+            unsigned inside;
+            unsigned hits = leaf_lanes -> quantized ?
+                kernels.intersect_quantized_triangles(leaf_lanes -> GetCodes(), leaf_lanes -> stride, leaf_lanes -> code_origin, leaf_lanes -> code_scale,
+                                                      begin, batch, origin, direction, ray.GetTMin(), t, inside) :
+                kernels.intersect_triangles(leaf_lanes -> GetCoordinates(), leaf_lanes -> stride, begin, batch, origin, direction, ray.GetTMin(), t, inside);
+            while (hits) {
+                unsigned i = LowestBit(hits);
+                hits &= hits - 1;
+                polygon_hitpoint = origin + (direction * t[i]);
+                float distance = (polygon_hitpoint - origin).norm();
+                if (distance < tmax) {
+                    tmax = distance;
+                    hitpoint = polygon_hitpoint;
+                    side = (inside >> i) & 1 ? INSIDE : OUTSIDE;
+                    //quantized lanes keep no polygons, their normals are decoded
+                    normal = leaf_lanes -> quantized ? leaf_lanes -> GetNormal(begin + i) : leaf_polygons[begin + i].GetNormal();
+                    normal = side == INSIDE ? -normal : normal;
+                    hit = true;
+                }
+            }
+        }
+        return hit;
+    });
 }
 
 bool Sphere::Hitted(const Ray& ray, vec3f& hitpoint, vec3f& normal, Side& side) const {
@@ -172,8 +566,9 @@ bool Sphere::Hitted(const Ray& ray, vec3f& hitpoint, vec3f& normal, Side& side)
     float offset = sqrt(radius * radius - dist2);
     float t1 = projection_length - offset;
     float t2 = projection_length + offset;
-    if (t1 < 0)
-        if (t2 < 0)
+    float nearest = std::max(0.0f, ray.GetTMin());
+    if (t1 < nearest)
+        if (t2 < nearest)
             return false;
         else {
             hitpoint = ray.GetStartingPoint() + (ray.GetDirection() * t2);
@@ -189,98 +584,251 @@ bool Sphere::Hitted(const Ray& ray, vec3f& hitpoint, vec3f& normal, Side& side)
     return true;
 }
 
-Cilinder::Cilinder(Material* in_material, vec3f& in_center, float in_radius, float in_height) : Object(in_material) {
+AABB Sphere::GetBounds() const {
+    vec3f radius_vec(radius, radius, radius);
+    return AABB(center - radius_vec, center + radius_vec);
+}
+
+Cilinder::Cilinder(Material* in_material, vec3f& in_center, float in_radius, float in_height, const vec3f& in_axis) : Object(in_material) {
     center = in_center; 
+    axis = in_axis;
+    axis.normalize();
     radius = in_radius;
     height = in_height;
 }
 
-bool Cilinder::Hitted(const Ray& ray, vec3f& hitpoint, vec3f& normal, Side& side) const {
-    vec3f up(0.0f, 0.0f, 1.0f);
-    vec3f down(0.0f, 0.0f, -1.0f);
-    vec3f startpoint = ray.GetStartingPoint();
-    vec3f direction = ray.GetDirection();
-    float A = direction.x * direction.x + direction.y * direction.y;
-    float B = 2 * startpoint.x * direction.x - 2 * startpoint.x * center.x + 2 * startpoint.y * direction.y - 2 * direction.y * center.y;
-    float C = startpoint.x * startpoint.x + center.x * center.x - 2 * startpoint.x * center.x + startpoint.y * startpoint.y + center.y * center.y - 2 * startpoint.y * center.y - radius * radius;
-    float D = B*B - 4*A*C;
-    if (D < 0) {
+namespace {
+
+//_______capped cilinder as the intersection of the infinite cilinder with the slab between the caps_______
+//both side roots and both cap distances are computed, the entry and exit of the ray are their max and min;
+//a ray parallel to the axis gets an unbounded side interval, one parallel to the caps gets an unbounded or empty
+//slab interval from the infinities of the division. The only branch is the early out for rays that pass the
+//infinite cilinder
+
+struct CilinderInterval {
+    float side_near, side_far;
+    float slab_near, slab_far;
+    float t_near, t_far;
+};
+
+inline bool IntersectCilinderInterval(const vec3f& origin, const vec3f& direction, const vec3f& center, const vec3f& axis, float radius, float half_height,
+                                      float tmin, CilinderInterval& interval) {
+    //spelled out per component, this is the hot path of scenes full of cilinders
+    float offset_x = origin.x - center.x, offset_y = origin.y - center.y, offset_z = origin.z - center.z;
+    float direction_along = direction.x * axis.x + direction.y * axis.y + direction.z * axis.z;
+    float offset_along = offset_x * axis.x + offset_y * axis.y + offset_z * axis.z;
+    float across_x = direction.x - axis.x * direction_along, across_y = direction.y - axis.y * direction_along, across_z = direction.z - axis.z * direction_along;
+    float offset_across_x = offset_x - axis.x * offset_along, offset_across_y = offset_y - axis.y * offset_along, offset_across_z = offset_z - axis.z * offset_along;
+    float a = across_x * across_x + across_y * across_y + across_z * across_z;
+    float b = across_x * offset_across_x + across_y * offset_across_y + across_z * offset_across_z;
+    float c = offset_across_x * offset_across_x + offset_across_y * offset_across_y + offset_across_z * offset_across_z - radius * radius;
+    float discriminant = b * b - a * c;
+    if (discriminant < 0.0f)
         return false;
-    } else {
-        float t1 = (-B - sqrtf(D)) / (2 * A);
-        float t2 = (-B + sqrtf(D)) / (2 * A);
-        if (t1 < 0) {
-            if (t2 < 0)
-                return false;
-            else {
-                vec3f hit2 = startpoint + (direction * t2);
-                if (startpoint.z > center.z + height/2) {
-                    if (hit2.z > center.z + height/2){
-                        return false;
-                    } else {
-                        float t3 = (center.z + height/2 - startpoint.z) / direction.z;
-                        hitpoint = startpoint + (direction * t3);
-                        normal = up;
-                        side = OUTSIDE;
-                    }
-                } else if (fabs(startpoint.z - center.z) < height/2){
-                    if (hit2.z > center.z + height/2){
-                        float t3 = (center.z + height/2 - startpoint.z) / direction.z;
-                        hitpoint = startpoint + (direction * t3);
-                        normal = down;
-                        side = INSIDE;
-                    } else if (fabs(hit2.z - center.z) < height/2){
-                        hitpoint = hit2;
-                        normal = (up * ((hitpoint - center) * up) - hitpoint).normalize();
-                        side = INSIDE;
-                    } else {
-                        float t3 = (center.z - height/2 - startpoint.z) / direction.z;
-                        hitpoint = startpoint + (direction * t3);
-                        normal = up;
-                        side = INSIDE;
-                    }
-                } else {
-                    if (hit2.z < center.z - height/2){
-                        return false;
-                    } else {
-                        float t3 = (center.z - height/2 - startpoint.z) / direction.z;
-                        hitpoint = startpoint + (direction * t3);
-                        normal = down;
-                        side = OUTSIDE;
-                    }
+    float root = std::sqrt(discriminant);
+    float inv_a = 1.0f / a;
+    const float infinity = std::numeric_limits<float>::infinity();
+    bool parallel = a < 1e-12f;
+    bool inside_radius = c <= 0.0f;
+    interval.side_near = parallel ? (inside_radius ? -infinity : infinity) : (-b - root) * inv_a;
+    interval.side_far = parallel ? (inside_radius ? infinity : -infinity) : (-b + root) * inv_a;
+    float inv_along = 1.0f / direction_along;
+    float t_bottom = (-half_height - offset_along) * inv_along;
+    float t_top = (half_height - offset_along) * inv_along;
+    interval.slab_near = std::min(t_bottom, t_top);
+    interval.slab_far = std::max(t_bottom, t_top);
+    interval.t_near = std::max(interval.side_near, interval.slab_near);
+    interval.t_far = std::min(interval.side_far, interval.slab_far);
+    return interval.t_near <= interval.t_far && interval.t_far >= tmin;
+}
+
+//the nearest hit in front of the origin and not before tmin: the entry point seen from outside, the exit point from
+//inside or when the entry is closer than tmin
+bool IntersectCilinder(const Ray& ray, const vec3f& center, const vec3f& axis, float radius, float half_height, vec3f& hitpoint, vec3f& normal, Side& side) {
+    const vec3f& origin = ray.GetStartingPoint();
+    const vec3f& direction = ray.GetDirection();
+    CilinderInterval interval;
+    float tmin = std::max(0.0f, ray.GetTMin());
+    if (!IntersectCilinderInterval(origin, direction, center, axis, radius, half_height, tmin, interval))
+        return false;
+    bool outside = interval.t_near >= tmin;
+    float t = outside ? interval.t_near : interval.t_far;
+    bool on_cap = outside ? interval.slab_near >= interval.side_near : interval.slab_far <= interval.side_far;
+    hitpoint = origin + direction * t;
+    //normals face the ray: outwards when it comes from outside, inwards from inside
+    vec3f radial = hitpoint - center;
+    radial = radial - axis * (radial * axis);
+    vec3f cap_normal = axis * ((direction * axis) > 0.0f ? -1.0f : 1.0f);
+    normal = on_cap ? cap_normal : radial * ((outside ? 1.0f : -1.0f) / radial.norm());
+    side = outside ? OUTSIDE : INSIDE;
+    return true;
+}
+
+}
+
+bool Cilinder::Hitted(const Ray& ray, vec3f& hitpoint, vec3f& normal, Side& side) const {
+    return IntersectCilinder(ray, center, axis, radius, height / 2, hitpoint, normal, side);
+}
+
+AABB Cilinder::GetBounds() const {
+    //the caps are discs: along a coordinate axis each reaches radius times the sine of its angle to that axis
+    vec3f half_size;
+    for (unsigned i = 0; i < 3; i++)
+        half_size[i] = height / 2 * std::fabs(axis[i]) + radius * std::sqrt(std::max(1.0f - axis[i] * axis[i], 0.0f));
+    return AABB(center - half_size, center + half_size);
+}
+
+CilinderGroup::CilinderGroup(Material* in_material, const std::vector<Cilinder>& in_cilinders) : Object(in_material) {
+    //packets of up to four cilinders from the smallest subtrees of a BVH over all of them
+    std::vector<AABB> cilinder_bounds(in_cilinders.size());
+    for (size_t i = 0; i < in_cilinders.size(); i++)
+        cilinder_bounds[i] = in_cilinders[i].GetBounds();
+    BVHBuildOptions packing_options;
+    packing_options.width = 2;
+    BVH packing_bvh;
+    packing_bvh.Build(cilinder_bounds, packing_options);
+    std::vector<std::pair<uint32_t, uint32_t>> ranges = packing_bvh.GetSubtreeSlotRanges(4);
+
+    std::vector<AABB> packet_bounds;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        //a bigger leaf is split into several packets
+        for (uint32_t begin = ranges[i].first; begin < ranges[i].second; begin += 4) {
+            Packet packet;
+            memset(&packet, 0, sizeof(packet));
+            packet.first = uint32_t(cilinders.size());
+            packet.count = std::min(ranges[i].second - begin, 4u);
+            AABB bounds_of_packet;
+            for (uint32_t lane = 0; lane < packet.count; lane++) {
+                const Cilinder& cilinder = in_cilinders[packing_bvh.GetPrimitiveIndices()[begin + lane]];
+                for (unsigned axis = 0; axis < 3; axis++) {
+                    packet.center[axis][lane] = cilinder.GetCenter()[axis];
+                    packet.axis[axis][lane] = cilinder.GetAxis()[axis];
                 }
+                packet.radius[lane] = cilinder.GetRadius();
+                packet.half_height[lane] = cilinder.GetHeight() / 2;
+                bounds_of_packet.Extend(cilinder.GetBounds());
+                cilinders.push_back(cilinder);
             }
+            packets.push_back(packet);
+            packet_bounds.push_back(bounds_of_packet);
+            bounds.Extend(bounds_of_packet);
         }
-        else {
-            vec3f hit1 = startpoint + (direction * t1);
-            vec3f hit2 = startpoint + (direction * t2);
-            if (fabs(hit1.z - center.z) < height/2){
-                hitpoint = hit1;
-                normal = (hitpoint - (center + (up * ((hitpoint - center) * up)))).normalize();
-                side = OUTSIDE;
-                return true;
-            } else if(hit1.z > center.z + height/2){
-                if (hit2.z > center.z + height/2){
-                    return false;
-                } else {
-                    float t3 = (center.z + height/2 - hit1.z) / direction.z;
-                    hit1 = hit1 + (direction * t3);
-                    normal = up;
-                    side = OUTSIDE;
-                    hitpoint = hit1;
-                }
-            } else {
-                if (hit2.z < center.z - height/2){
-                    return false;
-                } else {
-                    float t3 = (center.z - height/2 - hit1.z) / direction.z;
-                    hit1 = hit1 + (direction * t3);
-                    normal = down;
-                    side = OUTSIDE;
-                    hitpoint = hit1;
-                }
-            }
+    }
+    BVHBuildOptions packet_options;
+    packet_options.max_leaf_size = 1;
+    bvh.Build(packet_bounds, packet_options);
+}
+
+namespace {
+
+//distance to the nearest of the packet's cilinders in [tmin, tmax) in front of the origin, -1 if none
+int IntersectCilinderPacket(const float (&center)[3][4], const float (&axis)[3][4], const float (&radius)[4], const float (&half_height)[4],
+                            unsigned count, const vec3f& origin, const vec3f& direction, float tmin, float tmax, float& t) {
+    const float4 zero(0.0f);
+    const float4 infinity(std::numeric_limits<float>::infinity());
+    vec3f4 lane_axis(float4::Load(axis[0]), float4::Load(axis[1]), float4::Load(axis[2]));
+    vec3f4 offset = Broadcast<4>(origin) - vec3f4(float4::Load(center[0]), float4::Load(center[1]), float4::Load(center[2]));
+    vec3f4 ray_direction = Broadcast<4>(direction);
+    float4 direction_along = ray_direction * lane_axis;
+    float4 offset_along = offset * lane_axis;
+    vec3f4 across = ray_direction - lane_axis * direction_along;
+    vec3f4 offset_across = offset - lane_axis * offset_along;
+    float4 a = across * across;
+    float4 b = across * offset_across;
+    float4 lane_radius = float4::Load(radius);
+    float4 c = offset_across * offset_across - lane_radius * lane_radius;
+    float4 discriminant = b * b - a * c;
+    mask4 passes = discriminant >= zero;
+    unsigned lane_mask = (1u << count) - 1;
+    if ((passes.Bits() & lane_mask) == 0)
+        return -1;
+    float4 root = Sqrt(Max(discriminant, zero));
+    float4 inv_a = float4(1.0f) / a;
+    float4 side_near = (-b - root) * inv_a;
+    float4 side_far = (-b + root) * inv_a;
+    //parallel to the axis: all or nothing depending on the distance from it
+    mask4 parallel = a < float4(1e-12f);
+    mask4 inside_radius = c <= zero;
+    side_near = Select(parallel, Select(inside_radius, -infinity, infinity), side_near);
+    side_far = Select(parallel, Select(inside_radius, infinity, -infinity), side_far);
+    float4 lane_half_height = float4::Load(half_height);
+    float4 inv_along = float4(1.0f) / direction_along;
+    float4 t_bottom = (-lane_half_height - offset_along) * inv_along;
+    float4 t_top = (lane_half_height - offset_along) * inv_along;
+    float4 t_near = Max(side_near, Min(t_bottom, t_top));
+    float4 t_far = Min(side_far, Max(t_bottom, t_top));
+    float4 lane_tmin(std::max(0.0f, tmin));
+    float4 lane_t = Select(t_near >= lane_tmin, t_near, t_far);
+    mask4 valid = (t_near <= t_far) & (t_far >= lane_tmin) & passes & (lane_t < float4(tmax));
+    unsigned mask = valid.Bits() & lane_mask;
+    if (mask == 0)
+        return -1;
+    float lane_ts[4];
+    lane_t.Store(lane_ts);
+    int nearest = -1;
+    while (mask) {
+        unsigned lane = LowestBit(mask);
+        mask &= mask - 1;
+        if (nearest < 0 || lane_ts[lane] < t) {
+            nearest = int(lane);
+            t = lane_ts[lane];
         }
     }
+    return nearest;
+}
+
+}
+
+bool CilinderGroup::Hitted(const Ray& ray, vec3f& hitpoint, vec3f& normal, Side& side) const {
+    const std::vector<uint32_t>& packet_slots = bvh.GetPrimitiveIndices();
+    uint32_t nearest = 0;
+    float min_distance = std::numeric_limits<float>::max();
+    bool hit = bvh.Traverse(ray, min_distance, [&](uint32_t slot, float& tmax) {
+        const Packet& packet = packets[packet_slots[slot]];
+        float t;
+        int lane = IntersectCilinderPacket(packet.center, packet.axis, packet.radius, packet.half_height, packet.count, ray.GetStartingPoint(), ray.GetDirection(), ray.GetTMin(), tmax, t);
+        if (lane < 0)
+            return false;
+        nearest = packet.first + unsigned(lane);
+        tmax = t;
+        return true;
+    });
+    //only the nearest cilinder's hitpoint and normal are worked out
+    return hit && cilinders[nearest].Hitted(ray, hitpoint, normal, side);
+}
+
+Instance::Instance(const Object* in_prototype, const mat3x4f& in_object_to_world, Material* in_material) : Object(in_material != nullptr ? in_material : in_prototype -> GetMaterial()) {
+    prototype = in_prototype;
+    SetTransform(in_object_to_world);
+}
+
+void Instance::SetTransform(const mat3x4f& in_object_to_world) {
+    object_to_world = in_object_to_world;
+    world_to_object = in_object_to_world.Inverse();
+}
+
+bool Instance::Hitted(const Ray& ray, vec3f& hitpoint, vec3f& normal, Side& side) const {
+    vec3f local_direction = world_to_object.TransformVector(ray.GetDirection());
+    Ray local_ray(local_direction, world_to_object.TransformPoint(ray.GetStartingPoint()), ray.GetRefrectiveIndex(), ray.GetCurRecursionDepth());
+    //object space distances are scaled by the length of the transformed unit direction, the cone angle is kept
+    float scale = local_direction.norm();
+    local_ray.SetCone(ray.GetConeWidth() * scale, ray.GetConeSpread());
+    local_ray.SetInterval(ray.GetTMin() * scale, std::min(ray.GetTMax() * scale, std::numeric_limits<float>::max()));
+    vec3f local_hitpoint;
+    vec3f local_normal;
+    if (!prototype -> Hitted(local_ray, local_hitpoint, local_normal, side))
+        return false;
+    hitpoint = object_to_world.TransformPoint(local_hitpoint);
+    normal = world_to_object.TransformTransposed(local_normal).normalize();
     return true;
-}
\ No newline at end of file
+}
+
+AABB Instance::GetBounds() const {
+    AABB local_bounds = prototype -> GetBounds();
+    AABB bounds;
+    for (unsigned corner = 0; corner < 8; corner++) {
+        vec3f point(corner & 1 ? local_bounds.max.x : local_bounds.min.x, corner & 2 ? local_bounds.max.y : local_bounds.min.y, corner & 4 ? local_bounds.max.z : local_bounds.min.z);
+        bounds.Extend(object_to_world.TransformPoint(point));
+    }
+    return bounds;
+}
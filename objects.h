@@ -3,8 +3,17 @@
 
 #include <vector>
 #include <string>
+#include <mutex>
+#include <atomic>
+#include <utility>
+#include <type_traits>
 #include "geometry.h"
 #include "ray.h"
+#include "bvh.h"
+#include "accelerator.h"
+#include "lod.h"
+#include "arena.h"
+#include "vertex_format.h"
 
 //--------ALL DEFINED CLASSES-------------------------
 class Material;
@@ -17,6 +26,8 @@ class Polygon;
 class PolygonalObject;
 class Sphere;
 class Cilinder;
+class CilinderGroup;
+class Instance;
 //----------------------------------------------------
 
 enum Side{
@@ -30,6 +41,7 @@ enum Side{
 
 class Material {
 public:
+    virtual ~Material() {}
     virtual vec3f GetRayColour(const Ray& ray, const vec3f& hitpoint, const vec3f& normal, const Side& side, const Scene& scene) const = 0;
 };
 
@@ -37,6 +49,7 @@ class EmissiveMaterial : public Material {
     vec3f colour;
 public:
     EmissiveMaterial(vec3f& in_colour) { colour = in_colour; };
+    vec3f GetColour() const { return colour; };
     vec3f GetRayColour(const Ray& ray, const vec3f& hitpoint, const vec3f& normal, const Side& side, const Scene& scene) const { return colour; };
 };
 
@@ -45,6 +58,8 @@ class DielectricMaterial : public Material {
     float outer_refractive_index;
 public:
     DielectricMaterial(float in_inner_refractive_index, float in_outer_refractive_index) : inner_refractive_index(in_inner_refractive_index), outer_refractive_index(in_outer_refractive_index) {};
+    float GetInnerRefractiveIndex() const { return inner_refractive_index; };
+    float GetOuterRefractiveIndex() const { return outer_refractive_index; };
     vec3f GetRayColour(const Ray& ray, const vec3f& hitpoint, const vec3f& normal, const Side& side, const Scene& scene) const;
 };
 
@@ -62,12 +77,55 @@ public:
 //_______class Scene for storing graphic objects________
 
 class Scene {
-    std::vector<Object*> objects;
+    //the geometry arena outlives the objects that use it, both outlive everything below
+    Arena geometry_arena;                   //polygons, lanes and BVH nodes of the owned polygonal objects
+    Arena object_arena;                     //materials and objects made by Create, destroyed by it
+    std::vector<Object*> owned_objects;     //the objects among them, whose geometry Build places
+    void RecordCreated(Object* object, std::true_type /*is an object*/) { owned_objects.push_back(object); }
+    void RecordCreated(const Material*, std::false_type) {}
+    std::vector<Object*> objects;           //slots of the static accelerator, removed objects are left as nullptr
+    Accelerator accelerator;
+    AcceleratorOptions build_options;
+    bool built = false;
+    size_t removed_slot_count = 0;
+    std::vector<Object*> dynamic_objects;   //added after Build, they live in the dynamic BVH until the next rebuild
+    std::vector<uint32_t> dynamic_leaves;
+    DynamicBVH dynamic_bvh;
 public:
-    void AddObject(Object* new_object) { objects.push_back(new_object); }
+    //geometry_options.huge_pages keeps the meshes' polygons and BVH nodes on 2MB pages, for fewer TLB misses
+    explicit Scene(const ArenaOptions& geometry_options = ArenaOptions()) : geometry_arena(geometry_options) {}
+    Scene(const Scene&) = delete;
+    Scene& operator=(const Scene&) = delete;
+    //constructs a material or an object owned by the scene, all of them are destroyed at once with it; an object
+    //still has to be added (the prototype of instances is not), Build moves the geometry of the built polygonal
+    //ones into the geometry arena. Objects made elsewhere (e.g. by a SceneCache) can be added as well
+    template <typename T, typename... Args> T* Create(Args&&... args);
+    //before Build the object is only collected, afterwards it is inserted into the dynamic BVH in O(log n)
+    void AddObject(Object* new_object);
+    //returns false if the object is not in the scene
+    bool RemoveObject(const Object* object);
+    //builds the acceleration structure (a BVH unless options.type selects the grid or the kd-tree), call after adding the objects
+    void Build(const AcceleratorOptions& options = AcceleratorOptions());
+    //call after moving, adding or removing objects (e.g. once per animation frame): refits the static and dynamic BVHs
+    //and rebuilds only when the static one's SAH cost has grown by more than max_cost_ratio since the last build or when
+    //the edits exceed max_edit_ratio of its objects; grids and kd-trees are always rebuilt; returns true on rebuild
+    bool Update(float max_cost_ratio = 1.5f, float max_edit_ratio = 0.25f);
     vec3f Intersect (const Ray& ray) const;
+    //the objects in the scene, static and dynamic ones, each once
+    std::vector<Object*> GetObjects() const;
+    const Accelerator& GetAccelerator() const { return accelerator; }
+    //bytes reserved by the arenas of the owned materials, objects and geometry
+    size_t GetArenaMemoryUsage() const { return geometry_arena.GetMemoryUsage() + object_arena.GetMemoryUsage(); }
 };
 
+template <typename T, typename... Args> T* Scene::Create(Args&&... args) {
+    static_assert(std::is_base_of<Object, T>::value || std::is_base_of<Material, T>::value, "a scene creates only materials and objects");
+    //the arena registers the destructor of every T that has one, so materials are destroyed with the scene like objects
+    T* created = object_arena.Create<T>(std::forward<Args>(args)...);
+    RecordCreated(created, std::is_base_of<Object, T>());
+    return created;
+}
+
 //-------OBJECTS-----------------------------------------
 
 //_______base object class_______________________________
@@ -76,9 +134,14 @@ class Object {
     Material* material;
 public:
     Object(Material* in_material) { material = in_material; };
+    virtual ~Object() {}
+    //the nearest hit in front of the origin and no closer than ray.GetTMin()
     virtual bool Hitted(const Ray& ray, vec3f& hitpoint, vec3f& normal, Side& side) const = 0;
+    virtual AABB GetBounds() const = 0;
     virtual vec3f GetRayColour(const Ray& ray, const vec3f& hit_point, const vec3f& normal, const Side& side, const Scene& scene) const { return material -> GetRayColour(ray, hit_point, normal, side, scene); }
     Material* GetMaterial() const { return material; };
+    //moves large immutable arrays into the arena, which must then outlive the object (Scene::Build, owned objects)
+    virtual void PlaceGeometry(Arena&) {}
 };
 
 //_______class polygon for polygonal objects_________
@@ -90,19 +153,97 @@ class Polygon{
 public:
     Polygon (const vec3f& in_first_vertex, const vec3f& in_second_vertex, const vec3f& in_third_vertex);
     bool Hitted(const Ray& ray, vec3f& hitpoint, vec3f& normal, Side& side) const; //Moller-Trumbor algorithm
+    AABB GetBounds() const;
+    AABB GetClippedBounds(unsigned axis, float slab_min, float slab_max) const; //bounds of the part between two axis planes
     vec3f GetFirstVertex() const { return first_vertex; };
     vec3f GetSecondVertex() const { return second_vertex; };
     vec3f GetThirdVertex() const { return third_vertex; };
     vec3f GetNormal() const { return normal; };
 };
 
+//_______vertex coordinates of polygons in slot order as nine arrays ([vertex][axis]) for the triangle kernels___
+//as floats, or for VERTEX_QUANTIZED as 16-bit codes over the object's bounds together with octahedral normals
+
+struct TriangleLanes {
+    std::vector<float, AlignedAllocator<float, 32>> coordinates;
+    const float* external_coordinates = nullptr;   //the same moved into an arena
+    bool quantized = false;
+    std::vector<uint16_t, AlignedAllocator<uint16_t, 32>> codes;
+    std::vector<uint32_t> normals;
+    const uint16_t* external_codes = nullptr;
+    const uint32_t* external_normals = nullptr;
+    float code_origin[3] = {};
+    float code_scale[3] = {};
+    size_t count = 0;
+    size_t stride = 0;      //padded so that a kernel may read a whole packet from any slot
+    static size_t GetStride(size_t count);
+    void Build(const Polygon* polygons, size_t in_count);
+    //uses coordinates laid out by Build (9 arrays of GetStride(in_count) floats) that are owned by someone else
+    void Attach(const float* in_coordinates, size_t in_count);
+    void BuildQuantized(const Polygon* polygons, size_t in_count, const AABB& bounds);
+    void Place(Arena& arena);
+    const float* GetCoordinates() const { return external_coordinates != nullptr ? external_coordinates : coordinates.data(); }
+    const uint16_t* GetCodes() const { return external_codes != nullptr ? external_codes : codes.data(); }
+    vec3f GetNormal(size_t slot) const { return DecodeOctahedral(external_normals != nullptr ? external_normals[slot] : normals[slot]); }
+    //the polygon of a slot of the quantized lanes
+    Polygon Decode(size_t slot) const;
+};
+
 //________polygonal object class_________________________
 
 class PolygonalObject : public Object{
-    std::vector<Polygon> polygons;
+    //the BVH may be built lazily by the first ray that enters the bounds, hence mutable;
+    //after the build the polygons are kept in BVH leaf order, polygons cut by spatial splits appear once per leaf
+    mutable std::vector<Polygon> polygons;
+    VertexFormat vertex_format = VERTEX_FLOAT;
+    mutable std::vector<Polygon> decoded_polygons; //of quantized lanes, only made for GetPolygons
+    mutable std::once_flag decode_flag;
+    bool placed = false;
+    const Polygon* external_polygons = nullptr;    //polygons owned by someone else (e.g. a mapped scene cache), already in leaf order
+    size_t external_polygon_count = 0;
+    mutable TriangleLanes lanes;                    //copy of the polygons in leaf order, external together with external polygons
+    mutable BVH bvh;
+    mutable std::once_flag build_flag;
+    mutable std::atomic<bool> built;
+    BVHBuildOptions build_options;
+    AABB bounds;
+    AABB code_bounds;                               //grid of the VERTEX_QUANTIZED codes, the bounds before snapping
+    //simplified copies of the mesh from fine to coarse, built together with the BVH
+    struct LODLevel {
+        std::vector<Polygon> polygons;
+        TriangleLanes lanes;
+        BVH bvh;
+        float error;
+    };
+    LODOptions lod_options;
+    mutable std::vector<LODLevel> lod_levels;
+    void BuildBVH() const;
 public:
-    PolygonalObject(Material* in_material, std::vector<Polygon>& in_polygons) : Object(in_material), polygons(in_polygons) {}
+    //with lod_options.level_count > 0 rays whose cone is wide at the object's distance intersect a simplified mesh;
+    //with VERTEX_QUANTIZED the vertices are snapped to their 16-bit codes right away and only the codes are kept once
+    //the BVH is built (the LOD levels stay floats)
+    PolygonalObject(Material* in_material, std::vector<Polygon>& in_polygons, const BVHBuildOptions& options = BVHBuildOptions(),
+                    const LODOptions& in_lod_options = LODOptions(), VertexFormat in_vertex_format = VERTEX_FLOAT);
+    //wraps polygons in BVH leaf order, their lane coordinates (as laid out by TriangleLanes::Build) and their prebuilt
+    //BVH without copying any of them, all must outlive the object
+    PolygonalObject(Material* in_material, const Polygon* in_polygons, size_t in_polygon_count, const float* in_lane_coordinates, const BVHImage& in_bvh);
     bool Hitted(const Ray& ray, vec3f& hitpoint, vec3f& normal, Side& side) const;
+    AABB GetBounds() const { return bounds; }
+    bool IsBuilt() const { return built.load(std::memory_order_acquire); }
+    void EnsureBuilt() const;
+    //the polygons in BVH leaf order and the BVH over them, building it first if it is lazy; quantized ones are
+    //decoded into a copy on the first call
+    const Polygon* GetPolygons() const;
+    size_t GetPolygonCount() const;
+    const BVH& GetBVH() const;
+    size_t GetLODLevelCount() const;
+    VertexFormat GetVertexFormat() const { return vertex_format; }
+    //the polygon count and error of a simplified level, 0 being the first one below the full mesh
+    size_t GetLODPolygonCount(size_t level) const { return lod_levels[level].polygons.size(); }
+    float GetLODError(size_t level) const { return lod_levels[level].error; }
+    //the polygons, their lanes and the BVH nodes of a built mesh; a lazy one not built yet and the LOD levels keep
+    //their own storage
+    void PlaceGeometry(Arena& arena);
 };
 
 //________class for spheres_______________________________
@@ -113,22 +254,67 @@ class Sphere : public Object {
 public:
     Sphere(Material* in_material, vec3f& in_center, float in_radius) : Object(in_material), center(in_center), radius(in_radius) {};
     vec3f GetCenter() const { return center; };
+    void SetCenter(const vec3f& in_center) { center = in_center; };
     float GetRadius() const { return radius; };
     bool Hitted(const Ray& ray, vec3f& hitpoint, vec3f& normal, Side& side) const;
+    AABB GetBounds() const;
 };
 
 //________class for Cilinders_________________________________
 
 class Cilinder : public Object {
     vec3f center;
+    vec3f axis;         //unit vector from the bottom cap to the top one
     float radius;
     float height;
 public:
-    Cilinder(Material* in_material, vec3f& in_center, float in_radius, float in_height);
+    Cilinder(Material* in_material, vec3f& in_center, float in_radius, float in_height, const vec3f& in_axis = vec3f(0.0f, 0.0f, 1.0f));
     vec3f GetCenter() const { return center; };
+    void SetCenter(const vec3f& in_center) { center = in_center; };
+    vec3f GetAxis() const { return axis; };
     float GetRadius() const { return radius; };
     float GetHeight() const { return height; };
     bool Hitted(const Ray& ray, vec3f& hitpoint, vec3f& normal, Side& side) const;
+    AABB GetBounds() const;
+};
+
+//________many cilinders of one material (pillars, pipes), tested four at a time___
+//the cilinders are packed by BVH subtrees into SoA packets of four, a BVH over the packets finds the ones to test
+
+class CilinderGroup : public Object {
+    struct alignas(16) Packet {
+        float center[3][4];
+        float axis[3][4];
+        float radius[4];
+        float half_height[4];
+        uint32_t first;     //index of the first lane's cilinder
+        uint32_t count;
+    };
+    std::vector<Cilinder> cilinders;    //in packet order
+    std::vector<Packet, AlignedAllocator<Packet, 16>> packets;
+    BVH bvh;
+    AABB bounds;
+public:
+    CilinderGroup(Material* in_material, const std::vector<Cilinder>& in_cilinders);
+    bool Hitted(const Ray& ray, vec3f& hitpoint, vec3f& normal, Side& side) const;
+    AABB GetBounds() const { return bounds; }
+    size_t GetCilinderCount() const { return cilinders.size(); }
+};
+
+//________class for transformed instances of shared objects___
+//the prototype (e.g. a PolygonalObject with its BVH) is not added to the scene itself and is shared by all its instances
+
+class Instance : public Object {
+    const Object* prototype;
+    mat3x4f object_to_world;
+    mat3x4f world_to_object;
+public:
+    Instance(const Object* in_prototype, const mat3x4f& in_object_to_world, Material* in_material = nullptr);
+    const Object* GetPrototype() const { return prototype; };
+    mat3x4f GetTransform() const { return object_to_world; };
+    void SetTransform(const mat3x4f& in_object_to_world);
+    bool Hitted(const Ray& ray, vec3f& hitpoint, vec3f& normal, Side& side) const;
+    AABB GetBounds() const;
 };
 
 //--------------------------------------------------------
@@ -0,0 +1,447 @@
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+#include "paged_mesh.h"
+
+namespace {
+
+const char paged_mesh_magic[8] = { 'R', 'T', 'P', 'A', 'G', 'E', 'D', 0 };
+const uint32_t byte_order_tag = 0x01020304;
+const uint64_t blob_alignment = 64;     //clusters are read into cache-line aligned buffers as they are laid out on disk
+const unsigned max_deferred_clusters = 32;
+
+struct PagedMeshHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t polygon_size;
+    uint32_t width;
+    uint32_t quantization_bits;
+    uint32_t node_size;
+    uint32_t cluster_count;
+    uint32_t padding;
+    uint64_t clusters_offset;
+    uint64_t file_size;
+};
+
+struct ClusterRecord {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t polygon_count;
+    uint64_t nodes_offset;
+    uint64_t node_count;
+    float bounds_min[3];
+    float bounds_max[3];
+};
+
+uint64_t AlignOffset(uint64_t offset) {
+    return (offset + blob_alignment - 1) / blob_alignment * blob_alignment;
+}
+
+}
+
+struct PagedMesh::ResidentCluster {
+    std::vector<char, AlignedAllocator<char, blob_alignment>> data;  //the cluster as stored, empty if it could not be read
+    const Polygon* polygons = nullptr;
+    BVH bvh;
+};
+
+//_______cluster cache____________________________________
+
+ClusterCache::ClusterCache(size_t in_capacity, unsigned loader_count) : capacity(in_capacity), clock(0) {
+    ResetStatistics();
+    for (unsigned i = 0; i < std::max(loader_count, 1u); i++)
+        loaders.emplace_back(&ClusterCache::LoaderLoop, this);
+}
+
+ClusterCache::~ClusterCache() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    requested.notify_all();
+    for (size_t i = 0; i < loaders.size(); i++)
+        loaders[i].join();
+}
+
+ClusterCache::CounterShard& ClusterCache::GetShard() {
+    static std::atomic<unsigned> next_shard(0);
+    static thread_local unsigned shard = next_shard++ % shard_count;
+    return shards[shard];
+}
+
+void ClusterCache::Enqueue(const PagedMesh* mesh, uint32_t cluster) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(Request{ mesh, cluster });
+    }
+    requested.notify_one();
+}
+
+void ClusterCache::LoaderLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        requested.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (stopping)
+            return;
+        Request request = queue.front();
+        queue.pop_front();
+        loading.push_back(request.mesh);
+
+        //the file is read without holding the lock, rays keep tracing the resident clusters meanwhile
+        lock.unlock();
+        std::shared_ptr<const PagedMesh::ResidentCluster> cluster = request.mesh -> LoadCluster(request.cluster);
+        lock.lock();
+        loading.erase(std::find(loading.begin(), loading.end(), request.mesh));
+
+        size_t size = cluster -> data.size();
+        PagedMesh::Slot& slot = request.mesh -> slots[request.cluster];
+        slot.last_use.store(clock.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_store(&slot.resident, cluster);
+        resident.push_back(Entry{ request.mesh, request.cluster, size });
+        resident_bytes += size;
+        peak_resident_bytes = std::max(peak_resident_bytes, resident_bytes);
+        loads++;
+        bytes_loaded += size;
+
+        //evict the least recently used clusters, never the one just loaded so that its ray can make progress
+        while (resident_bytes > capacity && resident.size() > 1) {
+            size_t victim = resident.size();
+            uint64_t oldest = std::numeric_limits<uint64_t>::max();
+            for (size_t i = 0; i < resident.size(); i++) {
+                const Entry& entry = resident[i];
+                if (entry.mesh == request.mesh && entry.cluster == request.cluster)
+                    continue;
+                uint64_t last_use = entry.mesh -> slots[entry.cluster].last_use.load(std::memory_order_relaxed);
+                if (last_use < oldest) {
+                    oldest = last_use;
+                    victim = i;
+                }
+            }
+            PagedMesh::Slot& victim_slot = resident[victim].mesh -> slots[resident[victim].cluster];
+            std::atomic_store(&victim_slot.resident, std::shared_ptr<const PagedMesh::ResidentCluster>());
+            victim_slot.requested.store(false);
+            resident_bytes -= resident[victim].size;
+            resident[victim] = resident.back();
+            resident.pop_back();
+            evictions++;
+        }
+        loaded.notify_all();
+    }
+}
+
+void ClusterCache::Forget(const PagedMesh* mesh) {
+    std::unique_lock<std::mutex> lock(mutex);
+    queue.erase(std::remove_if(queue.begin(), queue.end(), [mesh](const Request& request) { return request.mesh == mesh; }), queue.end());
+    loaded.wait(lock, [this, mesh] { return std::find(loading.begin(), loading.end(), mesh) == loading.end(); });
+    for (size_t i = resident.size(); i-- > 0;) {
+        if (resident[i].mesh != mesh)
+            continue;
+        resident_bytes -= resident[i].size;
+        resident[i] = resident.back();
+        resident.pop_back();
+    }
+}
+
+ClusterCacheStatistics ClusterCache::GetStatistics() const {
+    ClusterCacheStatistics statistics;
+    for (unsigned i = 0; i < shard_count; i++) {
+        statistics.hits += shards[i].hits.load(std::memory_order_relaxed);
+        statistics.misses += shards[i].misses.load(std::memory_order_relaxed);
+        statistics.culled += shards[i].culled.load(std::memory_order_relaxed);
+        statistics.waits += shards[i].waits.load(std::memory_order_relaxed);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    statistics.loads = loads;
+    statistics.evictions = evictions;
+    statistics.bytes_loaded = bytes_loaded;
+    statistics.resident_bytes = resident_bytes;
+    statistics.peak_resident_bytes = peak_resident_bytes;
+    statistics.capacity = capacity;
+    return statistics;
+}
+
+void ClusterCache::ResetStatistics() {
+    for (unsigned i = 0; i < shard_count; i++) {
+        shards[i].hits.store(0);
+        shards[i].misses.store(0);
+        shards[i].culled.store(0);
+        shards[i].waits.store(0);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    loads = 0;
+    evictions = 0;
+    bytes_loaded = 0;
+    peak_resident_bytes = resident_bytes;
+}
+
+void ClusterCache::PrintStatistics(std::ostream& stream) const {
+    ClusterCacheStatistics statistics = GetStatistics();
+    uint64_t accesses = statistics.hits + statistics.misses;
+    const double megabyte = 1024.0 * 1024.0;
+    stream << "Cluster cache: " << statistics.hits << " hits, " << statistics.misses << " misses ("
+           << (accesses > 0 ? 100.0 * statistics.hits / accesses : 100.0) << "% hit rate), "
+           << statistics.culled << " misses skipped after a closer hit, " << statistics.waits << " waits" << std::endl;
+    stream << "Cluster cache: " << statistics.loads << " loads (" << statistics.bytes_loaded / megabyte << " MB), "
+           << statistics.evictions << " evictions, " << statistics.resident_bytes / megabyte << " MB resident (peak "
+           << statistics.peak_resident_bytes / megabyte << " MB) of " << statistics.capacity / megabyte << " MB" << std::endl;
+}
+
+//_______paged mesh_______________________________________
+
+PagedMesh::~PagedMesh() {
+    cache.Forget(this);
+}
+
+bool PagedMesh::Write(const std::string& path, const std::vector<Polygon>& polygons, const PagedMeshOptions& options) {
+    //a binary BVH over the whole mesh decides the clusters, each one a subtree and thus compact in space
+    std::vector<AABB> polygon_bounds(polygons.size());
+    for (size_t i = 0; i < polygons.size(); i++)
+        polygon_bounds[i] = polygons[i].GetBounds();
+    BVHBuildOptions split_options;
+    split_options.width = 2;
+    BVH bvh;
+    bvh.Build(polygon_bounds, split_options);
+    std::vector<std::pair<uint32_t, uint32_t>> ranges = bvh.GetSubtreeSlotRanges(std::max(options.cluster_size, 1u));
+    std::vector<AABB>().swap(polygon_bounds);
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        std::cerr << "Paged mesh: cannot write " << path << std::endl;
+        return false;
+    }
+    PagedMeshHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, paged_mesh_magic, sizeof(paged_mesh_magic));
+    header.version = version;
+    header.byte_order = byte_order_tag;
+    header.polygon_size = sizeof(Polygon);
+    header.cluster_count = uint32_t(ranges.size());
+    header.clusters_offset = AlignOffset(sizeof(PagedMeshHeader));
+    header.width = options.cluster_bvh.width;
+    header.quantization_bits = options.cluster_bvh.quantization_bits;
+    std::vector<ClusterRecord> records(ranges.size());
+    const char zeros[blob_alignment] = {};
+    auto write_at = [&file, &zeros](uint64_t position, const void* bytes, uint64_t byte_count) {
+        uint64_t current = uint64_t(file.tellp());
+        file.write(zeros, std::streamsize(position - current));
+        file.write(static_cast<const char*>(bytes), std::streamsize(byte_count));
+    };
+    write_at(0, &header, sizeof(header));
+
+    //clusters are built and written one at a time after the space left for the table
+    BVHBuildOptions cluster_options = options.cluster_bvh;
+    cluster_options.lazy = false;
+    const std::vector<uint32_t>& slots = bvh.GetPrimitiveIndices();
+    uint64_t offset = AlignOffset(header.clusters_offset + records.size() * sizeof(ClusterRecord));
+    for (size_t i = 0; i < ranges.size(); i++) {
+        std::vector<Polygon> cluster_polygons;
+        cluster_polygons.reserve(ranges[i].second - ranges[i].first);
+        for (uint32_t slot = ranges[i].first; slot < ranges[i].second; slot++)
+            cluster_polygons.push_back(polygons[slots[slot]]);
+        PolygonalObject cluster(nullptr, cluster_polygons, cluster_options);
+        BVHImage image = cluster.GetBVH().GetImage();
+        header.width = image.width;
+        header.quantization_bits = image.quantization_bits;
+        header.node_size = uint32_t(image.node_size);
+
+        ClusterRecord& record = records[i];
+        record.offset = offset;
+        record.polygon_count = cluster.GetPolygonCount();
+        record.nodes_offset = AlignOffset(record.polygon_count * sizeof(Polygon));
+        record.node_count = image.node_count;
+        record.size = record.nodes_offset + record.node_count * image.node_size;
+        for (unsigned axis = 0; axis < 3; axis++) {
+            record.bounds_min[axis] = image.bounds.min[axis];
+            record.bounds_max[axis] = image.bounds.max[axis];
+        }
+        write_at(record.offset, cluster.GetPolygons(), record.polygon_count * sizeof(Polygon));
+        write_at(record.offset + record.nodes_offset, image.nodes, record.node_count * image.node_size);
+        offset = AlignOffset(record.offset + record.size);
+    }
+    write_at(offset, nullptr, 0);
+    header.file_size = offset;
+    if (header.node_size == 0)
+        header.node_size = uint32_t(BVH::GetNodeSize(header.width, header.quantization_bits));
+
+    file.seekp(0);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.seekp(std::streamoff(header.clusters_offset));
+    file.write(reinterpret_cast<const char*>(records.data()), std::streamsize(records.size() * sizeof(ClusterRecord)));
+    return bool(file);
+}
+
+bool PagedMesh::Open(const std::string& in_path) {
+    cache.Forget(this);
+    clusters.clear();
+    slots.reset();
+    cluster_bvh = BVH();
+    bounds = AABB();
+    path = in_path;
+
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        std::cerr << "Paged mesh: cannot open " << path << std::endl;
+        return false;
+    }
+    uint64_t file_size = uint64_t(file.tellg());
+    file.seekg(0);
+    PagedMeshHeader header;
+    bool valid = file.read(reinterpret_cast<char*>(&header), sizeof(header)) &&
+                 memcmp(header.magic, paged_mesh_magic, sizeof(paged_mesh_magic)) == 0 && header.version == version &&
+                 header.byte_order == byte_order_tag && header.polygon_size == sizeof(Polygon) && header.file_size == file_size &&
+                 header.node_size == BVH::GetNodeSize(header.width, header.quantization_bits) &&
+                 header.clusters_offset + uint64_t(header.cluster_count) * sizeof(ClusterRecord) <= file_size;
+    if (!valid) {
+        std::cerr << "Paged mesh: " << path << " is not a compatible paged mesh (version " << version << ")" << std::endl;
+        return false;
+    }
+    std::vector<ClusterRecord> records(header.cluster_count);
+    file.seekg(std::streamoff(header.clusters_offset));
+    file.read(reinterpret_cast<char*>(records.data()), std::streamsize(records.size() * sizeof(ClusterRecord)));
+    for (size_t i = 0; i < records.size() && valid; i++) {
+        const ClusterRecord& record = records[i];
+        valid = file && record.offset % blob_alignment == 0 && record.offset + record.size <= file_size &&
+                record.polygon_count * sizeof(Polygon) <= record.nodes_offset &&
+                record.nodes_offset + record.node_count * header.node_size <= record.size;
+        Cluster cluster;
+        cluster.offset = record.offset;
+        cluster.size = record.size;
+        cluster.polygon_count = record.polygon_count;
+        cluster.nodes_offset = record.nodes_offset;
+        cluster.node_count = record.node_count;
+        cluster.bounds = AABB(vec3f(record.bounds_min[0], record.bounds_min[1], record.bounds_min[2]),
+                              vec3f(record.bounds_max[0], record.bounds_max[1], record.bounds_max[2]));
+        clusters.push_back(cluster);
+    }
+    if (!valid) {
+        std::cerr << "Paged mesh: " << path << " is damaged" << std::endl;
+        clusters.clear();
+        return false;
+    }
+    width = header.width;
+    quantization_bits = header.quantization_bits;
+
+    slots.reset(new Slot[clusters.size()]);
+    std::vector<AABB> cluster_bounds(clusters.size());
+    for (size_t i = 0; i < clusters.size(); i++) {
+        slots[i].last_use.store(0);
+        slots[i].requested.store(false);
+        cluster_bounds[i] = clusters[i].bounds;
+        bounds.Extend(clusters[i].bounds);
+    }
+    cluster_bvh.Build(cluster_bounds);
+    return true;
+}
+
+std::shared_ptr<const PagedMesh::ResidentCluster> PagedMesh::LoadCluster(uint32_t index) const {
+    const Cluster& cluster = clusters[index];
+    std::shared_ptr<ResidentCluster> resident = std::make_shared<ResidentCluster>();
+    resident -> data.resize(cluster.size);
+    std::ifstream file(path, std::ios::binary);
+    file.seekg(std::streamoff(cluster.offset));
+    if (!file.read(resident -> data.data(), std::streamsize(cluster.size))) {
+        //an unreadable cluster is traced as empty rather than stalling the rays waiting for it
+        std::cerr << "Paged mesh: cannot read cluster " << index << " of " << path << std::endl;
+        resident -> data.clear();
+        return resident;
+    }
+    resident -> polygons = reinterpret_cast<const Polygon*>(resident -> data.data());
+    BVHImage image;
+    image.width = width;
+    image.quantization_bits = quantization_bits;
+    image.bounds = cluster.bounds;
+    image.nodes = resident -> data.data() + cluster.nodes_offset;
+    image.node_count = cluster.node_count;
+    image.node_size = BVH::GetNodeSize(width, quantization_bits);
+    resident -> bvh.Attach(image);
+    return resident;
+}
+
+std::shared_ptr<const PagedMesh::ResidentCluster> PagedMesh::Acquire(uint32_t cluster, bool wait) const {
+    Slot& slot = slots[cluster];
+    std::shared_ptr<const ResidentCluster> resident = std::atomic_load(&slot.resident);
+    while (!resident) {
+        if (!slot.requested.exchange(true))
+            cache.Enqueue(this, cluster);
+        if (!wait)
+            return resident;
+        //woken by every finished load; a cluster evicted before the wake-up is requested again
+        std::unique_lock<std::mutex> lock(cache.mutex);
+        cache.loaded.wait(lock, [&slot] { return std::atomic_load(&slot.resident) || !slot.requested.load(); });
+        resident = std::atomic_load(&slot.resident);
+    }
+    //the tick only changes on loads, so hot clusters are not written to by every ray
+    uint64_t tick = cache.clock.load(std::memory_order_relaxed);
+    if (slot.last_use.load(std::memory_order_relaxed) != tick)
+        slot.last_use.store(tick, std::memory_order_relaxed);
+    return resident;
+}
+
+bool PagedMesh::HitCluster(const ResidentCluster& resident, const Ray& ray, float& tmax, vec3f& hitpoint, vec3f& normal, Side& side) const {
+    vec3f polygon_hitpoint;
+    vec3f polygon_normal;
+    Side polygon_side;
+    return resident.bvh.Traverse(ray, tmax, [&](uint32_t i, float& polygon_tmax) {
+        if (resident.polygons[i].Hitted(ray, polygon_hitpoint, polygon_normal, polygon_side)) {
+            float distance = (polygon_hitpoint - ray.GetStartingPoint()).norm();
+            if (distance < polygon_tmax) {
+                polygon_tmax = distance;
+                hitpoint = polygon_hitpoint;
+                normal = polygon_normal;
+                side = polygon_side;
+                return true;
+            }
+        }
+        return false;
+    });
+}
+
+bool PagedMesh::Hitted(const Ray& ray, vec3f& hitpoint, vec3f& normal, Side& side) const {
+    struct DeferredCluster {
+        uint32_t cluster;
+        float tentry;
+    };
+    DeferredCluster deferred[max_deferred_clusters];
+    unsigned deferred_count = 0;
+    ClusterCache::CounterShard& shard = cache.GetShard();
+    vec3f inv_direction = ray.GetInverseDirection();
+    const std::vector<uint32_t>& cluster_slots = cluster_bvh.GetPrimitiveIndices();
+    float min_distance = std::numeric_limits<float>::max();
+    bool hit = cluster_bvh.Traverse(ray, min_distance, [&](uint32_t slot, float& tmax) {
+        uint32_t cluster = cluster_slots[slot];
+        float tentry;
+        if (!IntersectBox(clusters[cluster].bounds.min, clusters[cluster].bounds.max, ray.GetStartingPoint(), inv_direction, tmax, tentry))
+            return false;
+        std::shared_ptr<const ResidentCluster> resident = Acquire(cluster, false);
+        if (resident) {
+            shard.hits.fetch_add(1, std::memory_order_relaxed);
+            return HitCluster(*resident, ray, tmax, hitpoint, normal, side);
+        }
+        shard.misses.fetch_add(1, std::memory_order_relaxed);
+        if (deferred_count < max_deferred_clusters) {
+            deferred[deferred_count++] = DeferredCluster{ cluster, tentry };
+            return false;
+        }
+        shard.waits.fetch_add(1, std::memory_order_relaxed);
+        return HitCluster(*Acquire(cluster, true), ray, tmax, hitpoint, normal, side);
+    });
+
+    //the missing clusters nearest first, those behind the closest hit are not waited for
+    std::sort(deferred, deferred + deferred_count, [](const DeferredCluster& a, const DeferredCluster& b) { return a.tentry < b.tentry; });
+    for (unsigned i = 0; i < deferred_count; i++) {
+        if (deferred[i].tentry > min_distance) {
+            shard.culled.fetch_add(deferred_count - i, std::memory_order_relaxed);
+            break;
+        }
+        std::shared_ptr<const ResidentCluster> resident = std::atomic_load(&slots[deferred[i].cluster].resident);
+        if (!resident) {
+            shard.waits.fetch_add(1, std::memory_order_relaxed);
+            resident = Acquire(deferred[i].cluster, true);
+        }
+        hit |= HitCluster(*resident, ray, min_distance, hitpoint, normal, side);
+    }
+    return hit;
+}
@@ -0,0 +1,139 @@
+#ifndef PAGED_MESH_H
+#define PAGED_MESH_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <ostream>
+#include "objects.h"
+
+//_______out-of-core meshes: polygons paged in from disk by BVH-aligned clusters_______
+//PagedMesh::Write cuts a mesh into clusters, each the polygons of one BVH subtree stored together with its own
+//prebuilt BVH; a PagedMesh keeps only the cluster bounds in memory and pages clusters in through a ClusterCache
+//of bounded size shared by all paged meshes
+
+struct PagedMeshOptions {
+    unsigned cluster_size = 16384;  //polygons per cluster at most (a single bigger leaf stays whole)
+    BVHBuildOptions cluster_bvh;    //layout of the BVH stored with every cluster
+};
+
+struct ClusterCacheStatistics {
+    uint64_t hits = 0;          //a ray entered a cluster that was resident
+    uint64_t misses = 0;        //a ray entered a cluster that was not resident and requested it
+    uint64_t culled = 0;        //missed clusters that the ray did not have to wait for as it hit something closer
+    uint64_t waits = 0;         //missed clusters that the ray had to wait for
+    uint64_t loads = 0;
+    uint64_t evictions = 0;
+    uint64_t bytes_loaded = 0;
+    size_t resident_bytes = 0;
+    size_t peak_resident_bytes = 0;
+    size_t capacity = 0;
+};
+
+class PagedMesh;
+
+//_______least recently used cache of clusters, loaded by background threads_______
+//rays never block on the cache lock: resident clusters are found through the mesh's slots and kept alive by
+//shared_ptr while they are traced, so evicting one that is still in use only drops the cache's reference
+
+class ClusterCache {
+    friend class PagedMesh;
+    struct Request {
+        const PagedMesh* mesh;
+        uint32_t cluster;
+    };
+    struct Entry {
+        const PagedMesh* mesh;
+        uint32_t cluster;
+        size_t size;
+    };
+    //statistics are spread over cache lines so that tracing threads do not contend on them
+    struct alignas(64) CounterShard {
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> misses;
+        std::atomic<uint64_t> culled;
+        std::atomic<uint64_t> waits;
+    };
+    static constexpr unsigned shard_count = 16;
+    CounterShard shards[shard_count];
+    size_t capacity;
+    size_t resident_bytes = 0;
+    size_t peak_resident_bytes = 0;
+    uint64_t loads = 0;
+    uint64_t evictions = 0;
+    uint64_t bytes_loaded = 0;
+    std::atomic<uint64_t> clock;        //advanced on every load, clusters remember the tick of their last use
+    std::vector<Entry> resident;        //scanned for the least recently used cluster on eviction
+    std::deque<Request> queue;
+    std::vector<const PagedMesh*> loading;  //meshes the loader threads are reading from right now
+    bool stopping = false;
+    mutable std::mutex mutex;
+    std::condition_variable requested;
+    std::condition_variable loaded;
+    std::vector<std::thread> loaders;
+    CounterShard& GetShard();
+    void Enqueue(const PagedMesh* mesh, uint32_t cluster);
+    void Forget(const PagedMesh* mesh);
+    void LoaderLoop();
+public:
+    explicit ClusterCache(size_t in_capacity, unsigned loader_count = 2);
+    ClusterCache(const ClusterCache&) = delete;
+    ClusterCache& operator=(const ClusterCache&) = delete;
+    ~ClusterCache();
+    ClusterCacheStatistics GetStatistics() const;
+    void ResetStatistics();
+    void PrintStatistics(std::ostream& stream) const;
+};
+
+//_______mesh whose polygons stay on disk until a ray needs them___________________
+//a ray that enters a cluster which is not resident requests it and goes on with the resident ones; it waits for
+//the missing clusters only at the end and only for those still closer than its nearest hit
+
+class PagedMesh : public Object {
+    friend class ClusterCache;
+    struct Cluster {
+        uint64_t offset;        //of the cluster in the file: polygons in leaf order, then the BVH nodes
+        uint64_t size;
+        uint64_t polygon_count;
+        uint64_t nodes_offset;  //relative to the cluster
+        uint64_t node_count;
+        AABB bounds;
+    };
+    struct ResidentCluster;
+    struct Slot {
+        std::shared_ptr<const ResidentCluster> resident;   //accessed with std::atomic_load / std::atomic_store
+        std::atomic<uint64_t> last_use;
+        std::atomic<bool> requested;
+    };
+    ClusterCache& cache;
+    std::string path;
+    std::vector<Cluster> clusters;
+    std::unique_ptr<Slot[]> slots;
+    unsigned width = 2;
+    unsigned quantization_bits = 0;
+    BVH cluster_bvh;
+    AABB bounds;
+    std::shared_ptr<const ResidentCluster> Acquire(uint32_t cluster, bool wait) const;
+    std::shared_ptr<const ResidentCluster> LoadCluster(uint32_t cluster) const;
+    bool HitCluster(const ResidentCluster& resident, const Ray& ray, float& tmax, vec3f& hitpoint, vec3f& normal, Side& side) const;
+public:
+    static const uint32_t version = 1;
+    PagedMesh(Material* in_material, ClusterCache& in_cache) : Object(in_material), cache(in_cache) {}
+    PagedMesh(const PagedMesh&) = delete;
+    PagedMesh& operator=(const PagedMesh&) = delete;
+    ~PagedMesh();
+    //builds the clusters and their BVHs in memory and writes them to path; run once per asset, e.g. on a bigger machine
+    static bool Write(const std::string& path, const std::vector<Polygon>& polygons, const PagedMeshOptions& options = PagedMeshOptions());
+    //reads only the cluster table, the polygons are paged in by the rays
+    bool Open(const std::string& path);
+    bool Hitted(const Ray& ray, vec3f& hitpoint, vec3f& normal, Side& side) const;
+    AABB GetBounds() const { return bounds; }
+    size_t GetClusterCount() const { return clusters.size(); }
+};
+
+#endif
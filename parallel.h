@@ -0,0 +1,40 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <thread>
+#include <vector>
+#include <cstddef>
+
+inline unsigned GetThreadCount() {
+    unsigned thread_count = std::thread::hardware_concurrency();
+    return thread_count == 0 ? 1 : thread_count;
+}
+
+//splits [begin, end) into chunk_count contiguous chunks and runs body(chunk, chunk_begin, chunk_end) for each
+//on its own thread; the calling thread takes the first chunk
+template <typename Body> void ParallelForChunks(size_t begin, size_t end, unsigned chunk_count, Body body) {
+    if (chunk_count <= 1 || end - begin < 2) {
+        body(0u, begin, end);
+        return;
+    }
+    size_t size = end - begin;
+    std::vector<std::thread> threads;
+    for (unsigned chunk = 1; chunk < chunk_count; chunk++)
+        threads.emplace_back(body, chunk, begin + size * chunk / chunk_count, begin + size * (chunk + 1) / chunk_count);
+    body(0u, begin, begin + size / chunk_count);
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+}
+
+//runs body(i) for every i in [begin, end), with at least min_chunk_size iterations per thread
+template <typename Body> void ParallelFor(size_t begin, size_t end, Body body, size_t min_chunk_size = 1024) {
+    size_t chunk_count = (end - begin) / min_chunk_size;
+    if (chunk_count > GetThreadCount())
+        chunk_count = GetThreadCount();
+    ParallelForChunks(begin, end, chunk_count, [&body](unsigned, size_t chunk_begin, size_t chunk_end) {
+        for (size_t i = chunk_begin; i < chunk_end; i++)
+            body(i);
+    });
+}
+
+#endif
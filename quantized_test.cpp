@@ -0,0 +1,125 @@
+#include <cstdio>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "objects.h"
+#include "dispatch.h"
+
+//checks that a VERTEX_QUANTIZED mesh is hit exactly where the float mesh of its decoded polygons is, for every
+//instruction set of the machine and every kind of BVH
+//usage: quantized_test, returns non-zero on a mismatch
+
+namespace {
+
+int failures = 0;
+
+void Check(const char* name, const char* kernels, unsigned mismatches, unsigned hits) {
+    bool passed = mismatches == 0 && hits > 0;
+    printf("%-24s %-10s %8u hits %8u mismatches %s\n", name, kernels, hits, mismatches, passed ? "ok" : "FAILED");
+    if (!passed)
+        failures++;
+}
+
+std::mt19937 generator(7);
+
+float Uniform(float low, float high) {
+    return std::uniform_real_distribution<float>(low, high)(generator);
+}
+
+//small triangles spread over a large box, so that a step of the codes is a good part of a triangle
+std::vector<Polygon> MakeSoup() {
+    std::vector<Polygon> polygons;
+    for (int i = 0; i < 20000; i++) {
+        vec3f center(Uniform(-100.0f, 100.0f), Uniform(-100.0f, 100.0f), Uniform(-100.0f, 100.0f));
+        polygons.push_back(Polygon(center + vec3f(Uniform(-0.05f, 0.05f), Uniform(-0.05f, 0.05f), Uniform(-0.05f, 0.05f)),
+                                   center + vec3f(Uniform(-0.05f, 0.05f), Uniform(-0.05f, 0.05f), Uniform(-0.05f, 0.05f)),
+                                   center + vec3f(Uniform(-0.05f, 0.05f), Uniform(-0.05f, 0.05f), Uniform(-0.05f, 0.05f))));
+    }
+    return polygons;
+}
+
+//a closed sphere of shared vertices, rays through its edges must not leak
+std::vector<Polygon> MakeSphere() {
+    const int rings = 120, segments = 240;
+    const float pi = 3.14159265f;
+    auto point = [&](int ring, int segment) {
+        float theta = pi * ring / rings, phi = 2.0f * pi * segment / segments;
+        return vec3f(std::sin(theta) * std::cos(phi), std::sin(theta) * std::sin(phi), std::cos(theta)) * 10.0f;
+    };
+    std::vector<Polygon> polygons;
+    for (int ring = 0; ring < rings; ring++) {
+        for (int segment = 0; segment < segments; segment++) {
+            vec3f a = point(ring, segment), b = point(ring + 1, segment), c = point(ring + 1, segment + 1), d = point(ring, segment + 1);
+            if (ring > 0)
+                polygons.push_back(Polygon(a, b, d));
+            if (ring < rings - 1)
+                polygons.push_back(Polygon(b, c, d));
+        }
+    }
+    return polygons;
+}
+
+//rays from around the bounds aimed at points of the decoded triangles, a third of them at vertices and edges
+std::vector<Ray> MakeRays(const Polygon* polygons, size_t polygon_count, const AABB& bounds) {
+    vec3f center = (bounds.min + bounds.max) * 0.5f;
+    float radius = (bounds.max - bounds.min).norm();
+    std::vector<Ray> rays;
+    for (int i = 0; i < 30000; i++) {
+        const Polygon& target = polygons[generator() % polygon_count];
+        float u = Uniform(0.0f, 1.0f), v = Uniform(0.0f, 1.0f);
+        if (u + v > 1.0f) {
+            u = 1.0f - u;
+            v = 1.0f - v;
+        }
+        if (i % 3 == 0)
+            u = float(generator() % 2);
+        vec3f aim = target.GetFirstVertex() + (target.GetSecondVertex() - target.GetFirstVertex()) * u + (target.GetThirdVertex() - target.GetFirstVertex()) * v;
+        vec3f origin = center + vec3f(Uniform(-1.0f, 1.0f), Uniform(-1.0f, 1.0f), Uniform(-1.0f, 1.0f)).normalize() * radius;
+        rays.push_back(Ray(aim - origin, origin, 1.0f, 0));
+    }
+    return rays;
+}
+
+void CheckMesh(const char* name, std::vector<Polygon> polygons, const BVHBuildOptions& options) {
+    PolygonalObject quantized(nullptr, polygons, options, LODOptions(), VERTEX_QUANTIZED);
+    std::vector<Polygon> decoded(quantized.GetPolygons(), quantized.GetPolygons() + quantized.GetPolygonCount());
+    PolygonalObject reference(nullptr, decoded, options);
+    std::vector<Ray> rays = MakeRays(decoded.data(), decoded.size(), quantized.GetBounds());
+    InstructionSet detected = DetectInstructionSet();
+    for (int instruction_set = ISA_BASELINE; instruction_set <= detected; instruction_set++) {
+        SetInstructionSet(InstructionSet(instruction_set));
+        unsigned mismatches = 0, hits = 0;
+        for (size_t i = 0; i < rays.size(); i++) {
+            vec3f quantized_hitpoint, quantized_normal, reference_hitpoint, reference_normal;
+            Side quantized_side, reference_side;
+            bool quantized_hit = quantized.Hitted(rays[i], quantized_hitpoint, quantized_normal, quantized_side);
+            bool reference_hit = reference.Hitted(rays[i], reference_hitpoint, reference_normal, reference_side);
+            if (quantized_hit != reference_hit ||
+                (quantized_hit && ((quantized_hitpoint - reference_hitpoint).norm() > 1e-4f || quantized_side != reference_side)))
+                mismatches++;
+            hits += reference_hit;
+        }
+        Check(name, GetKernels().name, mismatches, hits);
+    }
+    SetInstructionSet(detected);
+}
+
+}
+
+int main() {
+    BVHBuildOptions wide4, wide8, binary, spatial, compressed;
+    wide8.width = 8;
+    binary.width = 2;
+    spatial.spatial_splits = true;
+    compressed.quantization_bits = 8;
+    std::vector<Polygon> soup = MakeSoup(), sphere = MakeSphere();
+    CheckMesh("soup width 4", soup, wide4);
+    CheckMesh("soup width 8", soup, wide8);
+    CheckMesh("soup binary", soup, binary);
+    CheckMesh("soup SBVH", soup, spatial);
+    CheckMesh("soup 8-bit nodes", soup, compressed);
+    CheckMesh("sphere width 4", sphere, wide4);
+    CheckMesh("sphere SBVH", sphere, spatial);
+    return failures == 0 ? 0 : 1;
+}
@@ -1,64 +1,120 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
 #include "ray.h"
 #include "geometry.h"
+#include "fastmath.h"
+#include "dispatch.h"
+
+namespace {
+
+//xorshift32 per thread, seeded once from std::rand so that srand still makes the renders repeatable; a tenth of the
+//cost of std::rand, which takes a lock
+inline float NextUniform() {
+    static thread_local uint32_t state = 0;
+    if (state == 0)
+        state = uint32_t(std::rand()) * 2654435761u | 1u;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return float(state >> 8) * (1.0f / 16777216.0f);
+}
+
+}
 
 unsigned Ray::max_recursion_depth = 5;
+float Ray::diffuse_cone_spread = 0.5f;     //a diffuse bounce is sampled by a few rays, each standing for a wide lobe
+
+Ray::Ray(const vec3f& in_direction, const vec3f& in_starting_point, float refractive_index, unsigned recursion_depth)
+    : Ray(in_direction * FastRsqrt(in_direction * in_direction), in_starting_point, refractive_index, recursion_depth, UnitDirection()) {
+}
 
-Ray::Ray(const vec3f& in_direction, const vec3f& in_starting_point, float refractive_index, unsigned recursion_depth) {
+Ray::Ray(const vec3f& in_direction, const vec3f& in_starting_point, float refractive_index, unsigned recursion_depth, UnitDirection) {
     direction = in_direction;
-    direction = direction.normalize();
     starting_point = in_starting_point;
     cur_refractive_index = refractive_index;
-    current_recursion_depth = recursion_depth;
+    current_recursion_depth = uint16_t(recursion_depth);
+    Precompute();
+}
+
+void Ray::Precompute() {
+    inv_direction = SafeInverse(direction);
+    sign_bits = uint8_t((inv_direction.x < 0) | (inv_direction.y < 0) << 1 | (inv_direction.z < 0) << 2);
 }
 
 Ray Ray::Reflect(const vec3f& hitpoint, const vec3f& normal) const{
     float eps = 1e-3;
-    vec3f new_direction(hitpoint + direction - ((normal * (normal * direction)) * 2) - hitpoint);
-    Ray reflected_ray(new_direction, hitpoint + (new_direction * eps), cur_refractive_index, current_recursion_depth + 1);
+    vec3f new_direction = direction - (normal * (2 * (normal * direction)));   //unit, as both are
+    Ray reflected_ray(new_direction, hitpoint + (new_direction * eps), cur_refractive_index, current_recursion_depth + 1, UnitDirection());
+    reflected_ray.SetCone(GetFootprint((hitpoint - starting_point).norm()), cone_spread);
     return reflected_ray;
 }
 
+//snell's law in vector form: the tangential part of the direction is scaled by the ratio of the indices and the
+//normal part is what is left of the unit length; past the critical angle the ray is reflected (total internal reflection)
 Ray Ray::Refract(const vec3f& hitpoint, const vec3f& normal, float new_refractive_index) const { 
-    float min_norm = 1e-5;
     float eps = 1e-3;
-    float alpha = acos((-direction) * normal);
-    float beta = asin(cur_refractive_index / new_refractive_index * sin(alpha));
-    vec3f tang = direction + normal * ((-direction) * normal);
-    if (tang.norm() > min_norm){
-        tang = tang.normalize();
-        vec3f new_direction = (hitpoint - (normal * cos(beta)) + (tang * sin(beta))) - hitpoint;
-        Ray refracted_ray(new_direction, hitpoint + (new_direction * eps), new_refractive_index, current_recursion_depth + 1);
-        return refracted_ray;
-    }
-    Ray refracted_ray(direction, hitpoint + (direction * eps), new_refractive_index, current_recursion_depth + 1);
+    float eta = cur_refractive_index / new_refractive_index;
+    float cos_incident = -(direction * normal);
+    float sin2_refracted = eta * eta * (1.0f - cos_incident * cos_incident);
+    if (sin2_refracted > 1.0f)
+        return Reflect(hitpoint, normal);
+    float cos_refracted = std::sqrt(1.0f - sin2_refracted);
+    vec3f new_direction = (direction * eta) + (normal * (eta * cos_incident - cos_refracted));
+    Ray refracted_ray(new_direction, hitpoint + (new_direction * eps), new_refractive_index, current_recursion_depth + 1, UnitDirection());
+    refracted_ray.SetCone(GetFootprint((hitpoint - starting_point).norm()), cone_spread);
     return refracted_ray;
 }
 
 Ray Ray::Diffuse(const vec3f& hitpoint, const vec3f& normal) const {
-    float eps1 = 1e-4;
-    float eps2 = 1e-3;
-    vec3f not_normal = normal;
-    if (fabs(not_normal.x) < eps1) {
-        not_normal.x += 1;
-    } else if(fabs(not_normal.y) < eps1) {
-        not_normal.y += 1;
-    } else if(fabs(not_normal.z) < eps1) {
-        not_normal.z += 1;
-    } else {
-        not_normal.x += 1;
-    }
-    vec3f e1 = (not_normal - (normal * (not_normal * normal))).normalize();
-    vec3f e2 = cross(normal, e1).normalize();
-
-    float phi = float(std::rand());
-    phi = phi / RAND_MAX * 2 * PI;
-
-    float teta = float(std::rand());
-    teta = teta / RAND_MAX * PI / 2;
+    float eps = 1e-3;
+    vec3f new_direction;
+    SampleCosineHemisphere(normal, 1, &new_direction);
+    Ray diffused_ray(new_direction, hitpoint + (new_direction * eps), cur_refractive_index, current_recursion_depth + 1, UnitDirection());
+    diffused_ray.SetCone(GetFootprint((hitpoint - starting_point).norm()), std::max(cone_spread, diffuse_cone_spread));
+    return diffused_ray;
+}
 
-    vec3f new_direction = ((e1 * sin(teta)) * cos(phi)) + ((e2 * sin(teta)) * sin(phi)) + (normal * cos(teta));
+void Ray::DiffuseFan(const vec3f& hitpoint, const vec3f& normal, unsigned count, RayVector& rays) const {
+    float eps = 1e-3;
+    const unsigned max_batch = 64;
+    vec3f directions[max_batch];
+    float footprint = GetFootprint((hitpoint - starting_point).norm());
+    float spread = std::max(cone_spread, diffuse_cone_spread);
+    rays.reserve(rays.size() + count);
+    for (unsigned first = 0; first < count; first += max_batch) {
+        unsigned batch = std::min(count - first, max_batch);
+        SampleCosineHemisphere(normal, batch, directions);
+        for (unsigned i = 0; i < batch; i++) {
+            rays.push_back(Ray(directions[i], hitpoint + (directions[i] * eps), cur_refractive_index, current_recursion_depth + 1, UnitDirection()));
+            rays.back().SetCone(footprint, spread);
+        }
+    }
+}
 
-    Ray diffused_ray(new_direction, hitpoint + (new_direction * eps2), cur_refractive_index, current_recursion_depth + 1);
+void BuildOrthonormalBasis(const vec3f& normal, vec3f& tangent, vec3f& bitangent) {
+    float sign = std::copysign(1.0f, normal.z);
+    float a = -1.0f / (sign + normal.z);
+    float b = normal.x * normal.y * a;
+    tangent = vec3f(1.0f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x);
+    bitangent = vec3f(b, sign + normal.y * normal.y * a, -normal.y);
+}
 
-    return diffused_ray;
-}
\ No newline at end of file
+//the uniform numbers come from this thread's generator, the kernel for the CPU maps them to directions
+void SampleCosineHemisphere(const vec3f& normal, unsigned count, vec3f* directions) {
+    const float two_pi = 6.28318531f;
+    const unsigned max_batch = 64;
+    vec3f basis[3];
+    BuildOrthonormalBasis(normal, basis[0], basis[1]);
+    basis[2] = normal;
+    const Kernels& kernels = GetKernels();
+    for (unsigned first = 0; first < count; first += max_batch) {
+        unsigned batch = std::min(count - first, max_batch);
+        float radius_squared[max_batch], angle[max_batch];
+        for (unsigned i = 0; i < batch; i++) {
+            radius_squared[i] = NextUniform();
+            angle[i] = NextUniform() * two_pi;
+        }
+        kernels.sample_cosine_hemisphere(basis, batch, radius_squared, angle, directions + first);
+    }
+}
@@ -1,26 +1,77 @@
 #ifndef RAY_H
 #define RAY_H
 
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
 #include "geometry.h"
+#include "allocator.h"
 
 constexpr float PI = 3.1415;
 
-class Ray {
-    vec3f direction;
+//components clamped away from zero keep 0 * inf out of the slab test
+inline vec3f SafeInverse(const vec3f& direction) {
+    float min_component = 1e-20f;
+    return vec3f(1.0f / (fabs(direction.x) > min_component ? direction.x : min_component),
+                 1.0f / (fabs(direction.y) > min_component ? direction.y : min_component),
+                 1.0f / (fabs(direction.z) > min_component ? direction.z : min_component));
+}
+
+//tag for the constructor when the caller guarantees a direction of unit length (reflected, refracted and sampled
+//directions), so that it is not normalized again
+struct UnitDirection {};
+
+class Ray;
+//std::allocator ignores the alignment of Ray before C++17
+typedef std::vector<Ray, AlignedAllocator<Ray, 32>> RayVector;
+
+//_______64 bytes, two rays to a cache line: everything a slab test needs is computed once at construction_______
+
+class alignas(32) Ray {
     vec3f starting_point;
+    float tmin = 0.0f;                  //hits are searched for within [tmin, tmax] along the direction
+    vec3f direction;                    //unit length
+    float tmax = std::numeric_limits<float>::max();
+    vec3f inv_direction;                //SafeInverse of the direction
+    uint8_t sign_bits;                  //bit i set when the direction is negative along axis i
+    uint16_t current_recursion_depth;
     float cur_refractive_index;
-    unsigned current_recursion_depth;
+    float cone_width = 0.0f;            //ray cone: footprint width at the origin and its growth per unit of distance
+    float cone_spread = 0.0f;
     static unsigned max_recursion_depth;
+    static float diffuse_cone_spread;
+    void Precompute();
 public:
     Ray(const vec3f& in_direction, const vec3f& in_starting_point, float refractive_index, unsigned recursion_depth);
+    Ray(const vec3f& in_direction, const vec3f& in_starting_point, float refractive_index, unsigned recursion_depth, UnitDirection);
     vec3f GetDirection() const { return direction; };
     vec3f GetStartingPoint() const { return starting_point; };
+    vec3f GetInverseDirection() const { return inv_direction; };
+    unsigned GetSignBits() const { return sign_bits; };
+    bool IsNegative(unsigned axis) const { return (sign_bits >> axis) & 1; };
+    float GetTMin() const { return tmin; };
+    float GetTMax() const { return tmax; };
+    void SetInterval(float in_tmin, float in_tmax) { tmin = in_tmin; tmax = in_tmax; };
     float GetRefrectiveIndex() const { return cur_refractive_index; };
     unsigned GetCurRecursionDepth() const { return current_recursion_depth; };
     unsigned GetMaxRecursionDepth() const { return max_recursion_depth; };
+    void SetCone(float width, float spread) { cone_width = width; cone_spread = spread; };
+    float GetConeWidth() const { return cone_width; };
+    float GetConeSpread() const { return cone_spread; };
+    float GetFootprint(float distance) const { return cone_width + cone_spread * distance; };   //width of the cone at the distance
     Ray Reflect(const vec3f& hit_point, const vec3f& normal) const;                             //casual relection
     Ray Refract(const vec3f& hit_point, const vec3f& normal, float new_refractive_index) const; //snell's law
-    Ray Diffuse(const vec3f& hit_point, const vec3f& normal) const;
+    Ray Diffuse(const vec3f& hit_point, const vec3f& normal) const;                             //one cosine-weighted direction
+    void DiffuseFan(const vec3f& hit_point, const vec3f& normal, unsigned count, RayVector& rays) const; //count of them at once
 };
 
-#endif
\ No newline at end of file
+static_assert(sizeof(Ray) == 64, "Ray must stay 64 bytes");
+
+//tangent and bitangent completing a unit normal to an orthonormal basis, without branches (Duff et al. 2017)
+void BuildOrthonormalBasis(const vec3f& normal, vec3f& tangent, vec3f& bitangent);
+
+//count directions distributed by the cosine to the normal over its hemisphere, generated a SIMD register at a time
+void SampleCosineHemisphere(const vec3f& normal, unsigned count, vec3f* directions);
+
+#endif
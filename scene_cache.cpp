@@ -0,0 +1,406 @@
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+#include <type_traits>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "scene_cache.h"
+
+namespace {
+
+const char cache_magic[8] = { 'R', 'T', 'S', 'C', 'A', 'C', 'H', 'E' };
+const uint32_t byte_order_tag = 0x01020304;
+const uint32_t no_material = 0xffffffff;
+const uint64_t blob_alignment = 64;     //wide BVH nodes are cache-line aligned
+
+enum MaterialType : uint32_t {
+    MATERIAL_EMISSIVE,
+    MATERIAL_DIELECTRIC,
+    MATERIAL_DIFFUSE
+};
+
+enum ObjectType : uint32_t {
+    OBJECT_SPHERE,
+    OBJECT_CILINDER,
+    OBJECT_POLYGONAL,
+    OBJECT_INSTANCE
+};
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t polygon_size;
+    uint32_t material_count;
+    uint32_t object_count;
+    uint32_t mesh_count;
+    uint64_t materials_offset;
+    uint64_t objects_offset;
+    uint64_t meshes_offset;
+    uint64_t file_size;
+};
+
+struct MaterialRecord {
+    uint32_t type;
+    float parameters[3];
+};
+
+struct ObjectRecord {
+    uint32_t type;
+    uint32_t material;
+    uint32_t reference;     //mesh of a polygonal object, prototype object of an instance
+    uint32_t in_scene;
+    float parameters[12];   //sphere: center, radius; cilinder: center, radius, height, axis; instance: 3x4 transform
+};
+
+struct MeshRecord {
+    uint64_t polygons_offset;
+    uint64_t lanes_offset;      //the coordinates of TriangleLanes, 9 arrays of lane_stride floats
+    uint64_t nodes_offset;
+    uint64_t polygon_count;
+    uint64_t lane_stride;
+    uint64_t node_count;
+    uint32_t width;
+    uint32_t quantization_bits;
+    uint32_t node_size;
+    uint32_t padding;
+    float bounds_min[3];
+    float bounds_max[3];
+};
+
+static_assert(std::is_trivially_copyable<Polygon>::value, "polygons are stored and mapped as raw bytes");
+
+uint64_t AlignOffset(uint64_t offset) {
+    return (offset + blob_alignment - 1) / blob_alignment * blob_alignment;
+}
+
+//orders the objects so that every prototype is written before its instances
+void CollectObject(const Object* object, bool in_scene, std::vector<const Object*>& order, std::vector<uint32_t>& in_scene_flags,
+                   std::unordered_map<const Object*, uint32_t>& object_index) {
+    auto found = object_index.find(object);
+    if (found != object_index.end()) {
+        in_scene_flags[found -> second] |= in_scene;
+        return;
+    }
+    const Instance* instance = dynamic_cast<const Instance*>(object);
+    if (instance != nullptr)
+        CollectObject(instance -> GetPrototype(), false, order, in_scene_flags, object_index);
+    object_index[object] = uint32_t(order.size());
+    order.push_back(object);
+    in_scene_flags.push_back(in_scene);
+}
+
+}
+
+bool SceneCache::Save(const std::string& path, const std::vector<Object*>& scene_objects) {
+    std::vector<const Object*> order;
+    std::vector<uint32_t> in_scene_flags;
+    std::unordered_map<const Object*, uint32_t> object_index;
+    for (size_t i = 0; i < scene_objects.size(); i++)
+        CollectObject(scene_objects[i], true, order, in_scene_flags, object_index);
+
+    std::vector<MaterialRecord> material_records;
+    std::unordered_map<const Material*, uint32_t> material_index;
+    std::vector<ObjectRecord> object_records;
+    std::vector<const PolygonalObject*> meshes;
+    for (size_t i = 0; i < order.size(); i++) {
+        ObjectRecord record;
+        memset(&record, 0, sizeof(record));
+        record.in_scene = in_scene_flags[i];
+        record.material = no_material;
+        const Material* material = order[i] -> GetMaterial();
+        if (material != nullptr) {
+            auto found = material_index.find(material);
+            if (found == material_index.end()) {
+                MaterialRecord material_record;
+                memset(&material_record, 0, sizeof(material_record));
+                if (const EmissiveMaterial* emissive = dynamic_cast<const EmissiveMaterial*>(material)) {
+                    vec3f colour = emissive -> GetColour();
+                    material_record.type = MATERIAL_EMISSIVE;
+                    material_record.parameters[0] = colour.x;
+                    material_record.parameters[1] = colour.y;
+                    material_record.parameters[2] = colour.z;
+                } else if (const DielectricMaterial* dielectric = dynamic_cast<const DielectricMaterial*>(material)) {
+                    material_record.type = MATERIAL_DIELECTRIC;
+                    material_record.parameters[0] = dielectric -> GetInnerRefractiveIndex();
+                    material_record.parameters[1] = dielectric -> GetOuterRefractiveIndex();
+                } else if (const DiffuseMaterial* diffuse = dynamic_cast<const DiffuseMaterial*>(material)) {
+                    vec3f spectre = diffuse -> GetAbsorbationSpectre();
+                    material_record.type = MATERIAL_DIFFUSE;
+                    material_record.parameters[0] = spectre.x;
+                    material_record.parameters[1] = spectre.y;
+                    material_record.parameters[2] = spectre.z;
+                } else {
+                    std::cerr << "Scene cache: unsupported material type" << std::endl;
+                    return false;
+                }
+                found = material_index.insert(std::make_pair(material, uint32_t(material_records.size()))).first;
+                material_records.push_back(material_record);
+            }
+            record.material = found -> second;
+        }
+
+        if (const Sphere* sphere = dynamic_cast<const Sphere*>(order[i])) {
+            vec3f center = sphere -> GetCenter();
+            record.type = OBJECT_SPHERE;
+            record.parameters[0] = center.x;
+            record.parameters[1] = center.y;
+            record.parameters[2] = center.z;
+            record.parameters[3] = sphere -> GetRadius();
+        } else if (const Cilinder* cilinder = dynamic_cast<const Cilinder*>(order[i])) {
+            vec3f center = cilinder -> GetCenter();
+            record.type = OBJECT_CILINDER;
+            record.parameters[0] = center.x;
+            record.parameters[1] = center.y;
+            record.parameters[2] = center.z;
+            record.parameters[3] = cilinder -> GetRadius();
+            record.parameters[4] = cilinder -> GetHeight();
+            vec3f axis = cilinder -> GetAxis();
+            record.parameters[5] = axis.x;
+            record.parameters[6] = axis.y;
+            record.parameters[7] = axis.z;
+        } else if (const PolygonalObject* polygonal = dynamic_cast<const PolygonalObject*>(order[i])) {
+            record.type = OBJECT_POLYGONAL;
+            record.reference = uint32_t(meshes.size());
+            meshes.push_back(polygonal);
+        } else if (const Instance* instance = dynamic_cast<const Instance*>(order[i])) {
+            mat3x4f transform = instance -> GetTransform();
+            record.type = OBJECT_INSTANCE;
+            record.reference = object_index[instance -> GetPrototype()];
+            for (unsigned row = 0; row < 3; row++)
+                for (unsigned column = 0; column < 4; column++)
+                    record.parameters[row * 4 + column] = transform[row][column];
+        } else {
+            std::cerr << "Scene cache: unsupported object type" << std::endl;
+            return false;
+        }
+        object_records.push_back(record);
+    }
+
+    //records first, then every mesh's polygons, lanes and nodes at aligned offsets
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version = version;
+    header.byte_order = byte_order_tag;
+    header.polygon_size = sizeof(Polygon);
+    header.material_count = uint32_t(material_records.size());
+    header.object_count = uint32_t(object_records.size());
+    header.mesh_count = uint32_t(meshes.size());
+    header.materials_offset = AlignOffset(sizeof(CacheHeader));
+    header.objects_offset = AlignOffset(header.materials_offset + material_records.size() * sizeof(MaterialRecord));
+    header.meshes_offset = AlignOffset(header.objects_offset + object_records.size() * sizeof(ObjectRecord));
+    uint64_t offset = AlignOffset(header.meshes_offset + meshes.size() * sizeof(MeshRecord));
+    std::vector<MeshRecord> mesh_records(meshes.size());
+    std::vector<BVHImage> images(meshes.size());
+    for (size_t i = 0; i < meshes.size(); i++) {
+        MeshRecord& record = mesh_records[i];
+        memset(&record, 0, sizeof(record));
+        images[i] = meshes[i] -> GetBVH().GetImage();
+        record.polygon_count = meshes[i] -> GetPolygonCount();
+        record.polygons_offset = offset;
+        offset = AlignOffset(offset + record.polygon_count * sizeof(Polygon));
+        record.lane_stride = TriangleLanes::GetStride(record.polygon_count);
+        record.lanes_offset = offset;
+        offset = AlignOffset(offset + 9 * record.lane_stride * sizeof(float));
+        record.node_count = images[i].node_count;
+        record.nodes_offset = offset;
+        offset = AlignOffset(offset + record.node_count * images[i].node_size);
+        record.width = images[i].width;
+        record.quantization_bits = images[i].quantization_bits;
+        record.node_size = uint32_t(images[i].node_size);
+        for (unsigned axis = 0; axis < 3; axis++) {
+            record.bounds_min[axis] = images[i].bounds.min[axis];
+            record.bounds_max[axis] = images[i].bounds.max[axis];
+        }
+    }
+    header.file_size = offset;
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        std::cerr << "Scene cache: cannot write " << path << std::endl;
+        return false;
+    }
+    const char zeros[blob_alignment] = {};
+    auto write_at = [&file, &zeros](uint64_t position, const void* bytes, uint64_t byte_count) {
+        uint64_t current = uint64_t(file.tellp());
+        file.write(zeros, std::streamsize(position - current));
+        file.write(static_cast<const char*>(bytes), std::streamsize(byte_count));
+    };
+    write_at(0, &header, sizeof(header));
+    write_at(header.materials_offset, material_records.data(), material_records.size() * sizeof(MaterialRecord));
+    write_at(header.objects_offset, object_records.data(), object_records.size() * sizeof(ObjectRecord));
+    write_at(header.meshes_offset, mesh_records.data(), mesh_records.size() * sizeof(MeshRecord));
+    for (size_t i = 0; i < meshes.size(); i++) {
+        write_at(mesh_records[i].polygons_offset, meshes[i] -> GetPolygons(), mesh_records[i].polygon_count * sizeof(Polygon));
+        //laid out again from the polygons, quantized meshes are stored decoded
+        TriangleLanes lanes;
+        lanes.Build(meshes[i] -> GetPolygons(), mesh_records[i].polygon_count);
+        write_at(mesh_records[i].lanes_offset, lanes.coordinates.data(), lanes.coordinates.size() * sizeof(float));
+        write_at(mesh_records[i].nodes_offset, images[i].nodes, mesh_records[i].node_count * images[i].node_size);
+    }
+    write_at(header.file_size, nullptr, 0);
+    return bool(file);
+}
+
+bool SceneCache::Map(const std::string& path) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER file_size;
+    HANDLE mapping = nullptr;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    void* view = mapping != nullptr ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (view == nullptr) {
+        if (mapping != nullptr)
+            CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    file_handle = file;
+    mapping_handle = mapping;
+    data = static_cast<const char*>(view);
+    size = size_t(file_size.QuadPart);
+#else
+    int file = open(path.c_str(), O_RDONLY);
+    if (file < 0)
+        return false;
+    struct stat file_stat;
+    void* view = MAP_FAILED;
+    if (fstat(file, &file_stat) == 0 && file_stat.st_size > 0)
+        view = mmap(nullptr, size_t(file_stat.st_size), PROT_READ, MAP_SHARED, file, 0);
+    close(file);
+    if (view == MAP_FAILED)
+        return false;
+    data = static_cast<const char*>(view);
+    size = size_t(file_stat.st_size);
+#endif
+    return true;
+}
+
+void SceneCache::Unmap() {
+    scene_objects.clear();
+    objects.clear();
+    materials.clear();
+    if (data == nullptr)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+    CloseHandle(mapping_handle);
+    CloseHandle(file_handle);
+    mapping_handle = nullptr;
+    file_handle = nullptr;
+#else
+    munmap(const_cast<char*>(data), size);
+#endif
+    data = nullptr;
+    size = 0;
+}
+
+bool SceneCache::Load(const std::string& path) {
+    Unmap();
+    if (!Map(path)) {
+        std::cerr << "Scene cache: cannot map " << path << std::endl;
+        return false;
+    }
+    CacheHeader header;
+    bool valid = size >= sizeof(header);
+    if (valid) {
+        memcpy(&header, data, sizeof(header));
+        valid = memcmp(header.magic, cache_magic, sizeof(cache_magic)) == 0 && header.version == version &&
+                header.byte_order == byte_order_tag && header.polygon_size == sizeof(Polygon) && header.file_size == size &&
+                header.materials_offset + uint64_t(header.material_count) * sizeof(MaterialRecord) <= size &&
+                header.objects_offset + uint64_t(header.object_count) * sizeof(ObjectRecord) <= size &&
+                header.meshes_offset + uint64_t(header.mesh_count) * sizeof(MeshRecord) <= size;
+    }
+    if (!valid) {
+        std::cerr << "Scene cache: " << path << " is not a compatible cache (version " << version << ")" << std::endl;
+        Unmap();
+        return false;
+    }
+    const MaterialRecord* material_records = reinterpret_cast<const MaterialRecord*>(data + header.materials_offset);
+    const ObjectRecord* object_records = reinterpret_cast<const ObjectRecord*>(data + header.objects_offset);
+    const MeshRecord* mesh_records = reinterpret_cast<const MeshRecord*>(data + header.meshes_offset);
+
+    for (uint32_t i = 0; i < header.material_count; i++) {
+        const MaterialRecord& record = material_records[i];
+        vec3f parameters(record.parameters[0], record.parameters[1], record.parameters[2]);
+        if (record.type == MATERIAL_EMISSIVE)
+            materials.emplace_back(new EmissiveMaterial(parameters));
+        else if (record.type == MATERIAL_DIELECTRIC)
+            materials.emplace_back(new DielectricMaterial(parameters.x, parameters.y));
+        else if (record.type == MATERIAL_DIFFUSE)
+            materials.emplace_back(new DiffuseMaterial(parameters));
+        else {
+            valid = false;
+            break;
+        }
+    }
+
+    for (uint32_t i = 0; valid && i < header.object_count; i++) {
+        const ObjectRecord& record = object_records[i];
+        //only an instance may go without a material of its own, it takes the one of its prototype
+        if (record.material >= materials.size() && (record.material != no_material || record.type != OBJECT_INSTANCE)) {
+            valid = false;
+            break;
+        }
+        Material* material = record.material < materials.size() ? materials[record.material].get() : nullptr;
+        const float* parameters = record.parameters;
+        vec3f center(parameters[0], parameters[1], parameters[2]);
+        if (record.type == OBJECT_SPHERE) {
+            objects.emplace_back(new Sphere(material, center, parameters[3]));
+        } else if (record.type == OBJECT_CILINDER) {
+            objects.emplace_back(new Cilinder(material, center, parameters[3], parameters[4], vec3f(parameters[5], parameters[6], parameters[7])));
+        } else if (record.type == OBJECT_POLYGONAL && record.reference < header.mesh_count) {
+            const MeshRecord& mesh = mesh_records[record.reference];
+            if (mesh.polygons_offset + mesh.polygon_count * sizeof(Polygon) > size || mesh.nodes_offset + mesh.node_count * mesh.node_size > size ||
+                mesh.lane_stride != TriangleLanes::GetStride(mesh.polygon_count) || mesh.lanes_offset + 9 * mesh.lane_stride * sizeof(float) > size ||
+                mesh.lanes_offset % blob_alignment != 0 || mesh.node_size != BVH::GetNodeSize(mesh.width, mesh.quantization_bits)) {
+                valid = false;
+                break;
+            }
+            BVHImage image;
+            image.width = mesh.width;
+            image.quantization_bits = mesh.quantization_bits;
+            image.bounds = AABB(vec3f(mesh.bounds_min[0], mesh.bounds_min[1], mesh.bounds_min[2]), vec3f(mesh.bounds_max[0], mesh.bounds_max[1], mesh.bounds_max[2]));
+            image.nodes = data + mesh.nodes_offset;
+            image.node_count = mesh.node_count;
+            image.node_size = mesh.node_size;
+            objects.emplace_back(new PolygonalObject(material, reinterpret_cast<const Polygon*>(data + mesh.polygons_offset), mesh.polygon_count,
+                                                     reinterpret_cast<const float*>(data + mesh.lanes_offset), image));
+        } else if (record.type == OBJECT_INSTANCE && record.reference < i) {
+            mat3x4f transform;
+            for (unsigned row = 0; row < 3; row++)
+                for (unsigned column = 0; column < 4; column++)
+                    transform[row][column] = parameters[row * 4 + column];
+            objects.emplace_back(new Instance(objects[record.reference].get(), transform, material));
+        } else {
+            valid = false;
+            break;
+        }
+        if (record.in_scene)
+            scene_objects.push_back(objects.back().get());
+    }
+    if (!valid) {
+        std::cerr << "Scene cache: " << path << " is damaged" << std::endl;
+        Unmap();
+        return false;
+    }
+    return true;
+}
+
+void SceneCache::AddToScene(Scene& scene) const {
+    for (size_t i = 0; i < scene_objects.size(); i++)
+        scene.AddObject(scene_objects[i]);
+}
@@ -0,0 +1,40 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include "objects.h"
+
+//_______binary scene cache: materials, objects and meshes with their built BVHs_______
+//the file holds only offsets from its start, so it is mapped read-only and the polygons, triangle lanes and BVH nodes
+//of the meshes are used in place; render processes loading the same cache share its pages through the page cache
+
+class SceneCache {
+    const char* data = nullptr;     //the mapped file
+    size_t size = 0;
+#ifdef _WIN32
+    void* file_handle = nullptr;
+    void* mapping_handle = nullptr;
+#endif
+    std::vector<std::unique_ptr<Material>> materials;
+    std::vector<std::unique_ptr<Object>> objects;   //objects reference the materials and the mapped meshes
+    std::vector<Object*> scene_objects;
+    bool Map(const std::string& path);
+    void Unmap();
+public:
+    static const uint32_t version = 3;
+    SceneCache() {}
+    SceneCache(const SceneCache&) = delete;
+    SceneCache& operator=(const SceneCache&) = delete;
+    ~SceneCache() { Unmap(); }
+    //writes the objects together with their materials and the prototypes of instances (which are not put back into
+    //the scene on loading); polygonal objects are stored with their built BVH, lazy ones are built first
+    static bool Save(const std::string& path, const std::vector<Object*>& objects);
+    //maps the file and recreates the objects; fails on other versions and on files written with another memory layout
+    bool Load(const std::string& path);
+    const std::vector<Object*>& GetObjects() const { return scene_objects; }
+    void AddToScene(Scene& scene) const;
+};
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef VERTEX_FORMAT_H
+#define VERTEX_FORMAT_H
+
+#include <cmath>
+#include <cstdint>
+#include "geometry.h"
+
+//_______storage of the vertex data of polygonal objects_______
+//VERTEX_QUANTIZED keeps every position as three 16-bit steps over the object's bounding box (within half a step,
+//extent / 131070, of the original) and every normal octahedral-encoded in two 16-bit numbers: 22 bytes a triangle
+//instead of the 84 of the polygons and their float lanes, decoded on the fly by the triangle kernel
+
+enum VertexFormat {
+    VERTEX_FLOAT,
+    VERTEX_QUANTIZED
+};
+
+//the unit vector projected onto the octahedron |x| + |y| + |z| = 1, whose lower half is folded over the upper one
+inline uint32_t EncodeOctahedral(const vec3f& normal) {
+    float sum = std::fabs(normal.x) + std::fabs(normal.y) + std::fabs(normal.z);
+    float x = sum > 0.0f ? normal.x / sum : 0.0f;
+    float y = sum > 0.0f ? normal.y / sum : 0.0f;
+    if (normal.z < 0.0f) {
+        float folded_x = (1.0f - std::fabs(y)) * (x < 0.0f ? -1.0f : 1.0f);
+        y = (1.0f - std::fabs(x)) * (y < 0.0f ? -1.0f : 1.0f);
+        x = folded_x;
+    }
+    int16_t code_x = int16_t(std::lround(std::fmin(std::fmax(x, -1.0f), 1.0f) * 32767.0f));
+    int16_t code_y = int16_t(std::lround(std::fmin(std::fmax(y, -1.0f), 1.0f) * 32767.0f));
+    return uint32_t(uint16_t(code_x)) | uint32_t(uint16_t(code_y)) << 16;
+}
+
+inline vec3f DecodeOctahedral(uint32_t code) {
+    float x = float(int16_t(uint16_t(code & 0xffff))) * (1.0f / 32767.0f);
+    float y = float(int16_t(uint16_t(code >> 16))) * (1.0f / 32767.0f);
+    float z = 1.0f - std::fabs(x) - std::fabs(y);
+    if (z < 0.0f) {
+        float unfolded_x = (1.0f - std::fabs(y)) * (x < 0.0f ? -1.0f : 1.0f);
+        y = (1.0f - std::fabs(x)) * (y < 0.0f ? -1.0f : 1.0f);
+        x = unfolded_x;
+    }
+    return vec3f(x, y, z).normalize();
+}
+
+#endif
@@ -0,0 +1,268 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include "visibility.h"
+#include "parallel.h"
+
+namespace {
+
+const float near_distance = 1e-3f;             //points closer to the camera plane than this are not projected
+const float edge_tolerance = -1e-6f;           //barycentric slack, so that pixel centers on shared edges are not lost
+
+}
+
+const uint32_t VisibilityBuffer::no_object;
+const uint32_t VisibilityBuffer::no_primitive;
+
+Ray PinholeView::GetCenterRay(unsigned x, unsigned y) const {
+    vec3f pixel_coords(leftdown_screen_angle + (up * pixel_size * (y + 0.5f)) + (right * pixel_size * (x + 0.5f)));
+    Ray ray(pixel_coords - location, location, 1.0f, 0);
+    ray.SetCone(0.0f, pixel_size / screen_dist);
+    return ray;
+}
+
+//sets up the polygon for homogeneous rasterization: with r = (x, y, 1) the view space direction through a pixel,
+//r * (v_j x v_k) / det are the weights that combine r from the vertices, so the pixel sees the polygon in front of the
+//camera when all three are positive and their sum is 1 / z of the hit; no clipping is needed for vertices behind
+//the camera and the planes stay well conditioned for polygons that reach far off the screen
+void VisibilityBuffer::ProjectPolygon(const Polygon& polygon, uint32_t object, uint32_t primitive, std::vector<ScreenTriangle>& output) const {
+    vec3f world[3] = { polygon.GetFirstVertex() - view.location, polygon.GetSecondVertex() - view.location, polygon.GetThirdVertex() - view.location };
+    vec3f vertices[3];
+    unsigned behind = 0;
+    for (unsigned i = 0; i < 3; i++) {
+        vertices[i] = vec3f(world[i] * view.right, world[i] * view.up, world[i] * view.front);
+        behind += vertices[i].z < near_distance;
+    }
+    if (behind == 3)
+        return;
+    float scale = view.screen_dist / view.pixel_size;
+    ScreenTriangle triangle;
+    triangle.min_x = 0;
+    triangle.max_x = int(view.width) - 1;
+    triangle.min_y = 0;
+    triangle.max_y = int(view.height) - 1;
+    if (behind == 0) {  //otherwise the polygon reaches around the camera and is bounded by the screen alone
+        float min_x = std::numeric_limits<float>::max(), max_x = -std::numeric_limits<float>::max();
+        float min_y = std::numeric_limits<float>::max(), max_y = -std::numeric_limits<float>::max();
+        for (unsigned i = 0; i < 3; i++) {
+            float inverse_z = 1.0f / vertices[i].z;
+            float x = vertices[i].x * scale * inverse_z + screen_center.x;
+            float y = vertices[i].y * scale * inverse_z + screen_center.y;
+            min_x = std::min(min_x, x);
+            max_x = std::max(max_x, x);
+            min_y = std::min(min_y, y);
+            max_y = std::max(max_y, y);
+        }
+        //pixels whose centers x + 0.5 lie within the bounds, clamped to the screen before the conversion
+        triangle.min_x = int(std::max(0.0f, std::min(float(view.width), std::ceil(min_x - 0.5f))));
+        triangle.max_x = int(std::max(-1.0f, std::min(float(view.width) - 1.0f, std::floor(max_x - 0.5f))));
+        triangle.min_y = int(std::max(0.0f, std::min(float(view.height), std::ceil(min_y - 0.5f))));
+        triangle.max_y = int(std::max(-1.0f, std::min(float(view.height) - 1.0f, std::floor(max_y - 0.5f))));
+        if (triangle.min_x > triangle.max_x || triangle.min_y > triangle.max_y)
+            return;     //small polygons between the pixel centers
+    }
+    float det = vertices[0] * cross(vertices[1], vertices[2]);
+    if (fabs(det) < 1e-30f)     //the plane of the polygon passes through the camera
+        return;
+    triangle.depth[0] = triangle.depth[1] = triangle.depth[2] = 0.0f;
+    for (unsigned i = 0; i < 3; i++) {
+        vec3f plane = cross(vertices[(i + 1) % 3], vertices[(i + 2) % 3]) * (1.0f / det);
+        //from view space directions to pixel coordinates: x = (pixel_x - center_x) / scale
+        triangle.edge[i][0] = plane.x / scale;
+        triangle.edge[i][1] = plane.y / scale;
+        triangle.edge[i][2] = plane.z - (plane.x * screen_center.x + plane.y * screen_center.y) / scale;
+        for (unsigned axis = 0; axis < 3; axis++)
+            triangle.depth[axis] += triangle.edge[i][axis];
+    }
+    triangle.object = object;
+    triangle.primitive = primitive;
+    output.push_back(triangle);
+}
+
+void VisibilityBuffer::RasterizeTriangle(const ScreenTriangle& triangle, int row_begin, int row_end) {
+    int y_begin = std::max(triangle.min_y, row_begin);
+    int y_end = std::min(triangle.max_y + 1, row_end);
+    for (int y = y_begin; y < y_end; y++) {
+        float center_y = y + 0.5f;
+        float row_edge[3];
+        for (unsigned i = 0; i < 3; i++)
+            row_edge[i] = triangle.edge[i][1] * center_y + triangle.edge[i][2];
+        float row_depth = triangle.depth[1] * center_y + triangle.depth[2];
+        size_t row = size_t(y) * stride;
+#ifdef BVH_USE_SSE
+        //four pixels at a time from an aligned column, the lanes outside the bounds are masked off
+        const __m128 lane_centers = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+        const __m128 first_center = _mm_set1_ps(triangle.min_x + 0.5f);
+        const __m128 last_center = _mm_set1_ps(triangle.max_x + 0.5f);
+        const __m128 tolerance = _mm_set1_ps(edge_tolerance);
+        for (int x = triangle.min_x & ~3; x <= triangle.max_x; x += 4) {
+            __m128 center_x = _mm_add_ps(_mm_set1_ps(float(x)), lane_centers);
+            __m128 depth = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(triangle.depth[0]), center_x), _mm_set1_ps(row_depth));
+            __m128 inside = _mm_and_ps(_mm_cmpge_ps(center_x, first_center), _mm_cmple_ps(center_x, last_center));
+            __m128 slack = _mm_mul_ps(tolerance, depth);
+            for (unsigned i = 0; i < 3; i++) {
+                __m128 weight = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(triangle.edge[i][0]), center_x), _mm_set1_ps(row_edge[i]));
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(weight, slack));
+            }
+            float* stored_depth = &inverse_depth[row + x];
+            __m128 stored = _mm_load_ps(stored_depth);
+            __m128 closer = _mm_and_ps(inside, _mm_cmpgt_ps(depth, stored));
+            unsigned mask = unsigned(_mm_movemask_ps(closer));
+            if (mask == 0)
+                continue;
+            _mm_store_ps(stored_depth, _mm_or_ps(_mm_and_ps(closer, depth), _mm_andnot_ps(closer, stored)));
+            while (mask != 0) {
+                unsigned lane = LowestBit(mask);
+                mask &= mask - 1;
+                object_ids[row + x + lane] = triangle.object;
+                primitive_ids[row + x + lane] = triangle.primitive;
+            }
+        }
+#else
+        for (int x = triangle.min_x; x <= triangle.max_x; x++) {
+            float center_x = x + 0.5f;
+            float depth = triangle.depth[0] * center_x + row_depth;
+            bool inside = true;
+            for (unsigned i = 0; i < 3; i++)
+                inside = inside && triangle.edge[i][0] * center_x + row_edge[i] >= edge_tolerance * depth;
+            if (inside && depth > inverse_depth[row + x]) {
+                inverse_depth[row + x] = depth;
+                object_ids[row + x] = triangle.object;
+                primitive_ids[row + x] = triangle.primitive;
+            }
+        }
+#endif
+    }
+}
+
+//traces the pixel centers within the screen rectangle of the object's bounds against the object alone
+void VisibilityBuffer::ResolveObject(uint32_t object, int row_begin, int row_end) {
+    AABB bounds = objects[object] -> GetBounds();
+    if (bounds.Empty())
+        return;
+    int min_x = 0, max_x = int(view.width) - 1, min_y = 0, max_y = int(view.height) - 1;
+    float scale = view.screen_dist / view.pixel_size;
+    float corner_min_x = std::numeric_limits<float>::max(), corner_max_x = -std::numeric_limits<float>::max();
+    float corner_min_y = std::numeric_limits<float>::max(), corner_max_y = -std::numeric_limits<float>::max();
+    unsigned behind = 0;
+    float min_z = std::numeric_limits<float>::max();
+    for (unsigned corner = 0; corner < 8; corner++) {
+        vec3f point((corner & 1) ? bounds.max.x : bounds.min.x, (corner & 2) ? bounds.max.y : bounds.min.y, (corner & 4) ? bounds.max.z : bounds.min.z);
+        point = point - view.location;
+        float z = point * view.front;
+        min_z = std::min(min_z, z);
+        if (z < near_distance) {
+            behind++;
+            continue;
+        }
+        float x = (point * view.right) * scale / z + screen_center.x;
+        float y = (point * view.up) * scale / z + screen_center.y;
+        corner_min_x = std::min(corner_min_x, x);
+        corner_max_x = std::max(corner_max_x, x);
+        corner_min_y = std::min(corner_min_y, y);
+        corner_max_y = std::max(corner_max_y, y);
+    }
+    if (behind == 8)
+        return;
+    if (behind == 0) {  //otherwise the bounds reach around the camera and may cover any pixel
+        min_x = int(std::max(float(min_x), std::ceil(corner_min_x - 0.5f)));
+        max_x = int(std::min(float(max_x), std::floor(corner_max_x - 0.5f)));
+        min_y = int(std::max(float(min_y), std::ceil(corner_min_y - 0.5f)));
+        max_y = int(std::min(float(max_y), std::floor(corner_max_y - 0.5f)));
+    }
+    min_y = std::max(min_y, row_begin);
+    max_y = std::min(max_y, row_end - 1);
+    //pixels that already see something in front of the whole bounds are skipped
+    float max_inverse_depth = min_z > 0.0f ? 1.0f / min_z : std::numeric_limits<float>::max();
+    FirstHit hit;
+    for (int y = min_y; y <= max_y; y++) {
+        for (int x = min_x; x <= max_x; x++) {
+            if (inverse_depth[size_t(y) * stride + x] >= max_inverse_depth)
+                continue;
+            Ray ray = view.GetCenterRay(x, y);
+            if (!objects[object] -> Hitted(ray, hit.hitpoint, hit.normal, hit.side))
+                continue;
+            float z = (hit.hitpoint - view.location) * view.front;
+            size_t pixel = size_t(y) * stride + x;
+            if (z > 0.0f && 1.0f / z > inverse_depth[pixel]) {
+                inverse_depth[pixel] = 1.0f / z;
+                object_ids[pixel] = object;
+                primitive_ids[pixel] = no_primitive;
+                hits[pixel] = hit;
+            }
+        }
+    }
+}
+
+void VisibilityBuffer::Build(const Scene& scene, const PinholeView& in_view) {
+    view = in_view;
+    vec3f screen_offset = view.location + view.front * view.screen_dist - view.leftdown_screen_angle;
+    screen_center = vec2f((screen_offset * view.right) / view.pixel_size, (screen_offset * view.up) / view.pixel_size);
+    stride = (view.width + 3) & ~3u;
+    size_t pixel_count = size_t(stride) * view.height;
+    inverse_depth.assign(pixel_count, 0.0f);
+    object_ids.assign(pixel_count, no_object);
+    primitive_ids.assign(pixel_count, no_primitive);
+    hits.resize(pixel_count);
+
+    std::vector<Object*> scene_objects = scene.GetObjects();
+    objects.assign(scene_objects.begin(), scene_objects.end());
+    object_polygons.assign(objects.size(), nullptr);
+    triangles.clear();
+    std::vector<uint32_t> analytic_objects;
+    for (uint32_t i = 0; i < objects.size(); i++) {
+        const PolygonalObject* polygonal = dynamic_cast<const PolygonalObject*>(objects[i]);
+        if (polygonal == nullptr) {
+            analytic_objects.push_back(i);
+            continue;
+        }
+        //always the full mesh: camera rays see it unless LODOptions::full_detail_primary is turned off
+        const Polygon* polygons = polygonal -> GetPolygons();
+        object_polygons[i] = polygons;
+        for (size_t j = 0; j < polygonal -> GetPolygonCount(); j++)
+            ProjectPolygon(polygons[j], i, uint32_t(j), triangles);
+    }
+
+    //every thread owns a band of rows, so the buffers are written without synchronization
+    ParallelForChunks(0, view.height, GetThreadCount(), [&](unsigned, size_t band_begin, size_t band_end) {
+        int row_begin = int(band_begin), row_end = int(band_end);
+        for (size_t i = 0; i < triangles.size(); i++)
+            if (triangles[i].max_y >= row_begin && triangles[i].min_y < row_end)
+                RasterizeTriangle(triangles[i], row_begin, row_end);
+        for (size_t i = 0; i < analytic_objects.size(); i++)
+            ResolveObject(analytic_objects[i], row_begin, row_end);
+        //exact hits of the visible triangles; a pixel whose ray misses its triangle after all is left to the ray tracer
+        for (int y = row_begin; y < row_end; y++) {
+            for (unsigned x = 0; x < view.width; x++) {
+                size_t pixel = size_t(y) * stride + x;
+                if (primitive_ids[pixel] == no_primitive)
+                    continue;
+                FirstHit& hit = hits[pixel];
+                if (!object_polygons[object_ids[pixel]][primitive_ids[pixel]].Hitted(view.GetCenterRay(x, y), hit.hitpoint, hit.normal, hit.side)) {
+                    object_ids[pixel] = no_object;
+                    primitive_ids[pixel] = no_primitive;
+                }
+            }
+        }
+    });
+}
+
+vec3f VisibilityBuffer::Shade(unsigned x, unsigned y, const Scene& scene) const {
+    Ray ray = view.GetCenterRay(x, y);
+    size_t pixel = size_t(y) * stride + x;
+    if (object_ids[pixel] == no_object)
+        return scene.Intersect(ray);
+    const FirstHit& hit = hits[pixel];
+    return objects[object_ids[pixel]] -> GetRayColour(ray, hit.hitpoint, hit.normal, hit.side, scene);
+}
+
+const Object* VisibilityBuffer::GetObject(unsigned x, unsigned y) const {
+    uint32_t object = object_ids[size_t(y) * stride + x];
+    return object == no_object ? nullptr : objects[object];
+}
+
+float VisibilityBuffer::GetDepth(unsigned x, unsigned y) const {
+    float depth = inverse_depth[size_t(y) * stride + x];
+    return depth > 0.0f ? 1.0f / depth : 0.0f;
+}
@@ -0,0 +1,72 @@
+#ifndef VISIBILITY_H
+#define VISIBILITY_H
+
+#include <vector>
+#include <cstdint>
+#include "geometry.h"
+#include "ray.h"
+#include "allocator.h"
+#include "objects.h"
+
+//_______pinhole projection of a camera, shared by the camera rays and the rasterizer_______
+
+struct PinholeView {
+    vec3f location;
+    vec3f right;
+    vec3f up;
+    vec3f front;
+    vec3f leftdown_screen_angle;
+    float screen_dist;
+    float pixel_size;
+    unsigned width;
+    unsigned height;
+    Ray GetCenterRay(unsigned x, unsigned y) const;     //the camera ray through the center of the pixel
+};
+
+//_______first hits of the camera rays through the pixel centers_______
+//triangles of polygonal objects are rasterized into a z-buffer four pixels at a time, every other object (spheres,
+//cilinders, instances...) is resolved analytically by its own Hitted over the screen rectangle of its bounds; the
+//visible primitive of every pixel is then intersected once more to get the exact hit, so that every sample of the
+//pixel starts shading from it instead of tracing the camera ray through the scene
+
+class VisibilityBuffer {
+    struct ScreenTriangle {
+        float edge[3][3];       //a * x + b * y + c of the three edges, barycentric coordinates over z
+        float depth[3];         //1 / z as a plane in screen space
+        int min_x, max_x, min_y, max_y;
+        uint32_t object;
+        uint32_t primitive;
+    };
+    struct FirstHit {
+        vec3f hitpoint;
+        vec3f normal;
+        Side side;
+    };
+    PinholeView view;
+    vec2f screen_center;                //pixel coordinates of the point straight ahead
+    unsigned stride = 0;                //row length padded to four pixels
+    std::vector<float, AlignedAllocator<float, 16>> inverse_depth;     //1 / z of the nearest surface, 0 for the background
+    std::vector<uint32_t> object_ids;
+    std::vector<uint32_t> primitive_ids;
+    std::vector<FirstHit> hits;
+    std::vector<const Object*> objects;
+    std::vector<const Polygon*> object_polygons;                        //polygons of rasterized objects, nullptr for analytic ones
+    std::vector<ScreenTriangle> triangles;
+    void ProjectPolygon(const Polygon& polygon, uint32_t object, uint32_t primitive, std::vector<ScreenTriangle>& output) const;
+    void RasterizeTriangle(const ScreenTriangle& triangle, int row_begin, int row_end);
+    void ResolveObject(uint32_t object, int row_begin, int row_end);
+public:
+    static const uint32_t no_object = ~0u;
+    static const uint32_t no_primitive = ~0u;
+    //rasterizes the objects of the scene and resolves the first hit of every pixel; call again after the scene or the camera moved
+    void Build(const Scene& scene, const PinholeView& in_view);
+    //colour of the camera ray through the pixel center, shaded from the stored first hit; pixels where the rasterizer
+    //and the ray tracer disagree (and the background) are traced through the scene as usual
+    vec3f Shade(unsigned x, unsigned y, const Scene& scene) const;
+    //the object seen through the pixel center, nullptr for the background or when it is left to the ray tracer
+    const Object* GetObject(unsigned x, unsigned y) const;
+    //distance along the viewing direction to the first hit, 0 for the background
+    float GetDepth(unsigned x, unsigned y) const;
+};
+
+#endif